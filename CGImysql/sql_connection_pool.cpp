@@ -8,15 +8,47 @@
 #include <string>
 #include <stdlib.h>
 #include <list>
+#include <vector>
+#include <time.h>
+#include <pthread.h>
 
 #include "sql_connection_pool.h"
 
 using namespace std;
 
+// 线程固定持有的连接，线程退出时析构，把连接还给连接池
+struct pinned_connection
+{
+  connection_pool* pool;
+  MYSQL* conn;
+
+  pinned_connection(): pool(NULL), conn(NULL) {}
+  ~pinned_connection()
+  {
+    if(conn)
+      pool->unpin(conn);
+  }
+};
+
+static thread_local pinned_connection pinned;
+
+static long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
 connection_pool::connection_pool()
 {
   this->curConn = 0;
   this->freeConn = 0;
+  this->maxConn = 0;
+  this->maxPinned = 0;
+  this->pinnedConn = 0;
+  m_acquires = 0;
+  m_waits = 0;
+  m_wait_us = 0;
 }
 
 connection_pool *connection_pool::getInstance()
@@ -25,6 +57,35 @@ connection_pool *connection_pool::getInstance()
   return &connPool;
 }
 
+// 建立一个连接，在 init 创建的线程中执行，失败时 arg->conn 为 NULL
+void* connection_pool::connect_one(void* arg)
+{
+  connect_arg* a = (connect_arg*) arg;
+  connection_pool* pool = a->pool;
+  MYSQL *conn = NULL;             // 创建一个 mysql 连接变量
+  conn = mysql_init(conn);        // 分配、初始化 mysql 对象
+
+  if(conn == NULL)
+  {
+    printf("Error:%s\n", mysql_error(conn));
+    mysql_thread_end();
+    return NULL;
+  }
+
+  // 尝试与主机上的 mysql 建立连接
+  if(mysql_real_connect(conn, pool->url.c_str(), pool->user.c_str(), pool->passwd.c_str(),
+                        pool->database.c_str(), a->port, NULL, 0) == NULL)
+  {
+    printf("Connect to mysql failure,Error:%s\n", mysql_error(conn));
+    mysql_close(conn);
+    conn = NULL;
+  }
+  a->conn = conn;
+  // mysql_init 为本线程分配的资源
+  mysql_thread_end();
+  return NULL;
+}
+
 // 连接池的初始化
 void connection_pool::init(const string& url, const string& user, const string& passwd,
                            const string& database, int port, unsigned int maxConn)
@@ -35,30 +96,33 @@ void connection_pool::init(const string& url, const string& user, const string&
   this->database = database;
   this->port = port;
 
-  // 连接数据库，保证只有一个线程执行
-  lock.lock();
-  for(int i=0; i<maxConn; ++i)
+  // 每个连接一个线程同时建立，启动时间是一次连接的耗时，而不是 maxConn 次
+  // 多个线程同时调用 mysql_init 之前必须先初始化客户端库
+  mysql_library_init(0, NULL, NULL);
+  vector<connect_arg> args(maxConn);
+  vector<pthread_t> tids(maxConn);
+  for(unsigned int i=0; i<maxConn; ++i)
   {
-    MYSQL *conn = NULL;             // 创建一个 mysql 连接变量
-    conn = mysql_init(conn);        // 分配、初始化 mysql 对象
-
-    if(conn == NULL)
+    args[i].pool = this;
+    args[i].port = port;
+    args[i].conn = NULL;
+    if(pthread_create(&tids[i], NULL, connect_one, &args[i]) != 0)
     {
-      printf("Error:%s\n", mysql_error(conn));
+      printf("Error:create connect thread failure\n");
       exit(1);
     }
+  }
+  for(unsigned int i=0; i<maxConn; ++i)
+    pthread_join(tids[i], NULL);
 
-    // 尝试与主机上的 mysql 建立连接
-    conn = mysql_real_connect(conn, url.c_str(), user.c_str(), passwd.c_str(), database.c_str(), port, NULL, 0);
-
-    if(conn == NULL)
-    {
-      printf("Connect to mysql failure,Error:%s\n", mysql_error(conn));
+  lock.lock();
+  for(unsigned int i=0; i<maxConn; ++i)
+  {
+    if(args[i].conn == NULL)
       exit(1);
-    }
 
     // 连接已经建立，将初始化好的连接放进连接池中
-    connList.push_back(conn);
+    connList.push_back(args[i].conn);
     ++freeConn;       // 空闲连接增加
   }
 
@@ -68,14 +132,27 @@ void connection_pool::init(const string& url, const string& user, const string&
 }
 
 // 当有请求时，从连接池中返回一个可用链接，同时更新使用和空闲链接
+// 连接全部被占用时阻塞等待，等待的次数和时间计入统计
 MYSQL* connection_pool::getConnection()
 {
-  if(connList.size() == 0)
+  // 本线程固定持有的连接
+  if(pinned.conn)
+    return pinned.conn;
+
+  // 连接池还没有初始化
+  if(maxConn == 0)
     return NULL;
 
   MYSQL *conn = NULL;
 
-  reserve.wait();
+  m_acquires.fetch_add(1, std::memory_order_relaxed);
+  if(!reserve.trywait())
+  {
+    long start = now_us();
+    reserve.wait();
+    m_waits.fetch_add(1, std::memory_order_relaxed);
+    m_wait_us.fetch_add(now_us() - start, std::memory_order_relaxed);
+  }
 
   lock.lock();
   conn = connList.front();    // 获得连接池的第一个连接
@@ -84,7 +161,17 @@ MYSQL* connection_pool::getConnection()
   --freeConn;
   ++curConn;
 
+  // 还有固定的名额，本线程以后一直使用这个连接
+  bool pin = pinnedConn < maxPinned;
+  if(pin)
+    ++pinnedConn;
   lock.unlock();
+
+  if(pin)
+  {
+    pinned.pool = this;
+    pinned.conn = conn;
+  }
   return conn;
 }
 
@@ -94,6 +181,10 @@ bool connection_pool::releaseConnection(MYSQL *conn)
   if(conn == NULL)
     return false;
 
+  // 固定的连接不归还
+  if(conn == pinned.conn)
+    return true;
+
   lock.lock();
 
   connList.push_back(conn);
@@ -105,6 +196,30 @@ bool connection_pool::releaseConnection(MYSQL *conn)
   return true;
 }
 
+// 线程退出，归还固定的连接
+void connection_pool::unpin(MYSQL* conn)
+{
+  lock.lock();
+  --pinnedConn;
+  lock.unlock();
+  pinned.conn = NULL;
+  releaseConnection(conn);
+}
+
+void connection_pool::setMaxPinned(unsigned int maxPinned)
+{
+  lock.lock();
+  this->maxPinned = maxPinned;
+  lock.unlock();
+}
+
+void connection_pool::waitStats(long* acquires, long* waits, long* wait_us)
+{
+  *acquires = m_acquires.load(std::memory_order_relaxed);
+  *waits = m_waits.load(std::memory_order_relaxed);
+  *wait_us = m_wait_us.load(std::memory_order_relaxed);
+}
+
 // 销毁连接池
 void connection_pool::destroyPool()
 {
@@ -145,8 +260,23 @@ connectionRAII::connectionRAII(MYSQL **conn, connection_pool *connPool)
   poolRAII = connPool;    // 连接池
 }
 
+// 延迟获取，connPool 为 NULL 时 get() 始终返回 NULL
+connectionRAII::connectionRAII(connection_pool *connPool)
+{
+  connRAII = NULL;
+  poolRAII = connPool;
+}
+
+MYSQL* connectionRAII::get()
+{
+  if(!connRAII && poolRAII)
+    connRAII = poolRAII->getConnection();
+  return connRAII;
+}
+
 connectionRAII::~connectionRAII()
 {
   // 释放实例
-  poolRAII->releaseConnection(connRAII);
+  if(connRAII)
+    poolRAII->releaseConnection(connRAII);
 }
\ No newline at end of file
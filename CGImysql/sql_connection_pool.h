@@ -11,6 +11,7 @@
 #include <errno.h>
 #include <string.h>
 #include <string>
+#include <atomic>
 
 // 数据库连接池需要线程同步
 #include "../locker/locker.h"
@@ -24,6 +25,11 @@ public:
   bool releaseConnection(MYSQL* conn);        // 释放连接
   int getFreeConn();                          // 获得空闲的连接
   void destroyPool();                         // 销毁所有连接
+  // 最多允许多少个线程各自固定持有一个连接：线程第一次获取的连接不再归还，之后直接复用，线程退出时归还
+  // 默认为 0（不固定），必须留出足够的连接给不固定的线程
+  void setMaxPinned(unsigned int maxPinned);
+  // 累计的获取次数（不含固定连接的复用）、需要等待的次数和等待的总时间（微秒）
+  void waitStats(long* acquires, long* waits, long* wait_us);
 
   static connection_pool *getInstance();      // 单例模式
 
@@ -33,11 +39,28 @@ public:
 private:
   connection_pool();
   ~connection_pool();
+  void unpin(MYSQL* conn);                    // 线程退出时归还固定的连接
+
+  struct connect_arg
+  {
+    connection_pool* pool;
+    int port;
+    MYSQL* conn;
+  };
+  static void* connect_one(void* arg);        // init 中每个连接一个线程并行建立
+
+  friend struct pinned_connection;
 
 private:
   unsigned int maxConn;     // 最大连接数
   unsigned int curConn;     // 当前已使用的连接数
   unsigned int freeConn;    // 当前空闲的连接数
+  unsigned int maxPinned;   // 最多固定的连接数
+  unsigned int pinnedConn;  // 当前被线程固定的连接数，由 lock 保护
+
+  std::atomic<long> m_acquires;
+  std::atomic<long> m_waits;
+  std::atomic<long> m_wait_us;
 
 private:
   locker lock;
@@ -52,11 +75,16 @@ private:
   string database;      // 数据库名
 };
 
+// 资源获取即初始化
+// 1. connectionRAII(&conn, pool)：构造时立即获取连接
+// 2. connectionRAII(pool)：构造时不获取，第一次调用 get() 时才获取，用不到数据库的任务不经过连接池
 class connectionRAII
 {
 public:
   connectionRAII(MYSQL **conn, connection_pool *connPool);
+  explicit connectionRAII(connection_pool *connPool);
   ~connectionRAII();
+  MYSQL* get();
 private:
   MYSQL *connRAII;
   connection_pool *poolRAII;
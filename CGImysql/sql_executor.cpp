@@ -0,0 +1,289 @@
+//
+// Created by acg on 1/3/22.
+//
+
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "sql_executor.h"
+#include "../log/log.h"
+
+sql_executor::sql_executor(): m_connPool(NULL), m_eventfd(-1), m_stop(false)
+{
+}
+
+sql_executor::~sql_executor()
+{
+  // 数据库线程是脱离线程，只通知它们退出
+  m_stop = true;
+  m_pending_stat.post();
+}
+
+sql_executor* sql_executor::get_instance()
+{
+  static sql_executor instance;
+  return &instance;
+}
+
+bool sql_executor::init(connection_pool* connPool, int thread_number)
+{
+  m_connPool = connPool;
+  m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if(m_eventfd < 0)
+    return false;
+
+  for(int i=0; i<thread_number; ++i)
+  {
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, worker, this) != 0)
+      return false;
+    pthread_detach(tid);
+  }
+  return true;
+}
+
+void sql_executor::submit(sql_task* task)
+{
+  m_pending_lock.lock();
+  m_pending.push_back(task);
+  m_pending_lock.unlock();
+  m_pending_stat.post();
+}
+
+void* sql_executor::worker(void* arg)
+{
+  sql_executor* executor = (sql_executor*) arg;
+  executor->run();
+  return executor;
+}
+
+void sql_executor::run()
+{
+  // 连接在线程的整个生命周期内持有，线程退出时归还
+  MYSQL* mysql = NULL;
+  connectionRAII mysqlConn(&mysql, m_connPool);
+  stmt_cache stmts;
+  sql_task* batch[MAX_BATCH];
+
+  while(!m_stop)
+  {
+    m_pending_stat.wait();
+    m_pending_lock.lock();
+    if(m_pending.empty())
+    {
+      m_pending_lock.unlock();
+      continue;
+    }
+    sql_task* task = m_pending.front();
+    m_pending.pop_front();
+    int count = 1;
+    batch[0] = task;
+    if(task->insert)
+      count = take_batch(task->insert, batch, count);
+    m_pending_lock.unlock();
+
+    if(!task->insert)
+    {
+      execute(mysql, task);
+      complete(batch, 1);
+      continue;
+    }
+
+    // 队列中还有同一种插入，说明正在突发，稍等一会儿把后续的也合并进来
+    if(count > 1 && count < MAX_BATCH)
+    {
+      usleep(BATCH_LINGER_US);
+      m_pending_lock.lock();
+      count = take_batch(task->insert, batch, count);
+      m_pending_lock.unlock();
+    }
+    execute_batch(mysql, stmts, batch, count);
+    complete(batch, count);
+  }
+
+  for(stmt_cache::iterator it = stmts.begin(); it != stmts.end(); ++it)
+    mysql_stmt_close(it->second);
+}
+
+// 调用者持有 m_pending_lock，取出的任务对应的信号量留给其他线程，它们醒来发现队列为空会继续等待
+int sql_executor::take_batch(const sql_insert* insert, sql_task** batch, int count)
+{
+  std::list<sql_task*>::iterator it = m_pending.begin();
+  while(it != m_pending.end() && count < MAX_BATCH)
+  {
+    if((*it)->insert == insert)
+    {
+      batch[count++] = *it;
+      it = m_pending.erase(it);
+    }
+    else
+      ++it;
+  }
+  return count;
+}
+
+void sql_executor::execute(MYSQL* mysql, sql_task* task)
+{
+  if(!mysql)
+  {
+    task->ok = false;
+    task->err = 0;
+  }
+  else if(mysql_query(mysql, (task->params.empty() ? task->sql : bind_params(mysql, task)).c_str()))
+  {
+    task->ok = false;
+    task->err = mysql_errno(mysql);
+    LOG_ERROR("sql error %u:%s", task->err, mysql_error(mysql));
+  }
+  else
+  {
+    task->ok = true;
+    // 只有查询语句有结果集
+    if(mysql_field_count(mysql) > 0)
+      task->result = mysql_store_result(mysql);
+  }
+}
+
+std::string sql_executor::bind_params(MYSQL* mysql, const sql_task* task)
+{
+  std::string sql;
+  std::vector<char> escaped;
+  size_t next = 0;
+  for(size_t i=0; i<task->sql.size(); ++i)
+  {
+    if(task->sql[i] != '?' || next >= task->params.size())
+    {
+      sql += task->sql[i];
+      continue;
+    }
+    // 转义后最长是原来的两倍再加结尾的 '\0'
+    const std::string& param = task->params[next++];
+    escaped.resize(param.size() * 2 + 1);
+    unsigned long len = mysql_real_escape_string(mysql, &escaped[0], param.data(), param.size());
+    sql += '\'';
+    sql.append(&escaped[0], len);
+    sql += '\'';
+  }
+  return sql;
+}
+
+// 一批插入作为一条语句执行；失败时（例如某一行主键冲突）整条语句回滚，再逐行执行，只让出错的行失败
+void sql_executor::execute_batch(MYSQL* mysql, stmt_cache& stmts, sql_task** batch, int count)
+{
+  unsigned int err = 0;
+  if(mysql && execute_insert(mysql, stmts, batch, count, &err))
+  {
+    for(int i=0; i<count; ++i)
+      batch[i]->ok = true;
+    return;
+  }
+  if(count > 1)
+  {
+    LOG_WARN("batch insert of %d rows failed, retry one by one", count);
+    for(int i=0; i<count; ++i)
+    {
+      err = 0;
+      batch[i]->ok = mysql && execute_insert(mysql, stmts, batch + i, 1, &err);
+      batch[i]->err = err;
+    }
+    return;
+  }
+  batch[0]->ok = false;
+  batch[0]->err = err;
+}
+
+// 用（插入种类，行数）对应的预处理语句执行 count 行插入
+bool sql_executor::execute_insert(MYSQL* mysql, stmt_cache& stmts, sql_task** batch, int count, unsigned int* err)
+{
+  const sql_insert* insert = batch[0]->insert;
+  MYSQL_STMT*& stmt = stmts[std::make_pair(insert, count)];
+  if(!stmt)
+  {
+    // INSERT INTO 表(列...) VALUES(?,?),(?,?)...
+    std::string sql = insert->prefix;
+    for(int i=0; i<count; ++i)
+    {
+      sql += i ? ",(" : "(";
+      for(int j=0; j<insert->columns; ++j)
+        sql += j ? ",?" : "?";
+      sql += ")";
+    }
+    stmt = mysql_stmt_init(mysql);
+    if(!stmt)
+    {
+      *err = mysql_errno(mysql);
+      stmts.erase(std::make_pair(insert, count));
+      return false;
+    }
+    if(mysql_stmt_prepare(stmt, sql.c_str(), sql.size()))
+    {
+      *err = mysql_stmt_errno(stmt);
+      LOG_ERROR("prepare error:%s", mysql_stmt_error(stmt));
+      mysql_stmt_close(stmt);
+      stmts.erase(std::make_pair(insert, count));
+      return false;
+    }
+  }
+
+  int n = count * insert->columns;
+  std::vector<MYSQL_BIND> binds(n);
+  std::vector<unsigned long> lengths(n);
+  memset(&binds[0], 0, sizeof(MYSQL_BIND) * n);
+  for(int i=0; i<count; ++i)
+  {
+    for(int j=0; j<insert->columns; ++j)
+    {
+      int k = i * insert->columns + j;
+      const std::string& param = batch[i]->params[j];
+      lengths[k] = param.size();
+      binds[k].buffer_type = MYSQL_TYPE_STRING;
+      binds[k].buffer = (void*) param.data();
+      binds[k].buffer_length = param.size();
+      binds[k].length = &lengths[k];
+    }
+  }
+  if(mysql_stmt_bind_param(stmt, &binds[0]) || mysql_stmt_execute(stmt))
+  {
+    *err = mysql_stmt_errno(stmt);
+    LOG_ERROR("insert error %u:%s", *err, mysql_stmt_error(stmt));
+    return false;
+  }
+  return true;
+}
+
+void sql_executor::complete(sql_task** tasks, int count)
+{
+  m_done_lock.lock();
+  for(int i=0; i<count; ++i)
+    m_done.push_back(tasks[i]);
+  m_done_lock.unlock();
+
+  // eventfd 的计数累加，事件循环一次读出，多个完成只唤醒一次
+  uint64_t one = 1;
+  while(write(m_eventfd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+void sql_executor::dispatch()
+{
+  uint64_t count;
+  while(read(m_eventfd, &count, sizeof(count)) < 0 && errno == EINTR);
+
+  // 整个完成队列换出来再回调，回调中可以继续提交任务
+  std::list<sql_task*> done;
+  m_done_lock.lock();
+  done.swap(m_done);
+  m_done_lock.unlock();
+
+  for(std::list<sql_task*>::iterator it = done.begin(); it != done.end(); ++it)
+  {
+    sql_task* task = *it;
+    if(task->callback)
+      task->callback(task);
+    if(task->result)
+      mysql_free_result(task->result);
+    delete task;
+  }
+}
@@ -0,0 +1,92 @@
+//
+// Created by acg on 1/3/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_SQL_EXECUTOR_H
+#define XLAOTINYWEBSERVER_SQL_EXECUTOR_H
+
+#include <pthread.h>
+#include <mysql/mysql.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../locker/locker.h"
+#include "sql_connection_pool.h"
+
+// 可以合并执行的插入语句，例如注册时的 INSERT INTO user(username,passwd) VALUES
+// 同一时间段内提交的同一种插入合并成一条多行的 INSERT，用预处理语句执行，参数不需要转义
+struct sql_insert
+{
+  const char* prefix;             // "INSERT INTO 表(列...) VALUES"
+  int columns;                    // 每行的列数，即每个任务的参数个数
+};
+
+// 一条异步执行的 sql 语句
+// 提交者填写 sql（或者 insert 和 params）、callback 和 arg，执行完毕后 ok、err、result 由数据库线程填写
+struct sql_task
+{
+  std::string sql;                // sql 中的 ? 依次换成 params 中转义后加引号的字符串
+  const sql_insert* insert;       // 非空时是可以合并的插入，不使用 sql
+  std::vector<std::string> params;    // 语句的参数；插入时为一行，insert->columns 个字符串
+  void (*callback)(sql_task*);    // 在事件循环（0 号 reactor）中调用
+  void* arg;                      // 提交者的上下文，例如 http_conn
+  bool ok;                        // 语句是否执行成功
+  unsigned int err;               // 失败时的 mysql_errno
+  MYSQL_RES* result;              // 查询语句的结果集，回调返回后释放
+
+  sql_task(): insert(NULL), callback(NULL), arg(NULL), ok(false), err(0), result(NULL) {}
+};
+
+// 异步数据库执行器，单例模式
+// 1. 工作线程 submit 后立即返回，语句由专门的数据库线程阻塞执行，工作线程不会卡在数据库上
+//    每个数据库线程启动时从连接池取一个连接，一直使用，预处理语句也就可以在线程中缓存
+// 2. 执行完的任务放入完成队列，写 eventfd 通知事件循环
+// 3. 事件循环在 eventfd 可读时调用 dispatch，依次执行回调，然后释放结果集和任务
+// 4. 插入任务成批执行：取出一个插入任务时把队列中同一种插入一起取出，最多 MAX_BATCH 个，
+//    拼成一条多行 INSERT（一个事务）执行，一批全部完成后才通知事件循环
+//    一次取到多个说明正在突发，再等 BATCH_LINGER_US 微秒收集后续的任务；平时只有一个时立即执行，不增加延迟
+class sql_executor
+{
+public:
+  static const int MAX_BATCH = 32;            // 一条 INSERT 最多合并的行数
+  static const int BATCH_LINGER_US = 500;
+
+  static sql_executor* get_instance();
+
+  bool init(connection_pool* connPool, int thread_number);   // 创建 eventfd 和数据库线程
+  void submit(sql_task* task);              // 提交任务，任务由执行器在回调之后 delete
+  int get_eventfd() { return m_eventfd; }   // 注册到事件循环的内核事件表
+  void dispatch();                          // eventfd 可读时在事件循环中调用
+
+private:
+  sql_executor();
+  ~sql_executor();
+
+  // 预处理语句按（插入种类，行数）缓存在数据库线程中
+  typedef std::map<std::pair<const sql_insert*, int>, MYSQL_STMT*> stmt_cache;
+
+  static void* worker(void* arg);
+  void run();
+  int take_batch(const sql_insert* insert, sql_task** batch, int count);   // 从队列中取出同一种插入
+  void execute(MYSQL* mysql, sql_task* task);
+  static std::string bind_params(MYSQL* mysql, const sql_task* task);     // 把参数转义后代入 ?
+  void execute_batch(MYSQL* mysql, stmt_cache& stmts, sql_task** batch, int count);
+  bool execute_insert(MYSQL* mysql, stmt_cache& stmts, sql_task** batch, int count, unsigned int* err);
+  void complete(sql_task** tasks, int count);   // 放入完成队列并通知事件循环
+
+private:
+  connection_pool* m_connPool;
+  int m_eventfd;
+  bool m_stop;
+
+  std::list<sql_task*> m_pending;     // 等待执行的任务
+  locker m_pending_lock;
+  sem m_pending_stat;
+
+  std::list<sql_task*> m_done;        // 执行完等待回调的任务
+  locker m_done_lock;
+};
+
+#endif //XLAOTINYWEBSERVER_SQL_EXECUTOR_H
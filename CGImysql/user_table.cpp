@@ -0,0 +1,254 @@
+//
+// Created by acg on 1/4/22.
+//
+
+#include <stdlib.h>
+
+#include "user_table.h"
+
+user_table::user_table()
+{
+  for(int i=0; i<SHARD_NUMBER; ++i)
+  {
+    m_shards[i].table.store(new_array(MIN_CAPACITY), std::memory_order_relaxed);
+    m_shards[i].used = 0;
+    m_shards[i].tombs = 0;
+  }
+}
+
+user_table::~user_table()
+{
+  for(int i=0; i<SHARD_NUMBER; ++i)
+  {
+    shard& s = m_shards[i];
+    slot_array* t = s.table.load(std::memory_order_relaxed);
+    for(size_t j=0; j<=t->mask; ++j)
+    {
+      entry* e = t->slots[j].load(std::memory_order_relaxed);
+      if(e && e != tombstone())
+        free(e);
+    }
+    delete[] t->slots;
+    delete t;
+    for(size_t j=0; j<s.retired.size(); ++j)
+    {
+      delete[] s.retired[j]->slots;
+      delete s.retired[j];
+    }
+    for(size_t j=0; j<s.removed.size(); ++j)
+      free(s.removed[j]);
+  }
+}
+
+// FNV-1a，再做一次混合，让分片用到的高位也足够均匀
+uint64_t user_table::hash(const char* s, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i=0; i<len; ++i)
+  {
+    h ^= (unsigned char) s[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+user_table::slot_array* user_table::new_array(size_t capacity)
+{
+  slot_array* t = new slot_array;
+  t->mask = capacity - 1;
+  t->slots = new std::atomic<entry*>[capacity];
+  for(size_t i=0; i<capacity; ++i)
+    t->slots[i].store(NULL, std::memory_order_relaxed);
+  return t;
+}
+
+// 用户名和密码紧跟在条目后面，一次分配
+user_table::entry* user_table::new_entry(uint64_t h, const std::string& name, const std::string& passwd)
+{
+  entry* e = (entry*) malloc(sizeof(entry) + name.size() + passwd.size());
+  e->hash = h;
+  e->name_len = name.size();
+  e->passwd_len = passwd.size();
+  memcpy((char*) e->name(), name.data(), name.size());
+  memcpy((char*) e->passwd(), passwd.data(), passwd.size());
+  return e;
+}
+
+user_table::entry* user_table::find(uint64_t h, const char* name, size_t len)
+{
+  slot_array* t = shard_of(h).table.load(std::memory_order_acquire);
+  // 装载因子不超过 1/2，一定能遇到空槽
+  for(size_t i = h & t->mask; ; i = (i + 1) & t->mask)
+  {
+    entry* e = t->slots[i].load(std::memory_order_acquire);
+    if(!e)
+      return NULL;
+    if(e != tombstone() && e->hash == h && e->name_len == len && memcmp(e->name(), name, len) == 0)
+      return e;
+  }
+}
+
+bool user_table::contains(const char* name)
+{
+  size_t len = strlen(name);
+  return find(hash(name, len), name, len) != NULL;
+}
+
+bool user_table::check(const char* name, const char* passwd)
+{
+  size_t len = strlen(name);
+  entry* e = find(hash(name, len), name, len);
+  if(!e)
+    return false;
+  size_t passwd_len = strlen(passwd);
+  return e->passwd_len == passwd_len && memcmp(e->passwd(), passwd, passwd_len) == 0;
+}
+
+bool user_table::insert(const std::string& name, const std::string& passwd)
+{
+  return put(name, passwd, false);
+}
+
+void user_table::assign(const std::string& name, const std::string& passwd)
+{
+  put(name, passwd, true);
+}
+
+bool user_table::put(const std::string& name, const std::string& passwd, bool overwrite)
+{
+  uint64_t h = hash(name.data(), name.size());
+  shard& s = shard_of(h);
+  s.lock.lock();
+  slot_array* t = s.table.load(std::memory_order_relaxed);
+  std::atomic<entry*>* target = NULL;      // 第一个墓碑，用户名不存在时放在这里
+  size_t i = h & t->mask;
+  for(; ; i = (i + 1) & t->mask)
+  {
+    entry* e = t->slots[i].load(std::memory_order_relaxed);
+    if(!e)
+      break;
+    if(e == tombstone())
+    {
+      if(!target)
+        target = &t->slots[i];
+      continue;
+    }
+    if(e->hash == h && e->name_len == name.size() && memcmp(e->name(), name.data(), name.size()) == 0)
+    {
+      // 条目不能原地修改，换成新的条目
+      if(overwrite)
+      {
+        t->slots[i].store(new_entry(h, name, passwd), std::memory_order_release);
+        s.removed.push_back(e);
+      }
+      s.lock.unlock();
+      return overwrite;
+    }
+  }
+
+  if(target)
+    --s.tombs;
+  else
+    target = &t->slots[i];
+  target->store(new_entry(h, name, passwd), std::memory_order_release);
+  ++s.used;
+
+  // 保持装载因子（含墓碑）不超过 1/2；墓碑多时按原大小重建即可清掉墓碑
+  size_t capacity = t->mask + 1;
+  if((s.used + s.tombs) * 2 > capacity)
+    grow(s, s.used * 4 > capacity ? capacity * 2 : capacity);
+  s.lock.unlock();
+  return true;
+}
+
+bool user_table::erase(const std::string& name)
+{
+  return remove(name, NULL);
+}
+
+bool user_table::erase(const std::string& name, const std::string& passwd)
+{
+  return remove(name, &passwd);
+}
+
+bool user_table::remove(const std::string& name, const std::string* passwd)
+{
+  uint64_t h = hash(name.data(), name.size());
+  shard& s = shard_of(h);
+  s.lock.lock();
+  slot_array* t = s.table.load(std::memory_order_relaxed);
+  for(size_t i = h & t->mask; ; i = (i + 1) & t->mask)
+  {
+    entry* e = t->slots[i].load(std::memory_order_relaxed);
+    if(!e)
+      break;
+    if(e != tombstone() && e->hash == h && e->name_len == name.size() &&
+       memcmp(e->name(), name.data(), name.size()) == 0)
+    {
+      if(passwd && (e->passwd_len != passwd->size() || memcmp(e->passwd(), passwd->data(), passwd->size()) != 0))
+        break;
+      t->slots[i].store(tombstone(), std::memory_order_release);
+      s.removed.push_back(e);
+      --s.used;
+      ++s.tombs;
+      s.lock.unlock();
+      return true;
+    }
+  }
+  s.lock.unlock();
+  return false;
+}
+
+void user_table::grow(shard& s, size_t capacity)
+{
+  slot_array* old = s.table.load(std::memory_order_relaxed);
+  slot_array* t = new_array(capacity);
+  for(size_t i=0; i<=old->mask; ++i)
+  {
+    entry* e = old->slots[i].load(std::memory_order_relaxed);
+    if(!e || e == tombstone())
+      continue;
+    size_t j = e->hash & t->mask;
+    while(t->slots[j].load(std::memory_order_relaxed))
+      j = (j + 1) & t->mask;
+    t->slots[j].store(e, std::memory_order_relaxed);
+  }
+  // 新数组填好后整体发布，之后的读者看到的是完整的新数组
+  s.table.store(t, std::memory_order_release);
+  s.retired.push_back(old);
+  s.tombs = 0;
+}
+
+void user_table::reserve(size_t users)
+{
+  // 每个分片的槽数至少是平均用户数的 4 倍，加载完后装载因子约 1/4
+  size_t per_shard = users / SHARD_NUMBER + 1;
+  size_t capacity = MIN_CAPACITY;
+  while(capacity < per_shard * 4)
+    capacity <<= 1;
+  for(int i=0; i<SHARD_NUMBER; ++i)
+  {
+    shard& s = m_shards[i];
+    s.lock.lock();
+    if(s.table.load(std::memory_order_relaxed)->mask + 1 < capacity)
+      grow(s, capacity);
+    s.lock.unlock();
+  }
+}
+
+size_t user_table::size()
+{
+  size_t n = 0;
+  for(int i=0; i<SHARD_NUMBER; ++i)
+  {
+    m_shards[i].lock.lock();
+    n += m_shards[i].used;
+    m_shards[i].lock.unlock();
+  }
+  return n;
+}
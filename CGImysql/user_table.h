@@ -0,0 +1,90 @@
+//
+// Created by acg on 1/4/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_USER_TABLE_H
+#define XLAOTINYWEBSERVER_USER_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "../locker/locker.h"
+
+// 用户名 -> 密码的并发哈希表，读多写少：登录只读，注册才写
+// 1. 按哈希值的高位分成 SHARD_NUMBER 个分片，每个分片一把锁，只有写操作加锁
+// 2. 分片内是开放寻址（线性探测）的槽数组，槽里是指向条目的原子指针，条目写入后不再修改
+//    读操作不加锁：取出当前的槽数组，按哈希值探测，比较条目的哈希值和用户名
+// 3. 装载因子超过 1/2 时分配两倍大的新数组，把条目指针搬过去再整体替换，正在读旧数组的线程不受影响
+// 4. 删除的槽换成墓碑，探测越过墓碑继续；没有读者计数，无法确定旧数组和删除的条目何时不再被访问，
+//    它们保留到表析构时才释放：旧数组的总大小不超过当前数组，删除只在注册写库失败时发生
+class user_table
+{
+public:
+  static const int SHARD_BITS = 6;
+  static const int SHARD_NUMBER = 1 << SHARD_BITS;
+  static const size_t MIN_CAPACITY = 16;      // 每个分片初始的槽数
+
+  user_table();
+  ~user_table();
+
+  user_table(const user_table&)=delete;
+  user_table& operator=(const user_table&)=delete;
+
+  void reserve(size_t users);                                 // 预先按用户数分配槽数组，启动加载前调用
+  bool insert(const std::string& name, const std::string& passwd);   // 已经存在时返回 false，不覆盖
+  void assign(const std::string& name, const std::string& passwd);   // 存在时覆盖
+  bool erase(const std::string& name);
+  bool erase(const std::string& name, const std::string& passwd);   // 只有密码一致时才删除
+  bool contains(const char* name);
+  bool check(const char* name, const char* passwd);           // 用户存在并且密码一致，不分配内存
+  size_t size();
+
+private:
+  struct entry
+  {
+    uint64_t hash;
+    uint32_t name_len;
+    uint32_t passwd_len;
+    const char* name() const { return (const char*) (this + 1); }
+    const char* passwd() const { return name() + name_len; }
+  };
+
+  struct slot_array
+  {
+    size_t mask;                        // 槽数 - 1，槽数是 2 的幂
+    std::atomic<entry*>* slots;
+  };
+
+  // 读者只访问 table，和写者修改的成员分开放在不同的缓存行
+  struct shard
+  {
+    std::atomic<slot_array*> table;
+    char pad0[64];
+    locker lock;                        // 只有写操作加锁
+    size_t used;                        // 存放条目的槽数，由 lock 保护
+    size_t tombs;                       // 墓碑数，由 lock 保护
+    std::vector<slot_array*> retired;   // 替换下来的旧数组
+    std::vector<entry*> removed;        // 删除和被覆盖的条目
+    char pad1[64];
+  };
+
+  static uint64_t hash(const char* s, size_t len);
+  static entry* tombstone() { return (entry*) 1; }
+  static slot_array* new_array(size_t capacity);
+  static entry* new_entry(uint64_t h, const std::string& name, const std::string& passwd);
+
+  shard& shard_of(uint64_t h) { return m_shards[h >> (64 - SHARD_BITS)]; }
+  entry* find(uint64_t h, const char* name, size_t len);      // 无锁查找
+  bool put(const std::string& name, const std::string& passwd, bool overwrite);
+  bool remove(const std::string& name, const std::string* passwd);
+  void grow(shard& s, size_t capacity);                       // 调用者持有分片的锁
+
+private:
+  shard m_shards[SHARD_NUMBER];
+};
+
+#endif //XLAOTINYWEBSERVER_USER_TABLE_H
@@ -0,0 +1,447 @@
+//
+// Created by acg on 1/5/22.
+//
+// http 请求解析的对比测试：逐字节的状态机与 http_scan 按块查找
+// 语料是浏览器和压测工具发出的真实请求（抓包得到，Cookie 等隐私内容替换成了同样长度的随机值），
+// 重复拼接成一个约 60KB 的流水线缓冲区，模拟读缓冲区中的一批请求，解析其中全部请求
+// legacy：http_conn 原来的 parse_line（逐字节找 \r\n）加 strpbrk/strspn/strcasecmp 解析请求行和头部
+// scan：http_conn 现在的实现，分别强制使用 scalar、sse4.2、avx2 三种查找，cpu 不支持的跳过
+//       每个头部都记录到 http_request 中，头部名称用完美哈希识别
+// 两边都只保留分行、分隔请求行、识别头部的部分，url 改写、日志等与查找无关的处理去掉了
+// 周期数用 rdtsc 计，是 TSC 的周期，开启睿频时与核心周期不完全相等，同一台机器上的相对大小可以参考
+// 用法：./parse_bench [轮数]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../http/http_scan.h"
+#include "../http/http_request.h"
+
+static const char* corpus[] = {
+  // Chrome 96，打开首页
+  "GET / HTTP/1.1\r\n"
+  "Host: 1.117.27.35:9777\r\n"
+  "Connection: keep-alive\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/96.0.4664.110 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+  "application/signed-exchange;v=b3;q=0.9\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+  "\r\n",
+  // Chrome 96，页面中的图片
+  "GET /source/image.jpg HTTP/1.1\r\n"
+  "Host: 1.117.27.35:9777\r\n"
+  "Connection: keep-alive\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/96.0.4664.110 Safari/537.36\r\n"
+  "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+  "Referer: http://1.117.27.35:9777/5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+  "\r\n",
+  // Chrome 96，登录表单
+  "POST /2CGISQL.cgi HTTP/1.1\r\n"
+  "Host: 1.117.27.35:9777\r\n"
+  "Connection: keep-alive\r\n"
+  "Content-Length: 25\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Origin: http://1.117.27.35:9777\r\n"
+  "Content-Type: application/x-www-form-urlencoded\r\n"
+  "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/96.0.4664.110 Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+  "application/signed-exchange;v=b3;q=0.9\r\n"
+  "Referer: http://1.117.27.35:9777/2\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+  "\r\n"
+  "user=name&password=passwd",
+  // Firefox 95，Linux
+  "GET /5 HTTP/1.1\r\n"
+  "Host: 1.117.27.35:9777\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:95.0) Gecko/20100101 Firefox/95.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: zh-CN,zh;q=0.8,zh-TW;q=0.7,zh-HK;q=0.5,en-US;q=0.3,en;q=0.2\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: http://1.117.27.35:9777/1\r\n"
+  "Cookie: Hm_lvt_8f2a1c6e0b7d4953a1e6c2f0d9b84a17=1640760232,1640843127\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "\r\n",
+  // Chrome 96，Android
+  "GET /6 HTTP/1.1\r\n"
+  "Host: 1.117.27.35:9777\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "User-Agent: Mozilla/5.0 (Linux; Android 11; M2012K11AC) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/96.0.4664.104 Mobile Safari/537.36\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+  "application/signed-exchange;v=b3;q=0.9\r\n"
+  "Referer: http://1.117.27.35:9777/1\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Accept-Language: zh-CN,zh;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+  "\r\n",
+  // curl 7.80
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: 127.0.0.1:9006\r\n"
+  "User-Agent: curl/7.80.0\r\n"
+  "Accept: */*\r\n"
+  "\r\n",
+  // wrk 4.1
+  "GET /0 HTTP/1.1\r\n"
+  "Host: 127.0.0.1:9006\r\n"
+  "\r\n",
+  // webbench 1.5
+  "GET / HTTP/1.1\r\n"
+  "User-Agent: WebBench 1.5\r\n"
+  "Host: 127.0.0.1\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n",
+};
+
+static const int BUFFER_SIZE = 60 * 1024;
+
+enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
+enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST };
+
+// http_conn 中与解析有关的成员
+struct parser
+{
+  char* m_read_buf;
+  int m_read_idx;
+  int m_checked_idx;
+  int m_start_line;
+  CHECK_STATE m_check_state;
+  int m_method;
+  char* m_url;
+  char* m_version;
+  char* m_host;
+  long m_content_len;
+  bool m_linger;
+  http_request m_request;
+
+  // 校验两种实现的解析结果一致
+  long requests;
+  long checksum;
+};
+
+// 原来的实现
+struct legacy
+{
+  static LINE_STATUS parse_line(parser* p)
+  {
+    char temp;
+    for(; p->m_checked_idx < p->m_read_idx; ++p->m_checked_idx)
+    {
+      temp = p->m_read_buf[p->m_checked_idx];
+      if(temp == '\r')
+      {
+        if((p->m_checked_idx + 1) == p->m_read_idx)
+          return LINE_OPEN;
+        else if(p->m_read_buf[p->m_checked_idx + 1] == '\n')
+        {
+          p->m_read_buf[p->m_checked_idx++] = '\0';
+          p->m_read_buf[p->m_checked_idx++] = '\0';
+          return LINE_OK;
+        }
+        return LINE_BAD;
+      }
+      else if(temp == '\n')
+      {
+        if(p->m_checked_idx > 1 && p->m_read_buf[p->m_checked_idx - 1] == '\r')
+        {
+          p->m_read_buf[p->m_checked_idx - 1] = '\0';
+          p->m_read_buf[p->m_checked_idx++] = '\0';
+          return LINE_OK;
+        }
+        return LINE_BAD;
+      }
+    }
+    return LINE_OPEN;
+  }
+
+  static HTTP_CODE parse_request_line(parser* p, char* text, char*)
+  {
+    p->m_url = strpbrk(text, " \t");
+    if(!p->m_url)
+      return BAD_REQUEST;
+    *p->m_url++ = '\0';
+    if(strcasecmp(text, "GET") == 0)
+      p->m_method = 0;
+    else if(strcasecmp(text, "POST") == 0)
+      p->m_method = 1;
+    else
+      return BAD_REQUEST;
+    p->m_url += strspn(p->m_url, " \t");
+    p->m_version = strpbrk(p->m_url, " \t");
+    if(!p->m_version)
+      return BAD_REQUEST;
+    *p->m_version++ = '\0';
+    p->m_version += strspn(p->m_version, " \t");
+    if(strcasecmp(p->m_version, "HTTP/1.1") != 0)
+      return BAD_REQUEST;
+    p->m_check_state = CHECK_STATE_HEADER;
+    return NO_REQUEST;
+  }
+
+  static HTTP_CODE parse_headers(parser* p, char* text, char*)
+  {
+    if(text[0] == '\0')
+      return GET_REQUEST;
+    else if(strncasecmp(text, "Connection:", 11) == 0)
+    {
+      text += 11;
+      text += strspn(text, " \t");
+      if(strcasecmp(text, "keep-alive") == 0)
+        p->m_linger = true;
+    }
+    else if(strncasecmp(text, "Content-length:", 15) == 0)
+    {
+      text += 15;
+      text += strspn(text, " \t");
+      p->m_content_len = atol(text);
+    }
+    else if(strncasecmp(text, "Host:", 5) == 0)
+    {
+      text += 5;
+      text += strspn(text, " \t");
+      p->m_host = text;
+    }
+    return NO_REQUEST;
+  }
+};
+
+// 现在的实现
+struct scan
+{
+  static LINE_STATUS parse_line(parser* p)
+  {
+    char* end = p->m_read_buf + p->m_read_idx;
+    char* c = http_scan::find(p->m_read_buf + p->m_checked_idx, end, '\r', '\n');
+    p->m_checked_idx = c - p->m_read_buf;
+    if(c == end)
+      return LINE_OPEN;
+    if(*c == '\r')
+    {
+      if(c + 1 == end)
+        return LINE_OPEN;
+      if(c[1] == '\n')
+      {
+        p->m_read_buf[p->m_checked_idx++] = '\0';
+        p->m_read_buf[p->m_checked_idx++] = '\0';
+        return LINE_OK;
+      }
+      return LINE_BAD;
+    }
+    if(p->m_checked_idx > 1 && p->m_read_buf[p->m_checked_idx - 1] == '\r')
+    {
+      p->m_read_buf[p->m_checked_idx - 1] = '\0';
+      p->m_read_buf[p->m_checked_idx++] = '\0';
+      return LINE_OK;
+    }
+    return LINE_BAD;
+  }
+
+  static HTTP_CODE parse_request_line(parser* p, char* text, char* end)
+  {
+    p->m_url = http_scan::find(text, end, ' ', '\t');
+    if(p->m_url == end)
+      return BAD_REQUEST;
+    size_t method_len = p->m_url - text;
+    p->m_request.set_method(text, method_len);
+    *p->m_url++ = '\0';
+    if(method_len == 3 && strncasecmp(text, "GET", 3) == 0)
+      p->m_method = 0;
+    else if(method_len == 4 && strncasecmp(text, "POST", 4) == 0)
+      p->m_method = 1;
+    else
+      return BAD_REQUEST;
+    while(p->m_url < end && (*p->m_url == ' ' || *p->m_url == '\t'))
+      ++p->m_url;
+    char* url_end = http_scan::find(p->m_url, end, ' ', '\t');
+    if(url_end == end)
+      return BAD_REQUEST;
+    *url_end = '\0';
+    p->m_version = url_end + 1;
+    while(p->m_version < end && (*p->m_version == ' ' || *p->m_version == '\t'))
+      ++p->m_version;
+    if(end - p->m_version != 8 || strncasecmp(p->m_version, "HTTP/1.1", 8) != 0)
+      return BAD_REQUEST;
+    p->m_request.set_version(p->m_version, 8);
+    char* query = http_scan::find(p->m_url, url_end, '?', '?');
+    if(query != url_end)
+    {
+      *query = '\0';
+      p->m_request.set_query(query + 1, url_end - query - 1);
+    }
+    p->m_request.set_path(p->m_url, query - p->m_url);
+    p->m_check_state = CHECK_STATE_HEADER;
+    return NO_REQUEST;
+  }
+
+  static HTTP_CODE parse_headers(parser* p, char* text, char* end)
+  {
+    if(text[0] == '\0')
+    {
+      if(p->m_request.header(HEADER_CONNECTION).iequals("keep-alive"))
+        p->m_linger = true;
+      str_view content_length = p->m_request.header(HEADER_CONTENT_LENGTH);
+      if(content_length.data)
+        p->m_content_len = atol(content_length.data);
+      p->m_host = (char*) p->m_request.header(HEADER_HOST).data;
+      return GET_REQUEST;
+    }
+    char* colon = http_scan::find(text, end, ':', ':');
+    if(colon == end)
+      return NO_REQUEST;
+    char* value = colon + 1;
+    while(value < end && (*value == ' ' || *value == '\t'))
+      ++value;
+    while(end > value && (end[-1] == ' ' || end[-1] == '\t'))
+      *--end = '\0';
+    p->m_request.add_header(text, colon - text, value, end - value);
+    return NO_REQUEST;
+  }
+};
+
+static void finish_request(parser* p)
+{
+  ++p->requests;
+  p->checksum += (p->m_url - p->m_read_buf) + p->m_content_len * 3 + p->m_linger * 7 + (p->m_host ? 11 : 0);
+  p->m_check_state = CHECK_STATE_REQUESTLINE;
+  p->m_content_len = 0;
+  p->m_linger = false;
+  p->m_host = NULL;
+  p->m_request.clear(p->m_read_buf);
+}
+
+// 和 http_conn::process_read 相同的主状态机，解析缓冲区中的全部请求
+template <typename Impl>
+static void parse_all(parser* p)
+{
+  while(true)
+  {
+    if(p->m_check_state == CHECK_STATE_CONTENT)
+    {
+      if(p->m_read_idx - p->m_checked_idx < p->m_content_len)
+        return;
+      p->m_checked_idx += p->m_content_len;
+      p->m_start_line = p->m_checked_idx;
+      finish_request(p);
+      continue;
+    }
+    if(Impl::parse_line(p) != LINE_OK)
+      return;
+    char* text = p->m_read_buf + p->m_start_line;
+    char* end = p->m_read_buf + p->m_checked_idx - 2;
+    p->m_start_line = p->m_checked_idx;
+    HTTP_CODE ret;
+    if(p->m_check_state == CHECK_STATE_REQUESTLINE)
+      ret = Impl::parse_request_line(p, text, end);
+    else
+      ret = Impl::parse_headers(p, text, end);
+    if(ret == BAD_REQUEST)
+      return;
+    if(ret == GET_REQUEST)
+    {
+      if(p->m_content_len)
+        p->m_check_state = CHECK_STATE_CONTENT;
+      else
+        finish_request(p);
+    }
+  }
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+template <typename Impl>
+static void run(const char* name, const std::string& stream, std::vector<char>& buf, int rounds,
+                long* requests, long* checksum)
+{
+  unsigned long long total_cycles = 0;
+  double total_sec = 0;
+  parser p;
+  for(int r=0; r<rounds; ++r)
+  {
+    // 解析会把 \r\n 和分隔符改成 '\0'，每轮重新复制，复制不计时
+    memcpy(&buf[0], stream.data(), stream.size());
+    p.m_read_buf = &buf[0];
+    p.m_read_idx = stream.size();
+    p.m_checked_idx = 0;
+    p.m_start_line = 0;
+    p.m_check_state = CHECK_STATE_REQUESTLINE;
+    p.m_content_len = 0;
+    p.m_linger = false;
+    p.m_host = NULL;
+    p.m_request.clear(p.m_read_buf);
+    p.requests = 0;
+    p.checksum = 0;
+
+    double start = now_sec();
+    unsigned long long c = cycles();
+    parse_all<Impl>(&p);
+    total_cycles += cycles() - c;
+    total_sec += now_sec() - start;
+  }
+
+  double bytes = (double) stream.size() * rounds;
+  printf("%-14s %8ld requests %8.2f bytes/cycle %8.2f GB/s %8.1f ns/request%s\n", name, p.requests,
+         total_cycles ? bytes / total_cycles : 0.0, bytes / total_sec / 1e9, total_sec * 1e9 / p.requests / rounds,
+         (*requests < 0 || (p.requests == *requests && p.checksum == *checksum)) ? "" : "  MISMATCH");
+  *requests = p.requests;
+  *checksum = p.checksum;
+}
+
+int main(int argc, char* argv[])
+{
+  int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+  if(rounds <= 0)
+    rounds = 2000;
+
+  // 语料按顺序重复拼接，直到接近读缓冲区的最大大小
+  std::string stream;
+  int count = sizeof(corpus) / sizeof(corpus[0]);
+  for(int i=0; stream.size() + strlen(corpus[i % count]) <= (size_t) BUFFER_SIZE; ++i)
+    stream += corpus[i % count];
+  std::vector<char> buf(stream.size());
+  printf("corpus %d requests, stream %zu bytes, %d rounds, best scanner %s\n", count, stream.size(), rounds,
+         http_scan::level_name(http_scan::detect()));
+
+  long requests = -1, checksum = 0;
+  run<legacy>("legacy", stream, buf, rounds, &requests, &checksum);
+  for(int level = http_scan::SCALAR; level <= http_scan::AVX2; ++level)
+  {
+    if(!http_scan::set_level((http_scan::LEVEL) level))
+      continue;
+    std::string name = std::string("scan ") + http_scan::level_name((http_scan::LEVEL) level);
+    run<scan>(name.c_str(), stream, buf, rounds, &requests, &checksum);
+  }
+  return 0;
+}
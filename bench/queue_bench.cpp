@@ -0,0 +1,245 @@
+//
+// Created by acg on 12/30/21.
+//
+// 线程池请求队列的吞吐对比测试
+// list：threadPool 原来的实现，std::list + 互斥锁 + 信号量，每次入队分配一个链表节点
+// mpmc：无锁环形队列 + futex_event，消费者自旋后休眠、批量出队，只在有休眠者时唤醒
+// 每组测试 N 个生产者线程和 N 个消费者线程，N = 1、2、4 ... 64
+// 用法：./queue_bench [任务总数]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <list>
+#include <vector>
+
+#include "../locker/locker.h"
+#include "../threadPool/mpmc_queue.h"
+
+static const int QUEUE_CAPACITY = 10000;    // 与线程池的 max_requests 一致
+static const int POP_BATCH = 4;
+static const int SPIN_COUNT = 64;
+
+static long* const STOP = (long*) -1;       // 消费者的结束标记
+
+// threadPool 原来的请求队列
+class list_queue
+{
+public:
+  bool push(long* task)
+  {
+    m_lock.lock();
+    if(m_list.size() > (size_t) QUEUE_CAPACITY)
+    {
+      m_lock.unlock();
+      return false;
+    }
+    m_list.push_back(task);
+    m_lock.unlock();
+    m_stat.post();
+    return true;
+  }
+
+  long* pop()
+  {
+    while(true)
+    {
+      m_stat.wait();
+      m_lock.lock();
+      if(m_list.empty())
+      {
+        m_lock.unlock();
+        continue;
+      }
+      long* task = m_list.front();
+      m_list.pop_front();
+      m_lock.unlock();
+      return task;
+    }
+  }
+
+private:
+  std::list<long*> m_list;
+  locker m_lock;
+  sem m_stat;
+};
+
+// 与 threadPool 的 POOL_MPMC 模式相同的入队和出队方式
+class ring_queue
+{
+public:
+  ring_queue(): m_ring(QUEUE_CAPACITY) {}
+
+  bool push(long* task)
+  {
+    if(!m_ring.push(task))
+      return false;
+    m_event.notify();
+    return true;
+  }
+
+  int pop(long** batch)
+  {
+    int n = m_ring.pop_batch(batch, POP_BATCH);
+    for(int i=0; n == 0 && i < SPIN_COUNT; ++i)
+    {
+      cpu_relax();
+      n = m_ring.pop_batch(batch, POP_BATCH);
+    }
+    while(n == 0)
+    {
+      unsigned int key = m_event.prepare_wait();
+      n = m_ring.pop_batch(batch, POP_BATCH);
+      if(n == 0)
+      {
+        m_event.wait(key);
+        n = m_ring.pop_batch(batch, POP_BATCH);
+      }
+      else
+        m_event.cancel_wait();
+    }
+    if(m_ring.size_approx() > 0)
+      m_event.notify();
+    return n;
+  }
+
+private:
+  mpmc_queue<long*> m_ring;
+  futex_event m_event;
+};
+
+struct bench_arg
+{
+  void* queue;
+  long count;           // 生产者要放入的任务数
+  long sum;             // 消费者处理过的任务值之和，用于校验
+};
+
+static long task_value = 1;
+
+template <typename Q>
+static void push_retry(Q* q, long* task)
+{
+  // 队列满时让出 CPU，等消费者取走
+  while(!q->push(task))
+    sched_yield();
+}
+
+static void* list_producer(void* arg)
+{
+  bench_arg* a = (bench_arg*) arg;
+  for(long i=0; i<a->count; ++i)
+    push_retry((list_queue*) a->queue, &task_value);
+  return NULL;
+}
+
+static void* list_consumer(void* arg)
+{
+  bench_arg* a = (bench_arg*) arg;
+  list_queue* q = (list_queue*) a->queue;
+  while(true)
+  {
+    long* task = q->pop();
+    if(task == STOP)
+      break;
+    a->sum += *task;
+  }
+  return NULL;
+}
+
+static void* ring_producer(void* arg)
+{
+  bench_arg* a = (bench_arg*) arg;
+  for(long i=0; i<a->count; ++i)
+    push_retry((ring_queue*) a->queue, &task_value);
+  return NULL;
+}
+
+static void* ring_consumer(void* arg)
+{
+  bench_arg* a = (bench_arg*) arg;
+  ring_queue* q = (ring_queue*) a->queue;
+  long* batch[POP_BATCH];
+  bool stop = false;
+  while(!stop)
+  {
+    int n = q->pop(batch);
+    for(int i=0; i<n; ++i)
+    {
+      // 一批中取到了结束标记：把它之后的任务还回去，留给其他消费者
+      if(batch[i] == STOP)
+      {
+        for(int j=i+1; j<n; ++j)
+          push_retry(q, batch[j]);
+        stop = true;
+        break;
+      }
+      a->sum += *batch[i];
+    }
+  }
+  return NULL;
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Q>
+static void run(const char* name, int threads, long total, void* (*producer)(void*), void* (*consumer)(void*))
+{
+  Q queue;
+  std::vector<pthread_t> tids(threads * 2);
+  std::vector<bench_arg> args(threads * 2);
+  long per_producer = total / threads;
+
+  double start = now_sec();
+  for(int i=0; i<threads; ++i)
+  {
+    args[i].queue = &queue;
+    args[i].count = 0;
+    args[i].sum = 0;
+    pthread_create(&tids[i], NULL, consumer, &args[i]);
+  }
+  for(int i=threads; i<threads * 2; ++i)
+  {
+    args[i].queue = &queue;
+    args[i].count = per_producer;
+    args[i].sum = 0;
+    pthread_create(&tids[i], NULL, producer, &args[i]);
+  }
+  for(int i=threads; i<threads * 2; ++i)
+    pthread_join(tids[i], NULL);
+  // 所有任务都已入队，再给每个消费者放一个结束标记
+  for(int i=0; i<threads; ++i)
+    push_retry(&queue, STOP);
+  long sum = 0;
+  for(int i=0; i<threads; ++i)
+  {
+    pthread_join(tids[i], NULL);
+    sum += args[i].sum;
+  }
+  double elapsed = now_sec() - start;
+
+  long expect = per_producer * threads;
+  printf("%-5s %2d producers %2d consumers %10ld tasks %8.3f s %8.2f Mops/s%s\n", name, threads, threads,
+         expect, elapsed, expect / elapsed / 1e6, sum == expect ? "" : "  MISMATCH");
+}
+
+int main(int argc, char* argv[])
+{
+  long total = argc > 1 ? atol(argv[1]) : 1000000;
+  if(total <= 0)
+    total = 1000000;
+
+  for(int threads = 1; threads <= 64; threads *= 2)
+  {
+    run<list_queue>("list", threads, total, list_producer, list_consumer);
+    run<ring_queue>("mpmc", threads, total, ring_producer, ring_consumer);
+  }
+  return 0;
+}
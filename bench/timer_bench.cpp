@@ -0,0 +1,135 @@
+//
+// Created by acg on 12/29/21.
+//
+// 时间堆与时间轮的对比测试：模拟 N 个连接的定时器
+// 1. 添加：每个连接建立时添加一个定时器
+// 2. 刷新：连接活跃时推迟超时，共刷新 N * REFRESH_ROUNDS 次
+//    时间堆不支持调整位置，只能删除旧的（置空回调）再添加新的
+// 3. 删除：连接主动关闭时删除定时器
+// 4. 超时：N 个已经到期的定时器在 tick 中全部被处理
+// 用法：./timer_bench [连接数]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "../timer/time_wheel.h"
+#include "../timer/time_heap.h"
+
+static const int REFRESH_ROUNDS = 10;
+static long expired_count = 0;
+
+static void cb_func(client_data*)
+{
+  ++expired_count;
+}
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char* name, const char* op, double us, long count)
+{
+  printf("%-6s %-8s %10ld ops %10.1f ms %8.1f ns/op\n", name, op, count, us / 1000, us * 1000 / count);
+}
+
+static void bench_heap(int n, std::vector<client_data>& users, const std::vector<int>& order)
+{
+  time_heap heap;
+  std::vector<heap_timer*> timers(n);
+
+  double start = now_us();
+  for(int i=0; i<n; ++i)
+  {
+    heap_timer* timer = new heap_timer(30);
+    timer->cb_func = cb_func;
+    timer->user_data = &users[i];
+    heap.add_timer(timer);
+    timers[i] = timer;
+  }
+  report("heap", "add", now_us() - start, n);
+
+  start = now_us();
+  for(size_t i=0; i<order.size(); ++i)
+  {
+    int k = order[i];
+    heap.del_timer(timers[k]);
+    heap_timer* timer = new heap_timer(60);
+    timer->cb_func = cb_func;
+    timer->user_data = &users[k];
+    heap.add_timer(timer);
+    timers[k] = timer;
+  }
+  report("heap", "refresh", now_us() - start, order.size());
+
+  start = now_us();
+  for(int i=0; i<n; ++i)
+    heap.del_timer(timers[i]);
+  report("heap", "cancel", now_us() - start, n);
+
+  time_heap expire_heap;
+  for(int i=0; i<n; ++i)
+  {
+    heap_timer* timer = new heap_timer(-1);
+    timer->cb_func = cb_func;
+    timer->user_data = &users[i];
+    expire_heap.add_timer(timer);
+  }
+  expired_count = 0;
+  start = now_us();
+  expire_heap.tick();
+  report("heap", "expire", now_us() - start, expired_count);
+}
+
+static void bench_wheel(int n, std::vector<client_data>& users, const std::vector<int>& order)
+{
+  time_wheel wheel(n);
+  std::vector<tw_timer*> timers(n);
+
+  double start = now_us();
+  for(int i=0; i<n; ++i)
+    timers[i] = wheel.add_timer(30 * 1000, cb_func, &users[i]);
+  report("wheel", "add", now_us() - start, n);
+
+  start = now_us();
+  for(size_t i=0; i<order.size(); ++i)
+    wheel.adjust_timer(timers[order[i]], 60 * 1000);
+  report("wheel", "refresh", now_us() - start, order.size());
+
+  start = now_us();
+  for(int i=0; i<n; ++i)
+    wheel.del_timer(timers[i]);
+  report("wheel", "cancel", now_us() - start, n);
+
+  for(int i=0; i<n; ++i)
+    wheel.add_timer(0, cb_func, &users[i]);
+  usleep(time_wheel::TICK_MS * 1000);     // 等到下一个滴答，保证全部到期
+  expired_count = 0;
+  start = now_us();
+  while(wheel.tick())
+    ;
+  report("wheel", "expire", now_us() - start, expired_count);
+}
+
+int main(int argc, char* argv[])
+{
+  int n = argc > 1 ? atoi(argv[1]) : 100000;
+  if(n <= 0)
+    n = 100000;
+
+  std::vector<client_data> users(n);
+  std::vector<int> order((size_t) n * REFRESH_ROUNDS);
+  srand(1);
+  for(size_t i=0; i<order.size(); ++i)
+    order[i] = rand() % n;
+
+  printf("connections: %d, refreshes: %ld\n", n, (long) order.size());
+  bench_heap(n, users, order);
+  bench_wheel(n, users, order);
+  return 0;
+}
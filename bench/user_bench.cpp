@@ -0,0 +1,184 @@
+//
+// Created by acg on 1/4/22.
+//
+// 登录查找的吞吐对比测试
+// map：原来的 std::map<string, string>，为了没有数据竞争，查找和插入都加互斥锁
+// table：user_table，分片的开放寻址哈希表，查找不加锁
+// 每组测试 N 个线程随机查找已有的用户并校验密码，N = 1、2、4 ... 64；
+// 带 +writer 的一组同时有一个线程不断注册新用户，模拟注册高峰时的登录
+// 用法：./user_bench [用户数] [每个线程的查找次数]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "../locker/locker.h"
+#include "../CGImysql/user_table.h"
+
+// 原来的实现，加上互斥锁
+class map_table
+{
+public:
+  bool insert(const std::string& name, const std::string& passwd)
+  {
+    m_lock.lock();
+    bool ok = m_map.insert(std::make_pair(name, passwd)).second;
+    m_lock.unlock();
+    return ok;
+  }
+
+  bool check(const char* name, const char* passwd)
+  {
+    m_lock.lock();
+    std::map<std::string, std::string>::iterator it = m_map.find(name);
+    bool ok = it != m_map.end() && it->second == passwd;
+    m_lock.unlock();
+    return ok;
+  }
+
+private:
+  std::map<std::string, std::string> m_map;
+  locker m_lock;
+};
+
+static std::vector<std::string> names;
+static std::vector<std::string> passwds;
+static std::atomic<bool> writer_stop;
+
+template <typename Table>
+struct bench_arg
+{
+  Table* table;
+  long lookups;
+  unsigned int seed;
+  long hits;
+};
+
+template <typename Table>
+static void* reader(void* arg)
+{
+  bench_arg<Table>* a = (bench_arg<Table>*) arg;
+  unsigned int seed = a->seed;
+  long hits = 0;
+  size_t n = names.size();
+  for(long i=0; i<a->lookups; ++i)
+  {
+    size_t k = rand_r(&seed) % n;
+    if(a->table->check(names[k].c_str(), passwds[k].c_str()))
+      ++hits;
+  }
+  a->hits = hits;
+  return NULL;
+}
+
+template <typename Table>
+static void* writer(void* arg)
+{
+  Table* table = (Table*) arg;
+  char name[32];
+  for(long i=0; !writer_stop.load(std::memory_order_relaxed); ++i)
+  {
+    snprintf(name, sizeof(name), "new%ld", i);
+    table->insert(name, "passwd");
+  }
+  return NULL;
+}
+
+static double now_sec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Table>
+static void run(const char* name, Table* table, int threads, long lookups, bool with_writer)
+{
+  std::vector<pthread_t> tids(threads);
+  std::vector<bench_arg<Table> > args(threads);
+  pthread_t writer_tid;
+  writer_stop = false;
+  if(with_writer)
+    pthread_create(&writer_tid, NULL, writer<Table>, table);
+
+  double start = now_sec();
+  for(int i=0; i<threads; ++i)
+  {
+    args[i].table = table;
+    args[i].lookups = lookups;
+    args[i].seed = i + 1;
+    args[i].hits = 0;
+    pthread_create(&tids[i], NULL, reader<Table>, &args[i]);
+  }
+  long hits = 0;
+  for(int i=0; i<threads; ++i)
+  {
+    pthread_join(tids[i], NULL);
+    hits += args[i].hits;
+  }
+  double elapsed = now_sec() - start;
+  if(with_writer)
+  {
+    writer_stop = true;
+    pthread_join(writer_tid, NULL);
+  }
+
+  long total = lookups * threads;
+  printf("%-13s %2d threads %10ld lookups %8.3f s %8.2f Mlookups/s%s\n", name, threads, total, elapsed,
+         total / elapsed / 1e6, hits == total ? "" : "  MISMATCH");
+}
+
+template <typename Table>
+static double load(Table* table)
+{
+  double start = now_sec();
+  for(size_t i=0; i<names.size(); ++i)
+    table->insert(names[i], passwds[i]);
+  return now_sec() - start;
+}
+
+int main(int argc, char* argv[])
+{
+  long users = argc > 1 ? atol(argv[1]) : 1000000;
+  long lookups = argc > 2 ? atol(argv[2]) : 1000000;
+  if(users <= 0)
+    users = 1000000;
+  if(lookups <= 0)
+    lookups = 1000000;
+
+  names.resize(users);
+  passwds.resize(users);
+  char buf[32];
+  for(long i=0; i<users; ++i)
+  {
+    snprintf(buf, sizeof(buf), "user%ld", i);
+    names[i] = buf;
+    snprintf(buf, sizeof(buf), "pw%ld", i * 7919);
+    passwds[i] = buf;
+  }
+
+  map_table* map = new map_table;
+  printf("map   load %ld users %.3f s\n", users, load(map));
+  user_table* table = new user_table;
+  table->reserve(users);
+  printf("table load %ld users %.3f s\n", users, load(table));
+
+  for(int threads = 1; threads <= 64; threads *= 2)
+  {
+    run("map", map, threads, lookups, false);
+    run("table", table, threads, lookups, false);
+  }
+  for(int threads = 1; threads <= 64; threads *= 2)
+  {
+    run("map+writer", map, threads, lookups, true);
+    run("table+writer", table, threads, lookups, true);
+  }
+  delete map;
+  delete table;
+  return 0;
+}
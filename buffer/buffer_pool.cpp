@@ -0,0 +1,105 @@
+//
+// Created by acg on 12/27/21.
+//
+
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+
+buffer_pool::buffer_pool()
+{
+  for(int i=0; i<CLASS_NUMBER; ++i)
+  {
+    m_free[i] = NULL;
+    m_free_bytes[i] = 0;
+  }
+  m_bytes_in_use = 0;
+  m_bytes_free = 0;
+}
+
+buffer_pool::~buffer_pool()
+{
+  for(int i=0; i<CLASS_NUMBER; ++i)
+  {
+    while(m_free[i])
+    {
+      free_node* node = m_free[i];
+      m_free[i] = node->next;
+      ::free(node);
+    }
+  }
+}
+
+buffer_pool* buffer_pool::get_instance()
+{
+  static buffer_pool pool;
+  return &pool;
+}
+
+// 大小所在的级别，0 级为 MIN_SIZE，每级翻倍
+int buffer_pool::size_class(int size)
+{
+  int c = 0;
+  int class_size = MIN_SIZE;
+  while(class_size < size)
+  {
+    class_size <<= 1;
+    ++c;
+  }
+  return c;
+}
+
+char* buffer_pool::alloc(int size, int* real_size)
+{
+  if(size > MAX_SIZE)
+    return NULL;
+
+  int c = size_class(size);
+  int class_size = MIN_SIZE << c;
+  char* buf = NULL;
+
+  m_lock[c].lock();
+  if(m_free[c])
+  {
+    buf = (char*) m_free[c];
+    m_free[c] = m_free[c]->next;
+    m_free_bytes[c] -= class_size;
+    m_bytes_free -= class_size;
+  }
+  m_lock[c].unlock();
+
+  if(!buf)
+  {
+    buf = (char*) malloc(class_size);
+    if(!buf)
+      return NULL;
+  }
+  m_bytes_in_use += class_size;
+  *real_size = class_size;
+  return buf;
+}
+
+void buffer_pool::free(char* buf, int size)
+{
+  if(!buf)
+    return;
+
+  int c = size_class(size);
+  m_bytes_in_use -= size;
+
+  m_lock[c].lock();
+  if(m_free_bytes[c] + size <= MAX_FREE_BYTES)
+  {
+    free_node* node = (free_node*) buf;
+    node->next = m_free[c];
+    m_free[c] = node;
+    m_free_bytes[c] += size;
+    m_bytes_free += size;
+    buf = NULL;
+  }
+  m_lock[c].unlock();
+
+  // 空闲的已经够多了，直接还给系统
+  if(buf)
+    ::free(buf);
+}
@@ -0,0 +1,57 @@
+//
+// Created by acg on 12/27/21.
+//
+
+#ifndef XLAOTINYWEBSERVER_BUFFER_POOL_H
+#define XLAOTINYWEBSERVER_BUFFER_POOL_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include "../locker/locker.h"
+
+// 按大小分级的缓冲区池
+// 缓冲区大小为 2KB、4KB ... 64KB 共 6 级，申请时向上取整到所在的级别
+// 释放的缓冲区挂在对应级别的空闲链表上（链表指针就存在缓冲区本身），下次申请直接复用，不用再 malloc
+// 每级空闲的缓冲区超过 MAX_FREE_BYTES 时直接归还给系统，避免高峰过后一直占着内存
+class buffer_pool
+{
+public:
+  static const int MIN_SIZE = 2048;               // 最小的缓冲区
+  static const int MAX_SIZE = 65536;              // 最大的缓冲区
+  static const int CLASS_NUMBER = 6;              // 级别数：2K、4K、8K、16K、32K、64K
+  static const size_t MAX_FREE_BYTES = 8 * 1024 * 1024;   // 每级最多缓存的空闲字节数
+
+  static buffer_pool* get_instance();
+
+  // 申请至少 size 字节的缓冲区，实际大小写入 real_size；size 超过 MAX_SIZE 返回 NULL
+  char* alloc(int size, int* real_size);
+  // 归还缓冲区，size 必须是 alloc 返回的实际大小
+  void free(char* buf, int size);
+
+  size_t bytes_in_use() { return m_bytes_in_use.load(std::memory_order_relaxed); }   // 正在被使用的字节数
+  size_t bytes_free() { return m_bytes_free.load(std::memory_order_relaxed); }       // 空闲链表上的字节数
+
+  buffer_pool(const buffer_pool&)=delete;
+  buffer_pool& operator=(const buffer_pool&)=delete;
+
+private:
+  buffer_pool();
+  ~buffer_pool();
+
+  static int size_class(int size);
+
+private:
+  struct free_node
+  {
+    free_node* next;
+  };
+
+  locker m_lock[CLASS_NUMBER];                    // 每级一把锁，不同大小的申请互不影响
+  free_node* m_free[CLASS_NUMBER];                // 每级的空闲链表
+  size_t m_free_bytes[CLASS_NUMBER];              // 每级空闲链表上的字节数
+  std::atomic<size_t> m_bytes_in_use;
+  std::atomic<size_t> m_bytes_free;
+};
+
+#endif //XLAOTINYWEBSERVER_BUFFER_POOL_H
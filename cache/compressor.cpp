@@ -0,0 +1,132 @@
+//
+// Created by acg on 1/8/22.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compressor.h"
+
+#ifdef BROTLI
+#include <brotli/encode.h>
+#endif
+
+static const int GZIP_LEVEL = 9;
+static const int GZIP_WINDOW = 15 + 16;         // +16 让 zlib 输出 gzip 格式的头部和尾部
+static const int GZIP_MEM_LEVEL = 9;
+#ifdef BROTLI
+static const int BROTLI_QUALITY = 9;            // 11 的压缩时间是 9 的十倍以上，体积只小几个百分点
+#endif
+
+bool compressor::supported(CONTENT_ENCODING encoding)
+{
+  switch(encoding)
+  {
+    case ENCODING_GZIP:
+      return true;
+#ifdef BROTLI
+    case ENCODING_BR:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+bool compressor::compressible(const char* mime)
+{
+  static const char* const types[] = {
+    "application/javascript",
+    "application/json",
+    "image/svg+xml",
+  };
+  if(strncmp(mime, "text/", 5) == 0)
+    return true;
+  for(size_t i=0; i<sizeof(types) / sizeof(types[0]); ++i)
+  {
+    if(strcmp(mime, types[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+const char* compressor::name(CONTENT_ENCODING encoding)
+{
+  switch(encoding)
+  {
+    case ENCODING_BR: return "br";
+    case ENCODING_GZIP: return "gzip";
+    default: return "identity";
+  }
+}
+
+char* compressor::encode(CONTENT_ENCODING encoding, const char* src, size_t len, size_t* out_len)
+{
+  if(!supported(encoding))
+    return NULL;
+  switch(encoding)
+  {
+    case ENCODING_GZIP:
+      return encode_gzip(src, len, out_len);
+    case ENCODING_BR:
+      return encode_br(src, len, out_len);
+    default:
+      return NULL;
+  }
+}
+
+// 整个文件一次 deflate 完，输出空间按 deflateBound 预留，不需要分段
+char* compressor::encode_gzip(const char* src, size_t len, size_t* out_len)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if(deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, GZIP_WINDOW, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t bound = deflateBound(&stream, len);
+  char* out = (char*) malloc(bound);
+  if(!out)
+  {
+    deflateEnd(&stream);
+    return NULL;
+  }
+  stream.next_in = (Bytef*) src;
+  stream.avail_in = len;
+  stream.next_out = (Bytef*) out;
+  stream.avail_out = bound;
+  int ret = deflate(&stream, Z_FINISH);
+  *out_len = stream.total_out;
+  deflateEnd(&stream);
+  if(ret != Z_STREAM_END)
+  {
+    free(out);
+    return NULL;
+  }
+  return out;
+}
+
+char* compressor::encode_br(const char* src, size_t len, size_t* out_len)
+{
+#ifdef BROTLI
+  size_t bound = BrotliEncoderMaxCompressedSize(len);
+  if(bound == 0)
+    return NULL;
+  char* out = (char*) malloc(bound);
+  if(!out)
+    return NULL;
+  *out_len = bound;
+  if(!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                            len, (const uint8_t*) src, out_len, (uint8_t*) out))
+  {
+    free(out);
+    return NULL;
+  }
+  return out;
+#else
+  (void) src;
+  (void) len;
+  (void) out_len;
+  return NULL;
+#endif
+}
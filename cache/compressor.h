@@ -0,0 +1,41 @@
+//
+// Created by acg on 1/8/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_COMPRESSOR_H
+#define XLAOTINYWEBSERVER_COMPRESSOR_H
+
+#include <stddef.h>
+
+//#define BROTLI        // 同时生成 br 变体，需要在 makefile 中加上 -lbrotlienc
+
+// 静态文件的压缩编码，顺序就是 q 值相同时的优先顺序
+enum CONTENT_ENCODING
+{
+  ENCODING_BR = 0,
+  ENCODING_GZIP,
+  ENCODING_NUMBER,
+  ENCODING_IDENTITY = ENCODING_NUMBER     // 不压缩
+};
+
+// 把静态文件压缩成 Content-Encoding 对应的格式，结果由 file_cache 保存为文件的变体
+// 只在第一次需要时压缩一次，所以都用较高的压缩级别
+class compressor
+{
+public:
+  static const size_t MIN_SIZE = 256;           // 更小的文件压缩后节省的字节抵不上 Content-Encoding 头部
+  static const size_t MAX_SIZE = 1 << 20;       // 更大的文件压缩太慢，会长时间占用工作线程
+
+  static bool supported(CONTENT_ENCODING encoding);   // 是否编译进了这种编码
+  static bool compressible(const char* mime);         // 文本类的 Content-Type 才值得压缩
+  static const char* name(CONTENT_ENCODING encoding); // Content-Encoding 中的名称
+
+  // 压缩 [src, src + len)，返回 malloc 申请的结果，长度写入 out_len；失败返回 NULL
+  static char* encode(CONTENT_ENCODING encoding, const char* src, size_t len, size_t* out_len);
+
+private:
+  static char* encode_gzip(const char* src, size_t len, size_t* out_len);
+  static char* encode_br(const char* src, size_t len, size_t* out_len);
+};
+
+#endif //XLAOTINYWEBSERVER_COMPRESSOR_H
@@ -0,0 +1,542 @@
+//
+// Created by acg on 12/20/21.
+//
+
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <set>
+
+#include "file_cache.h"
+#include "../log/log.h"
+
+// 扩展名与 Content-Type 的对应关系
+static const char* mime_types[][2] =
+{
+  {"html", "text/html"},
+  {"htm",  "text/html"},
+  {"css",  "text/css"},
+  {"js",   "application/javascript"},
+  {"txt",  "text/plain"},
+  {"jpg",  "image/jpeg"},
+  {"jpeg", "image/jpeg"},
+  {"png",  "image/png"},
+  {"gif",  "image/gif"},
+  {"ico",  "image/x-icon"},
+  {"svg",  "image/svg+xml"},
+  {"mp4",  "video/mp4"},
+  {"webm", "video/webm"},
+  {"mp3",  "audio/mpeg"},
+  {"json", "application/json"},
+};
+
+static const char* get_mime(const char* path)
+{
+  const char* dot = strrchr(path, '.');
+  if(dot && !strchr(dot, '/'))
+  {
+    for(size_t i=0; i<sizeof(mime_types) / sizeof(mime_types[0]); ++i)
+    {
+      if(strcasecmp(dot + 1, mime_types[i][0]) == 0)
+        return mime_types[i][1];
+    }
+  }
+  return "application/octet-stream";
+}
+
+// 压缩后不够小的文件记为这个变体，之后不再尝试
+static file_variant no_variant = { -1, 0, NULL };
+
+// 路径所在的目录，直接截取最后一个 '/' 之前的部分，保证和 inotify 事件拼出的路径一致
+static string get_dir(const string& path)
+{
+  size_t pos = path.rfind('/');
+  if(pos == string::npos)
+    return ".";
+  return path.substr(0, pos);
+}
+
+file_cache::file_cache()
+{
+  m_bytes = 0;
+  m_max_bytes = 0;
+  m_lru.head = m_lru.tail = NULL;
+  m_lru.count = 0;
+  m_negative = m_lru;
+  m_clock = 0;
+  m_generation = 0;
+  m_enabled = false;
+  m_inotify_fd = -1;
+}
+
+file_cache::~file_cache()
+{
+  m_lock.wrlock();
+  for(auto it = m_entries.begin(); it != m_entries.end(); ++it)
+    release(it->second);
+  m_entries.clear();
+  m_lock.unlock();
+  if(m_inotify_fd != -1)
+    close(m_inotify_fd);
+}
+
+file_cache* file_cache::get_instance()
+{
+  static file_cache cache;
+  return &cache;
+}
+
+bool file_cache::init(size_t max_bytes)
+{
+  m_max_bytes = max_bytes;
+
+  m_inotify_fd = inotify_init1(IN_CLOEXEC);
+  if(m_inotify_fd < 0)
+  {
+    // 无法感知文件变化时不缓存，每次请求都重新读取
+    LOG_ERROR("inotify_init error:%d, file cache disabled", errno);
+    return false;
+  }
+
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, inotify_thread, this) != 0)
+  {
+    close(m_inotify_fd);
+    m_inotify_fd = -1;
+    return false;
+  }
+  pthread_detach(tid);
+
+  m_enabled = true;
+  return true;
+}
+
+file_entry* file_cache::acquire(const char* path)
+{
+  if(m_enabled)
+  {
+    // 命中：只加读锁
+    m_lock.rdlock();
+    auto it = m_entries.find(path);
+    if(it != m_entries.end())
+    {
+      file_entry* entry = it->second;
+      ++entry->ref;           // 持有读锁时加引用，写者无法在此期间释放它
+      entry->last_access.store(++m_clock, std::memory_order_relaxed);
+      m_lock.unlock();
+      return entry;
+    }
+    m_lock.unlock();
+  }
+
+  // 未命中：先监听目录再读取文件，之后文件的任何变化都会产生事件
+  // 读取期间发生的失效通过 m_generation 发现，这种情况下读到的条目不放进缓存
+  string key(path);
+  unsigned long generation = m_generation.load();
+  bool cacheable = m_enabled && watch_dir(get_dir(key));
+
+  file_entry* entry = load(path);
+  if(!entry)
+    return NULL;
+  entry->ref = 1;             // 调用者持有的引用
+
+  if(!cacheable || entry_bytes(entry) > m_max_bytes)
+    return entry;
+
+  m_lock.wrlock();
+  auto it = m_entries.find(key);
+  if(it != m_entries.end())
+  {
+    // 其他线程已经先加载了
+    file_entry* exist = it->second;
+    ++exist->ref;
+    m_lock.unlock();
+    release(entry);
+    return exist;
+  }
+  if(generation != m_generation.load())
+  {
+    m_lock.unlock();
+    return entry;
+  }
+  ++entry->ref;               // 缓存持有的引用
+  m_entries[key] = entry;
+  entry->lru_stamp = entry->last_access.load(std::memory_order_relaxed);
+  lru_push(list_of(entry), entry);
+  if(entry->exist)
+    m_bytes += entry_bytes(entry);
+  evict_locked(entry);
+  m_lock.unlock();
+  return entry;
+}
+
+void file_cache::release(file_entry* entry)
+{
+  if(!entry)
+    return;
+  // 最后一个引用释放时才真正关闭文件
+  if(entry->ref.fetch_sub(1) == 1)
+  {
+    if(entry->address)
+      munmap(entry->address, entry->st.st_size);
+    if(entry->fd != -1)
+      close(entry->fd);
+    free(entry->content.load());
+    for(int i=0; i<=ENCODING_NUMBER; ++i)
+    {
+      delete entry->headers[i][0].load();
+      delete entry->headers[i][1].load();
+    }
+    for(int i=0; i<ENCODING_NUMBER; ++i)
+    {
+      file_variant* variant = entry->variants[i].load();
+      if(variant && variant != &no_variant)
+      {
+        munmap(variant->address, variant->size);
+        close(variant->fd);
+        delete variant;
+      }
+    }
+    delete entry;
+  }
+}
+
+char* file_cache::map_file(file_entry* entry)
+{
+  if(!entry->exist || entry->fd == -1 || entry->st.st_size == 0)
+    return NULL;
+
+  entry->map_lock.lock();
+  if(!entry->address)
+  {
+    void* address = mmap(0, entry->st.st_size, PROT_READ, MAP_PRIVATE, entry->fd, 0);
+    if(address != MAP_FAILED)
+      entry->address = (char*) address;
+  }
+  entry->map_lock.unlock();
+  return entry->address;
+}
+
+file_variant* file_cache::get_variant(file_entry* entry, CONTENT_ENCODING encoding)
+{
+  // 不缓存时条目用完就释放，压缩的结果留不下来
+  if(!m_enabled || !entry->compressible || !compressor::supported(encoding))
+    return NULL;
+  file_variant* variant = entry->variants[encoding].load(std::memory_order_acquire);
+  if(!variant)
+  {
+    entry->variant_lock.lock();
+    variant = entry->variants[encoding].load(std::memory_order_acquire);
+    if(!variant)
+    {
+      variant = build_variant(entry, encoding);
+      if(!variant)
+        variant = &no_variant;
+      // 发布和计入预算在同一次写锁内，remove_locked 减去的字节数和加上的一致
+      m_lock.wrlock();
+      entry->variants[encoding].store(variant, std::memory_order_release);
+      auto it = m_entries.find(entry->path);
+      if(it != m_entries.end() && it->second == entry)
+      {
+        m_bytes += variant->size;
+        evict_locked(entry);
+      }
+      m_lock.unlock();
+    }
+    entry->variant_lock.unlock();
+  }
+  return variant == &no_variant ? NULL : variant;
+}
+
+// 压缩到 memfd 中，写完后封印，之后只能读取
+file_variant* file_cache::build_variant(file_entry* entry, CONTENT_ENCODING encoding)
+{
+  char* address = map_file(entry);
+  if(!address)
+    return NULL;
+  size_t size = 0;
+  char* data = compressor::encode(encoding, address, entry->st.st_size, &size);
+  if(!data)
+    return NULL;
+  // 至少小一成才使用压缩变体，否则省下的流量抵不上客户端解压
+  if(size == 0 || size >= (size_t) entry->st.st_size / 10 * 9)
+  {
+    free(data);
+    return NULL;
+  }
+
+  int fd = memfd_create(compressor::name(encoding), MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd < 0)
+  {
+    free(data);
+    return NULL;
+  }
+  size_t written = 0;
+  while(written < size)
+  {
+    ssize_t ret = write(fd, data + written, size - written);
+    if(ret < 0 && errno == EINTR)
+      continue;
+    if(ret <= 0)
+      break;
+    written += ret;
+  }
+  free(data);
+  void* mapped = MAP_FAILED;
+  if(written == size && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0)
+    mapped = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(mapped == MAP_FAILED)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  file_variant* variant = new file_variant;
+  variant->fd = fd;
+  variant->size = size;
+  variant->address = (char*) mapped;
+  LOG_INFO("file cache %s %s %ld -> %ld", compressor::name(encoding), entry->path.c_str(),
+           (long) entry->st.st_size, (long) size);
+  return variant;
+}
+
+void file_cache::invalidate(const string& path)
+{
+  m_lock.wrlock();
+  ++m_generation;
+  auto it = m_entries.find(path);
+  if(it != m_entries.end())
+    remove_locked(it->second);
+  m_lock.unlock();
+}
+
+// dir 为空时清空整个缓存
+void file_cache::invalidate_dir(const string& dir)
+{
+  string prefix = dir.empty() ? "" : dir + "/";
+  m_lock.wrlock();
+  ++m_generation;
+  for(auto it = m_entries.begin(); it != m_entries.end(); )
+  {
+    file_entry* entry = it->second;
+    ++it;
+    if(entry->path.compare(0, prefix.size(), prefix) == 0)
+      remove_locked(entry);
+  }
+  m_lock.unlock();
+}
+
+file_entry* file_cache::load(const char* path)
+{
+  file_entry* entry = new file_entry;
+  entry->path = path;
+  entry->fd = -1;
+  entry->address = NULL;
+  entry->content = NULL;
+  for(int i=0; i<=ENCODING_NUMBER; ++i)
+    entry->headers[i][0] = entry->headers[i][1] = NULL;
+  for(int i=0; i<ENCODING_NUMBER; ++i)
+    entry->variants[i] = NULL;
+  entry->compressible = false;
+  entry->mime = get_mime(path);
+  entry->ref = 0;
+  entry->last_access = ++m_clock;
+  entry->lru_prev = entry->lru_next = NULL;
+  entry->lru_stamp = 0;
+
+  if(stat(path, &entry->st) < 0)
+  {
+    // 只有确定不存在时才做负缓存
+    if(errno != ENOENT && errno != ENOTDIR)
+    {
+      delete entry;
+      return NULL;
+    }
+    memset(&entry->st, 0, sizeof(entry->st));
+    entry->exist = false;
+    return entry;
+  }
+  entry->exist = true;
+
+  // 目录和其他用户不可读的文件只缓存状态，由调用者返回对应的错误
+  if(S_ISREG(entry->st.st_mode) && (entry->st.st_mode & S_IROTH))
+  {
+    entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(entry->fd < 0)
+    {
+      delete entry;
+      return NULL;
+    }
+    entry->compressible = compressor::compressible(entry->mime) &&
+                          (size_t) entry->st.st_size >= compressor::MIN_SIZE &&
+                          (size_t) entry->st.st_size <= compressor::MAX_SIZE;
+  }
+  return entry;
+}
+
+size_t file_cache::entry_bytes(file_entry* entry)
+{
+  size_t bytes = sizeof(file_entry) + entry->path.size();
+  if(entry->exist)
+    bytes += entry->st.st_size;
+  for(int i=0; i<ENCODING_NUMBER; ++i)
+  {
+    file_variant* variant = entry->variants[i].load(std::memory_order_relaxed);
+    if(variant)
+      bytes += variant->size;
+  }
+  return bytes;
+}
+
+void file_cache::remove_locked(file_entry* entry)
+{
+  m_entries.erase(entry->path);
+  lru_remove(list_of(entry), entry);
+  if(entry->exist)
+    m_bytes -= entry_bytes(entry);
+  release(entry);     // 释放缓存持有的引用，正在发送的请求仍持有各自的引用
+}
+
+void file_cache::evict_locked(file_entry* keep)
+{
+  while(m_bytes > m_max_bytes && evict_one(m_lru, keep))
+    ;
+  while(m_negative.count > MAX_NEGATIVE && evict_one(m_negative, keep))
+    ;
+}
+
+// 命中时只持有读锁，不能移动链表，只更新 last_access；链表按放入时的 lru_stamp 排列
+// 淘汰时看尾部：放入之后又被访问过的条目移回头部，第一个没有被访问过的就是要淘汰的
+// 每次移动都对应至少一次访问，所以淘汰是均摊 O(1) 的，不再扫描整个表
+bool file_cache::evict_one(lru_list& list, file_entry* keep)
+{
+  for(size_t n = list.count; n > 0; --n)
+  {
+    file_entry* entry = list.tail;
+    unsigned long access = entry->last_access.load(std::memory_order_relaxed);
+    if(entry == keep || access != entry->lru_stamp)
+    {
+      lru_remove(list, entry);
+      entry->lru_stamp = access;
+      lru_push(list, entry);
+      continue;
+    }
+    LOG_INFO("file cache evict %s", entry->path.c_str());
+    remove_locked(entry);
+    return true;
+  }
+  return false;
+}
+
+void file_cache::lru_push(lru_list& list, file_entry* entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = list.head;
+  if(list.head)
+    list.head->lru_prev = entry;
+  else
+    list.tail = entry;
+  list.head = entry;
+  ++list.count;
+}
+
+void file_cache::lru_remove(lru_list& list, file_entry* entry)
+{
+  if(entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    list.head = entry->lru_next;
+  if(entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    list.tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+  --list.count;
+}
+
+bool file_cache::watch_dir(const string& dir)
+{
+  m_watch_lock.lock();
+  if(m_dir_wds.count(dir))
+  {
+    m_watch_lock.unlock();
+    return true;
+  }
+
+  int wd = inotify_add_watch(m_inotify_fd, dir.c_str(),
+                             IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+  if(wd < 0)
+  {
+    m_watch_lock.unlock();
+    return false;
+  }
+  // 同一个目录可能以不同的写法出现（如 "root/" 和 "root"），它们共用一个 wd
+  m_wd_dirs[wd].insert(dir);
+  m_dir_wds[dir] = wd;
+  m_watch_lock.unlock();
+  return true;
+}
+
+void* file_cache::inotify_thread(void* arg)
+{
+  file_cache* cache = (file_cache*) arg;
+  cache->handle_events();
+  return cache;
+}
+
+void file_cache::handle_events()
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while(true)
+  {
+    ssize_t len = read(m_inotify_fd, buf, sizeof(buf));
+    if(len <= 0)
+    {
+      if(len < 0 && errno == EINTR)
+        continue;
+      LOG_ERROR("inotify read error:%d", errno);
+      break;
+    }
+
+    for(char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len)
+    {
+      struct inotify_event* event = (struct inotify_event*) p;
+
+      // 事件队列溢出，丢失了事件，只能清空整个缓存
+      if(event->mask & IN_Q_OVERFLOW)
+      {
+        invalidate_dir("");
+        continue;
+      }
+
+      m_watch_lock.lock();
+      set<string> dirs = m_wd_dirs[event->wd];
+      if(event->mask & IN_IGNORED)
+      {
+        // 目录被删除或移走，watch 已被内核移除
+        for(auto it = dirs.begin(); it != dirs.end(); ++it)
+          m_dir_wds.erase(*it);
+        m_wd_dirs.erase(event->wd);
+      }
+      // 目录被移走后原路径上已经不是这个目录了，移除 watch，随后会收到 IN_IGNORED
+      if(event->mask & IN_MOVE_SELF)
+        inotify_rm_watch(m_inotify_fd, event->wd);
+      m_watch_lock.unlock();
+
+      for(auto it = dirs.begin(); it != dirs.end(); ++it)
+      {
+        if(event->len > 0)
+          invalidate(*it + "/" + event->name);
+        if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+          invalidate_dir(*it);
+      }
+    }
+  }
+}
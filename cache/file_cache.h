@@ -0,0 +1,137 @@
+//
+// Created by acg on 12/20/21.
+//
+
+#ifndef XLAOTINYWEBSERVER_FILE_CACHE_H
+#define XLAOTINYWEBSERVER_FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <string>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <atomic>
+
+#include "../locker/locker.h"
+#include "compressor.h"
+
+using namespace std;
+
+// 文件的一个压缩变体，保存在 memfd 中并封印为只读
+// 大的变体和原文件一样用 sendfile 发送，小的变体从只读映射和头部一起 sendmsg
+struct file_variant
+{
+  int fd;                                   // memfd
+  off_t size;                               // 压缩后的长度
+  char* address;                            // memfd 的只读映射
+};
+
+// 缓存中的一个静态文件
+// 条目只在创建时写入，之后只读，所以可以被多个线程同时使用
+struct file_entry
+{
+  string path;                              // 文件的完整路径，也是缓存的键
+  bool exist;                               // false 表示负缓存：文件不存在
+  int fd;                                   // 只读打开的文件描述符，目录或不可读的文件为 -1
+  struct stat st;                           // 文件状态
+  const char* mime;                         // 根据扩展名预先算好的 Content-Type
+  char* address;                            // 文件的映射地址，第一次需要时才映射
+  locker map_lock;                          // 保护惰性映射
+  // 小文件的内容，由 http_conn 第一次命中时读入内存，之后直接从内存发送
+  std::atomic<char*> content;
+  // 整个文件的 200 响应头部，除了最后的 Date 都已经序列化好，由 http_conn 第一次使用时生成
+  // 第一维是 CONTENT_ENCODING（最后一个是不压缩），第二维 [0] Connection: close，[1] keep-alive
+  std::atomic<std::string*> headers[ENCODING_NUMBER + 1][2];
+  bool compressible;                        // 文本类的文件，大小在 compressor 的范围内
+  // 各 CONTENT_ENCODING 的压缩变体，由 file_cache::get_variant 第一次需要时生成
+  std::atomic<file_variant*> variants[ENCODING_NUMBER];
+  locker variant_lock;                      // 同一个文件只由一个线程压缩
+  std::atomic<int> ref;                     // 引用计数：缓存持有一次，每个正在发送的请求各持有一次
+  std::atomic<unsigned long> last_access;   // 最近一次访问的时钟，用于 LRU 淘汰
+  // 以下由 file_cache 在持有写锁时修改
+  file_entry* lru_prev;                     // 所在 LRU 链表中的前后条目
+  file_entry* lru_next;
+  unsigned long lru_stamp;                  // 放到链表头部时的 last_access
+};
+
+// 进程内共享的静态文件缓存
+// 1. 读写锁保护哈希表，命中时只加读锁，多个工作线程可以同时查找
+// 2. 引用计数保证条目被淘汰或失效后，正在发送它的请求仍然可以安全使用
+// 3. 不存在的文件也会缓存（负缓存），重复的 404 不再调用 stat；负缓存单独限制条目数，不占用字节预算
+// 4. 所有条目的大小之和不超过字节预算，超出时从 LRU 链表的尾部淘汰最久未访问的条目，均摊 O(1)
+// 5. inotify 监听已缓存文件所在的目录，文件被修改、删除、新建时让对应条目失效
+// 6. 可压缩的文件第一次被请求某种编码时压缩一次，变体随条目一起失效和淘汰，计入字节预算
+class file_cache
+{
+public:
+  static const size_t MAX_NEGATIVE = 4096;      // 负缓存最多的条目数，随机 url 的 404 不会挤掉正常的文件
+
+  static file_cache* get_instance();
+
+  // 初始化缓存的字节预算，并启动 inotify 监听线程
+  bool init(size_t max_bytes);
+
+  // 获取路径对应的条目，引用计数 +1，用完后必须调用 release
+  // 打开文件失败返回 NULL
+  file_entry* acquire(const char* path);
+  void release(file_entry* entry);
+
+  // 返回文件的只读映射，第一次调用时才建立映射，失败返回 NULL
+  char* map_file(file_entry* entry);
+
+  // 返回文件某种编码的压缩变体，第一次调用时才压缩；不支持这种编码、压缩失败或者压缩后不够小时返回 NULL
+  file_variant* get_variant(file_entry* entry, CONTENT_ENCODING encoding);
+
+  // 让某个路径的条目失效
+  void invalidate(const string& path);
+  void invalidate_dir(const string& dir);       // 让目录下所有条目失效
+
+  file_cache(const file_cache&)=delete;
+  file_cache& operator=(const file_cache&)=delete;
+
+private:
+  file_cache();
+  ~file_cache();
+
+  file_entry* load(const char* path);           // 不加锁地读取文件信息，生成新的条目
+  size_t entry_bytes(file_entry* entry);        // 条目计入预算的字节数，包括已生成的压缩变体
+  file_variant* build_variant(file_entry* entry, CONTENT_ENCODING encoding);
+  void remove_locked(file_entry* entry);        // 从表中摘除条目，调用者持有写锁
+  void evict_locked(file_entry* keep);          // 淘汰到预算以内，调用者持有写锁
+
+  // 双向链表，头部是最近放入的条目
+  struct lru_list
+  {
+    file_entry* head;
+    file_entry* tail;
+    size_t count;
+  };
+  lru_list& list_of(file_entry* entry) { return entry->exist ? m_lru : m_negative; }
+  void lru_push(lru_list& list, file_entry* entry);   // 放到头部
+  void lru_remove(lru_list& list, file_entry* entry);
+  bool evict_one(lru_list& list, file_entry* keep);   // 淘汰链表中最久未访问的一个条目
+  bool watch_dir(const string& dir);            // 监听目录
+
+  static void* inotify_thread(void* arg);
+  void handle_events();
+
+private:
+  rwlocker m_lock;                                  // 保护 m_entries、m_bytes 和两个 LRU 链表
+  unordered_map<string, file_entry*> m_entries;     // 路径 -> 条目
+  size_t m_bytes;                                   // 已缓存的存在的文件的总字节数
+  lru_list m_lru;                                   // 存在的文件
+  lru_list m_negative;                              // 负缓存
+  size_t m_max_bytes;                               // 字节预算
+  std::atomic<unsigned long> m_clock;               // LRU 时钟
+  std::atomic<unsigned long> m_generation;          // 每次失效 +1，用于发现加载期间发生的失效
+  bool m_enabled;                                   // inotify 可用时才缓存，否则无法感知文件变化
+
+  locker m_watch_lock;                              // 保护下面两个表
+  int m_inotify_fd;
+  map<int, set<string> > m_wd_dirs;                 // watch 描述符 -> 目录
+  map<string, int> m_dir_wds;                       // 目录 -> watch 描述符
+};
+
+#endif //XLAOTINYWEBSERVER_FILE_CACHE_H
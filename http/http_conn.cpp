@@ -2,12 +2,16 @@
 // Created by acg on 11/12/21.
 //
 
-#include <map>
 #include <fstream>
 #include <mysql/mysql.h>
+#include <sys/sendfile.h>
+#include <random>
+#include <limits.h>
 
 #include "http_conn.h"
 #include "../log/log.h"
+#include "../buffer/buffer_pool.h"
+#include "../CGImysql/user_table.h"
 
 #define connfdET    //ET非阻塞
 //#define connfdLT      // 水平阻塞
@@ -15,49 +19,111 @@
 #define listenfdET
 //#define listenfdLT
 
-// 定义 http 响应的一些状态信息
-const char* ok_200_title = "OK";
+#define SENDFILE      // 静态文件：头部 send(MSG_MORE) + 文件 sendfile 零拷贝发送
+//#define MMAPFILE      // 静态文件：mmap 后与头部一起 writev 发送
 
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax.\n";
+// m_request 中片段的偏移是 16 位
+static_assert(http_conn::MAX_READ_BUFFER_SIZE <= http_request::MAX_BUFFER, "read buffer too large for http_request");
 
-const char* error_403_title = "Forbidden";
+// 定义 http 响应的一些状态信息，状态行由 http_response 预先编码
+const char* error_400_form = "Your request has bad syntax.\n";
 const char* error_403_form = "You don't have permission to get the file.\n";
-
-const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found.\n";
-
-const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the request file.\n";
+const char* error_501_form = "The request uses a feature the server does not support.\n";
+
+// 错误页面的头部在启动时序列化一次，之后所有连接直接发送同一块内存，只在发送时补上 Date
+struct error_response
+{
+  string header[2];             // [0] Connection: close，[1] keep-alive，以 "Date: " 结尾
+  const char* form;
+  int form_len;
+
+  error_response(int status, const char* form): form(form), form_len(strlen(form))
+  {
+    char buf[256];
+    for(int i=0; i<2; ++i)
+    {
+      http_response builder;
+      builder.init(buf, sizeof(buf));
+      builder.begin();
+      builder.status_line(status);
+      builder.content_length(form_len);
+      builder.connection(i == 1);
+      builder.date_name();
+      char* base = NULL;
+      int len = 0;
+      if(builder.end(&base, &len))
+        header[i].assign(base, len);
+    }
+  }
+};
+
+static const error_response error_400_response(400, error_400_form);
+static const error_response error_403_response(403, error_403_form);
+static const error_response error_404_response(404, error_404_form);
+static const error_response error_500_response(500, error_500_form);
+static const error_response error_501_response(501, error_501_form);
+
+// 不超过该大小的文件，内容读入内存缓存在文件缓存条目中，和头部一起由一次 sendmsg 发出
+#define SMALL_FILE_SIZE 16384
 
 // root 文件夹的路径
 const char* doc_root = "/home/acg/xlaoTinyWebServer/root";
 
-// 将表中的用户名和密码放入 map 中
-map<string, string> users;
-locker m_lock;
+// 将表中的用户名和密码放入并发哈希表中，登录查找不加锁
+user_table users;
 
-void http_conn::init_mysql_result(connection_pool *connPool)
+// 异步数据库操作的完成回调，在 main.cpp 中，把连接重新交给线程池或者关闭
+extern void db_complete(sql_task* task);
+
+// 注册时插入的用户
+static const sql_insert user_insert = {"INSERT INTO user(username,passwd) VALUES", 2};
+
+// 用户表是否已经加载完，加载完之前哈希表中查不到的用户还要到数据库中确认
+static std::atomic<bool> users_loaded(false);
+
+// 从数据库加载用户表，在后台线程中执行
+static void load_users(connection_pool *connPool)
 {
   // 从连接池中取出一个连接
   MYSQL *mysql = NULL;
   connectionRAII mysqlConn(&mysql, connPool);
+  if(!mysql)
+    return;
+
+  // 用户数的估计值，只用来预先分配哈希表，加载时不再扩容
+  if(!mysql_query(mysql, "SELECT TABLE_ROWS FROM information_schema.TABLES "
+                         "WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='user'"))
+  {
+    MYSQL_RES *result = mysql_store_result(mysql);
+    if(result)
+    {
+      MYSQL_ROW row = mysql_fetch_row(result);
+      if(row && row[0])
+        users.reserve(strtoull(row[0], NULL, 10));
+      mysql_free_result(result);
+    }
+  }
 
   // 从 user 表中检索 username, passwd
   if(mysql_query(mysql, "SELECT username,passwd FROM user"))
   {
     // 失败返回非0,出错则写入 error 日志中
     LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+    return;
   }
 
-  // 从表中检索完整的结果集
-  MYSQL_RES *result = mysql_store_result(mysql);
-
-  int num_fields = mysql_num_fields(result);    // 行内值的列数
-
-  MYSQL_FIELD *fields = mysql_fetch_fields(result);   // 返回所有字段形成的数组
+  // 逐行从服务器读取，不在客户端缓存整张表
+  MYSQL_RES *result = mysql_use_result(mysql);
+  if(!result)
+  {
+    LOG_ERROR("SELECT error:%s\n", mysql_error(mysql));
+    return;
+  }
 
   // 检索结果集的下一行
+  long count = 0;
   while(MYSQL_ROW row = mysql_fetch_row(result))
   {
     // +----------+--------+
@@ -66,12 +132,65 @@ void http_conn::init_mysql_result(connection_pool *connPool)
     // | name     | passwd |
     // | 56       | 5627   |
     // +----------+--------+
-    string temp1(row[0]);     // username
-    string temp2(row[1]);     // passwd
-    users[temp1] = temp2;       // 放入到 map 中
+    if(!row[0] || !row[1])
+      continue;
+    users.assign(row[0], row[1]);       // 放入到哈希表中
+    ++count;
   }
+  // 读到一半连接出错时 mysql_fetch_row 也返回 NULL
+  bool ok = mysql_errno(mysql) == 0;
+  if(!ok)
+    LOG_ERROR("load users error:%s", mysql_error(mysql));
+  mysql_free_result(result);
+  if(!ok)
+    return;
+
+  users_loaded.store(true, std::memory_order_release);
+  LOG_INFO("load %ld users", count);
 }
 
+static void* load_users_thread(void* arg)
+{
+  load_users((connection_pool*) arg);
+  mysql_thread_end();
+  return NULL;
+}
+
+// 在后台线程中加载用户表，服务器不等待加载完就开始接受请求
+// 加载完之前，登录时哈希表中查不到的用户到数据库中确认
+void http_conn::init_mysql_result(connection_pool *connPool)
+{
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, load_users_thread, connPool) != 0)
+  {
+    load_users(connPool);
+    return;
+  }
+  pthread_detach(tid);
+}
+
+#ifndef ASYNCSQL
+// 加载完用户表之前，到数据库中查询用户的密码（同步模式）
+static bool query_passwd(MYSQL* mysql, const char* name, string* passwd)
+{
+  char escaped[200];
+  mysql_real_escape_string(mysql, escaped, name, strlen(name));
+  char sql[256];
+  snprintf(sql, sizeof(sql), "SELECT passwd FROM user WHERE username='%s'", escaped);
+  if(mysql_query(mysql, sql))
+    return false;
+  MYSQL_RES *result = mysql_store_result(mysql);
+  if(!result)
+    return false;
+  MYSQL_ROW row = mysql_fetch_row(result);
+  bool found = row && row[0];
+  if(found)
+    *passwd = row[0];
+  mysql_free_result(result);
+  return found;
+}
+#endif
+
 // 设置 fd 为非阻塞
 int setNonBlocking(int fd)
 {
@@ -136,26 +255,32 @@ void modfd(int epollfd, int fd, int ev)
 }
 
 // 初始化 static 变量
-int http_conn::m_user_count = 0;
-int http_conn::m_epollfd = -1;
+std::atomic<int> http_conn::m_user_count(0);
 
-// 关闭连接
+// 关闭连接，由工作线程调用
+// 定时器属于接受连接的 reactor，这里不能直接 close：fd 会立即被其他 reactor 接受的新连接复用，旧定时器到期时把新连接关掉
+// 所以只释放缓冲区并 shutdown，重新注册事件后由所属 reactor 收到 EPOLLHUP，删除定时器并关闭 fd
 void http_conn::close_conn(bool real_close)
 {
   // 一个连接对应一个 m_sockfd
   if(real_close && m_sockfd != -1)
   {
-    removefd(m_epollfd, m_sockfd);
+    unmap();
+    m_read_idx = 0;
+    free_buffers();
+    shutdown(m_sockfd, SHUT_RDWR);
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
     m_sockfd = -1;
-    --m_user_count;
   }
 }
 
 // 初始化连接，注册到内核事件表中，然后调用私有 init()
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd)
 {
   m_sockfd = sockfd;
   m_address = addr;
+  m_epollfd = epollfd;
+  unmap();                          // 该 fd 上一个连接可能被定时器直接关闭，释放它残留的文件
   addfd(m_epollfd, sockfd, true);   // 注册到内核事件表
   ++m_user_count;
   init();
@@ -164,85 +289,240 @@ void http_conn::init(int sockfd, const sockaddr_in &addr)
 // 初始化新接受的连接
 void http_conn::init()
 {
-  mysql = NULL;
-  bytes_to_send = 0;
-  bytes_have_send = 0;
+  db = NULL;
+  m_db_state = DB_IDLE;
+  m_db_resumed = false;
+  m_db_reserved = false;
+  worker_id.store(-1, std::memory_order_relaxed);
+  m_start_line = 0;
+  m_checked_idx = 0;
+  m_read_idx = 0;
+  free_buffers();
+  init_request();
+  init_output();
+}
+
+// 初始化一个请求的解析状态，读缓冲区中未处理的数据（流水线中的后续请求）保留
+void http_conn::init_request()
+{
   m_check_state = CHECK_STATE_REQUESTLINE;  // 默认处理请求行
   m_linger = false;
   m_method = GET;
   m_url = 0;
-  m_version = 0;
   m_content_len = 0;
-  m_host = 0;
-  m_start_line = 0;
-  m_checked_idx = 0;
-  m_read_idx = 0;
-  m_write_idx = 0;
+  m_request.clear(m_read_buf);
+  m_string = NULL;
+  m_body_read = 0;
   cgi = 0;
-  memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-  memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-  memset(m_real_file, '\0', FILENAME_LEN);
+}
+
+// 初始化发送队列，一批流水线响应全部发送完后调用
+void http_conn::init_output()
+{
+  bytes_to_send = 0;
+  bytes_have_send = 0;
+  m_seg_count = 0;
+  m_seg_idx = 0;
+  m_batch_count = 0;
+  m_close_after_write = false;
+}
+
+// 一个请求的响应已经放入发送队列：
+// 把它持有的文件条目转交给这一批，丢弃读缓冲区中已经解析完的数据，为解析下一个请求做准备
+void http_conn::finish_request()
+{
+  if(m_file_entry)
+  {
+    m_batch_entries[m_batch_count++] = m_file_entry;
+    m_file_entry = NULL;
+  }
+  m_file_address = 0;
+  if(!m_linger)
+    m_close_after_write = true;
+
+  int remain = m_read_idx - m_checked_idx;
+  if(remain > 0)
+    memmove(m_read_buf, m_read_buf + m_checked_idx, remain);
+  m_read_idx = remain;
+  m_checked_idx = 0;
+  m_start_line = 0;
+  init_request();
+}
+
+// 是否还能把下一个请求的响应合并进这一批
+bool http_conn::can_pipeline()
+{
+  return !m_close_after_write && m_read_idx > 0 && m_batch_count < MAX_PIPELINE &&
+         m_seg_count + MAX_RESPONSE_SEGMENT <= MAX_SEGMENT;
+}
+
+// 往发送队列追加一段数据：fd 为 -1 时是内存块 [base, base + len)，否则是文件的 [offset, offset + len)
+void http_conn::add_segment(char* base, int len, int fd, off_t offset)
+{
+  if(len <= 0)
+    return;
+  segment* seg = &m_segs[m_seg_count++];
+  seg->base = base;
+  seg->len = len;
+  seg->fd = fd;
+  seg->offset = offset;
+  bytes_to_send += len;
+}
+
+bool http_conn::alloc_output()
+{
+  int size = sizeof(segment) * MAX_SEGMENT + sizeof(file_entry*) * MAX_PIPELINE + WRITE_BUFFER_SIZE;
+  m_out_block = buffer_pool::get_instance()->alloc(size, &m_out_size);
+  if(!m_out_block)
+    return false;
+  m_segs = (segment*) m_out_block;
+  m_batch_entries = (file_entry**) (m_out_block + sizeof(segment) * MAX_SEGMENT);
+  m_write_buf = m_out_block + sizeof(segment) * MAX_SEGMENT + sizeof(file_entry*) * MAX_PIPELINE;
+  m_response.init(m_write_buf, WRITE_BUFFER_SIZE);
+  return true;
+}
+
+// 发送队列为空时才能调用：写缓冲区整块归还；读缓冲区没有未处理的数据时归还，否则缩回初始大小
+// 大量空闲的长连接因此不占用任何缓冲区，下次读到数据时再申请
+void http_conn::free_buffers()
+{
+  if(m_out_block)
+  {
+    buffer_pool::get_instance()->free(m_out_block, m_out_size);
+    m_out_block = NULL;
+    m_out_size = 0;
+    m_segs = NULL;
+    m_batch_entries = NULL;
+    m_write_buf = NULL;
+    m_response.release();
+  }
+  if(m_read_idx == 0)
+  {
+    buffer_pool::get_instance()->free(m_read_buf, m_read_size);
+    m_read_buf = NULL;
+    m_read_size = 0;
+    m_request.set_base(NULL);
+  }
+  else
+    shrink_read_buffer();
 }
 
 // 从状态机：分析当前行的内容
 // 返回值表示读取状态：LINE_OK, LINE_BAD, LINE_OPEN
 http_conn::LINE_STATUS http_conn::parse_line()
 {
-  char temp;
   // m_checked_idx:已读，  [m_checked_idx, m_read_idx):未读
-  for(; m_checked_idx < m_read_idx; ++m_checked_idx)
+  // 按块查找下一个 '\r' 或 '\n'，中间的字符不需要逐个检查
+  char* end = m_read_buf + m_read_idx;
+  char* p = http_scan::find(m_read_buf + m_checked_idx, end, '\r', '\n');
+  m_checked_idx = p - m_read_buf;
+  if(p == end)
+    return LINE_OPEN;
+
+  // 完整行的标志：末尾 '\r\n'
+  if(*p == '\r')
   {
-    // 完整行的标志：末尾 '\r\n'
-    temp = m_read_buf[m_checked_idx];
-
-    // 如果当前字符是 '\r'，则可能读到完整行
-    if(temp == '\r')
-    {
-      // 如果读到末尾,返回未读完
-      if((m_checked_idx + 1) == m_read_idx)
-        return LINE_OPEN;
-      // 如果下一个字符是'\n'，则说明完整
-      else if(m_read_buf[m_checked_idx + 1] == '\n')
-      {
-        // 读取完整，替换 \r\n
-        m_read_buf[m_checked_idx++] = '\0';
-        m_read_buf[m_checked_idx++] = '\0';
-        return LINE_OK;
-      }
-      return LINE_BAD;
-    }
-    // '\n' 也可能读到完整行
-    else if(temp == '\n')
+    // 如果读到末尾,返回未读完，下次从 '\r' 开始重新检查
+    if(p + 1 == end)
+      return LINE_OPEN;
+    // 如果下一个字符是'\n'，则说明完整
+    if(p[1] == '\n')
     {
-      if(m_checked_idx > 1 && m_read_buf[m_checked_idx -1] == '\r')
-      {
-        m_read_buf[m_checked_idx - 1] = '\0';
-        m_read_buf[m_checked_idx++] = '\0';
-        return LINE_OK;
-      }
-      return LINE_BAD;
+      // 读取完整，替换 \r\n
+      m_read_buf[m_checked_idx++] = '\0';
+      m_read_buf[m_checked_idx++] = '\0';
+      return LINE_OK;
     }
+    return LINE_BAD;
+  }
+  // 单独的 '\n'
+  if(m_checked_idx > 1 && m_read_buf[m_checked_idx -1] == '\r')
+  {
+    m_read_buf[m_checked_idx - 1] = '\0';
+    m_read_buf[m_checked_idx++] = '\0';
+    return LINE_OK;
   }
-  return LINE_OPEN;
+  return LINE_BAD;
+}
+
+// 读缓冲区扩容到至少 size 字节，新的缓冲区从缓冲区池中申请
+// 已经解析出的 m_url 指向旧缓冲区，需要平移到新缓冲区的相同位置；m_request 中保存的是偏移，只需换基址
+bool http_conn::grow_read_buffer(int size)
+{
+  if(size <= m_read_size)
+    return true;
+  if(size > MAX_READ_BUFFER_SIZE)
+    return false;
+
+  int new_size = 0;
+  char* buf = buffer_pool::get_instance()->alloc(size, &new_size);
+  if(!buf)
+    return false;
+
+  if(m_read_buf)
+  {
+    memcpy(buf, m_read_buf, m_read_idx);
+    if(m_url)
+      m_url = buf + (m_url - m_read_buf);
+    buffer_pool::get_instance()->free(m_read_buf, m_read_size);
+  }
+  m_read_buf = buf;
+  m_read_size = new_size;
+  m_request.set_base(buf);
+  return true;
+}
+
+// 空闲时把扩容过的读缓冲区缩回初始大小，只在没有正在解析的请求时调用
+void http_conn::shrink_read_buffer()
+{
+  if(m_read_size <= READ_BUFFER_SIZE || m_read_idx > READ_BUFFER_SIZE)
+    return;
+
+  int new_size = 0;
+  char* buf = buffer_pool::get_instance()->alloc(READ_BUFFER_SIZE, &new_size);
+  if(!buf)
+    return;
+  memcpy(buf, m_read_buf, m_read_idx);
+  buffer_pool::get_instance()->free(m_read_buf, m_read_size);
+  m_read_buf = buf;
+  m_read_size = new_size;
+  m_request.set_base(buf);
 }
 
 // read_once 读取请求报文，直到无数据可读或者对方关闭连接
+// 读缓冲区之外再用一块栈上的临时空间一起 readv，读多了再扩容拷贝过去，一次系统调用尽量读完
 bool http_conn::read_once()
 {
-  if(m_read_idx >= READ_BUFFER_SIZE)
+  // 缓冲区满了先扩容，已经是最大仍然是满的，说明请求行和头部过长
+  if(m_read_idx >= m_read_size && !grow_read_buffer(m_read_idx + 1))
     return false;
 
   int bytes_read = 0;
-
+  char extra_buf[MAX_READ_BUFFER_SIZE];
+  struct iovec iv[2];
 
 #ifdef connfdLT
   // bytes_read 接收读缓冲区中下一个未读的数据
-  bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
-  m_read_idx += bytes_read;
+  iv[0].iov_base = m_read_buf + m_read_idx;
+  iv[0].iov_len = m_read_size - m_read_idx;
+  iv[1].iov_base = extra_buf;
+  iv[1].iov_len = MAX_READ_BUFFER_SIZE - m_read_size;
+  bytes_read = readv(m_sockfd, iv, iv[1].iov_len > 0 ? 2 : 1);
 
   if(bytes_read <= 0)
     return false;
 
+  if(bytes_read <= (int)iv[0].iov_len)
+    m_read_idx += bytes_read;
+  else
+  {
+    int extra = bytes_read - iv[0].iov_len;
+    m_read_idx = m_read_size;
+    if(!grow_read_buffer(m_read_idx + extra))
+      return false;
+    memcpy(m_read_buf + m_read_idx, extra_buf, extra);
+    m_read_idx += extra;
+  }
   return true;
 #endif
 
@@ -251,7 +531,15 @@ bool http_conn::read_once()
   // ET 必须设置文件是非阻塞，因为读空 recv 阻塞的话会卡住，无法跳出 while
   while(true)
   {
-    bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
+    // 缓冲区已经是最大并且读满时先去处理，处理完后重新注册 EPOLLIN 时内核会再次报告剩余的数据
+    if(m_read_idx >= m_read_size && !grow_read_buffer(m_read_idx + 1))
+      break;
+
+    iv[0].iov_base = m_read_buf + m_read_idx;
+    iv[0].iov_len = m_read_size - m_read_idx;
+    iv[1].iov_base = extra_buf;
+    iv[1].iov_len = MAX_READ_BUFFER_SIZE - m_read_size;    // 最多还能扩容出来的空间
+    bytes_read = readv(m_sockfd, iv, iv[1].iov_len > 0 ? 2 : 1);
     if( bytes_read == -1)
     { // 以下两个 errno 表示没有数据可读，可以退出
       if(errno == EAGAIN || errno == EWOULDBLOCK)
@@ -263,29 +551,39 @@ bool http_conn::read_once()
     else if(bytes_read == 0)
       return false;
 
-    m_read_idx += bytes_read;
+    if(bytes_read <= (int)iv[0].iov_len)
+      m_read_idx += bytes_read;
+    else
+    {
+      // 临时空间中多读的部分，扩容后拷贝到读缓冲区末尾
+      int extra = bytes_read - iv[0].iov_len;
+      m_read_idx = m_read_size;
+      if(!grow_read_buffer(m_read_idx + extra))
+        return false;
+      memcpy(m_read_buf + m_read_idx, extra_buf, extra);
+      m_read_idx += extra;
+    }
   }
   return true;
 #endif
 }
 
 // 解析 http 请求行，获得请求方法、url、http 版本号
-http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
+// [text, end) 是去掉 \r\n 的请求行，分隔符用 http_scan 按块查找，各部分的长度由位置相减得到
+http_conn::HTTP_CODE http_conn::parse_request_line(char *text, char *end)
 {
-  // strpbrk(const char* str1, const char *str2)
-  // 检索 str1 中第一个匹配 str2 中字符的字符（匹配单个字符，不是str2的字符串）
-  // 下面一段操作是跳过 method 开头，匹配请求的 url
-  m_url = strpbrk(text, " \t");
-  if(!m_url)
+  // 方法和 url 之间是空格或 '\t'
+  m_url = http_scan::find(text, end, ' ', '\t');
+  if(m_url == end)
     return BAD_REQUEST;
+  size_t method_len = m_url - text;
+  m_request.set_method(text, method_len);
   *m_url++ = '\0';
 
-  // strcasecmp,匹配两字符串是否相等，忽略大小写
-  // 下面一段确定方法 method
-  char *method = text;
-  if(strcasecmp(method, "GET") == 0)
+  // 下面一段确定方法 method，忽略大小写
+  if(method_len == 3 && strncasecmp(text, "GET", 3) == 0)
     m_method = GET;
-  else if(strcasecmp(method, "POST") == 0)
+  else if(method_len == 4 && strncasecmp(text, "POST", 4) == 0)
   {
     m_method = POST;
     cgi = 1;
@@ -293,18 +591,29 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
   else
     return BAD_REQUEST;
 
-  // strspn(const char* str1, const char* str2)
-  // 在str1中检索第一个不出现str2的下标，所以以下是跳过 \t
-  m_url += strspn(m_url, " \t");
+  // 跳过多余的空白，分隔符通常只有一个字符
+  while(m_url < end && (*m_url == ' ' || *m_url == '\t'))
+    ++m_url;
 
   // 跳过 url，匹配版本号
-  m_version = strpbrk(m_url, " \t");
-  if(!m_version)
+  char* url_end = http_scan::find(m_url, end, ' ', '\t');
+  if(url_end == end)
     return BAD_REQUEST;
-  *m_version++ = '\0';
-  m_version += strspn(m_version, " \t");
-  if(strcasecmp(m_version, "HTTP/1.1") != 0)
+  *url_end = '\0';
+  char* version = url_end + 1;
+  while(version < end && (*version == ' ' || *version == '\t'))
+    ++version;
+  if(end - version != 8 || strncasecmp(version, "HTTP/1.1", 8) != 0)
     return BAD_REQUEST;
+  m_request.set_version(version, 8);
+
+  // '?' 之后是查询字符串，m_url 只保留路径
+  char* query = http_scan::find(m_url, url_end, '?', '?');
+  if(query != url_end)
+  {
+    *query = '\0';
+    m_request.set_query(query + 1, url_end - query - 1);
+  }
 
   // 解析包装请求的 url
   if(strncasecmp(m_url, "http://", 7) == 0)
@@ -313,8 +622,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     // 返回 url 中第一次出现 / 的位置,匹配结果类似于"/index.html"
     m_url = strchr(m_url, '/');
   }
-
-  if(strncasecmp(m_url, "https://", 8) == 0)
+  else if(strncasecmp(m_url, "https://", 8) == 0)
   {
     m_url += 8;
     m_url = strchr(m_url, '/');
@@ -322,24 +630,44 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
 
   if(!m_url || m_url[0] != '/')
     return BAD_REQUEST;
-
-  // 如果 url = "/",则显示默认页面
-  if(strlen(m_url) == 1)
-  {
-    strcat(m_url, "index.html");
-
-  }
-
+  m_request.set_path(m_url, strlen(m_url));
 
   m_check_state = CHECK_STATE_HEADER;   // request 解析完毕，状态转移至解析 header
   return NO_REQUEST;
 }
 
-// 解析 http 请求的一个头部信息
-http_conn::HTTP_CODE http_conn::parse_headers(char *text)
+// Content-Length 只能是十进制数字，按无符号 64 位解析，不能超过 long 的范围
+// 不用 atol：它接受负数和前导空白，溢出时结果不确定
+static bool parse_content_length(const char* p, const char* end, long* length)
+{
+  if(p == end)
+    return false;
+  uint64_t v = 0;
+  for(; p < end; ++p)
+  {
+    if(*p < '0' || *p > '9')
+      return false;
+    uint64_t digit = *p - '0';
+    if(v > ((uint64_t) LONG_MAX - digit) / 10)
+      return false;
+    v = v * 10 + digit;
+  }
+  *length = (long) v;
+  return true;
+}
+
+// 解析 http 请求的一个头部信息，[text, end) 是去掉 \r\n 的头部行
+// 每个头部都记录到 m_request 中，不复制；头部全部读完后再从中取出 Connection
+// 决定消息体边界的头部在读到时就检查，边界不确定时后面的数据会被当成下一个请求：
+// Content-Length 格式错误、溢出或者多个值不一致时返回 BAD_REQUEST，Transfer-Encoding 不支持，返回 NOT_IMPLEMENTED
+http_conn::HTTP_CODE http_conn::parse_headers(char *text, char *end)
 {
   if(text[0] == '\0') // 遇到空行，表示头部字段解析完毕
   {
+    str_view connection = m_request.header(HEADER_CONNECTION);
+    if(connection.iequals("keep-alive"))
+      m_linger = true;
+
     // 如果有消息体，状态机转移至 CHECK_STATE_CONTENT
     if(m_content_len != 0)
     {
@@ -348,48 +676,62 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text)
     }
     return GET_REQUEST;
   }
-  // Connection 头部
-  // 这里用strncasecmp是因为比较两个字符串的前11个字符
-  else if(strncasecmp(text, "Connection:", 11) == 0)
-  {
-    text += 11;
-    text += strspn(text, " \t");
-    if(strcasecmp(text, "keep-alive") == 0)
-      m_linger = true;
-  }
-  // Content-length 头部
-  else if(strncasecmp(text, "Content-length:", 15) == 0)
-  {
-    text += 15;
-    text += strspn(text, " \t");
-    m_content_len = atol(text);
-  }
-  // Host
-  else if(strncasecmp(text, "Host:", 5) == 0)
-  {
-    text += 5;
-    text += strspn(text, " \t");
-    m_host = text;
-  }
-  else
+
+  // 名称和值以第一个 ':' 分隔，值去掉前后的空白；没有 ':' 的行忽略
+  char* colon = http_scan::find(text, end, ':', ':');
+  if(colon == end)
+    return NO_REQUEST;
+  char* value = colon + 1;
+  while(value < end && (*value == ' ' || *value == '\t'))
+    ++value;
+  while(end > value && (end[-1] == ' ' || end[-1] == '\t'))
+    *--end = '\0';
+
+  HTTP_HEADER h = http_request::lookup(text, colon - text);
+  if(h == HEADER_TRANSFER_ENCODING)
+    return NOT_IMPLEMENTED;
+  if(h == HEADER_CONTENT_LENGTH)
   {
-    LOG_INFO("unknown header:%s", text);
-    Log::get_instance()->flush();
+    long length = 0;
+    if(!parse_content_length(value, end, &length))
+      return BAD_REQUEST;
+    if(m_request.has_header(HEADER_CONTENT_LENGTH) && length != m_content_len)
+      return BAD_REQUEST;
+    m_content_len = length;
   }
-
+  m_request.add_header(text, colon - text, value, end - value);
   return NO_REQUEST;
 }
 
 // Post 的消息体放有 username 和 passwd
 http_conn::HTTP_CODE http_conn::parse_content(char *text)
 {
-  // 判断消息体是否被完整读入
-  if(m_read_idx >= (m_content_len + m_checked_idx))
+  // 小的消息体（登录、注册表单）完整保存在读缓冲区中，交给 do_request 使用
+  if(m_content_len <= MAX_BUFFERED_BODY)
   {
-    text[m_content_len] = '\0';
-    m_string = text;
-    return GET_REQUEST;     // http 请求解析完毕
+    // 判断消息体是否被完整读入
+    if(m_read_idx >= (m_content_len + m_checked_idx))
+    {
+      // 消息体后面可能紧跟着流水线中的下一个请求，不能写入 '\0'，使用方按 m_content_len 截取
+      m_string = text;
+      m_request.set_body(text, m_content_len);
+      m_checked_idx += m_content_len;
+      return GET_REQUEST;     // http 请求解析完毕
+    }
+    return NO_REQUEST;
   }
+
+  // 大的消息体流式处理：每次只消费已经读到的部分，然后把它从读缓冲区中移除
+  // 内存占用与消息体的大小无关，目前没有接收上传的业务，消息体直接丢弃
+  long avail = m_read_idx - m_checked_idx;
+  if(avail > m_content_len - m_body_read)
+    avail = m_content_len - m_body_read;
+  m_body_read += avail;
+  memmove(text, text + avail, m_read_idx - m_checked_idx - avail);
+  m_read_idx -= avail;
+
+  if(m_body_read == m_content_len)
+    return GET_REQUEST;
   return NO_REQUEST;
 }
 
@@ -401,27 +743,32 @@ http_conn::HTTP_CODE http_conn::process_read()
   char *text = 0;
 
   // 当读到完整的行(LINE_OK)时
-  while((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) || ((line_status = parse_line()) == LINE_OK))
+  // 消息体不按行解析：消息体不完整时不能再调用 parse_line，否则 m_checked_idx 会越过消息体的起始位置
+  while((m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) ||
+        (m_check_state != CHECK_STATE_CONTENT && (line_status = parse_line()) == LINE_OK))
   {
     text = get_line();
+    // 完整的行以两个 '\0'（原来的 \r\n）结尾
+    char* end = m_read_buf + m_checked_idx - 2;
     m_start_line = m_checked_idx;
-    LOG_INFO("%s", text);
-    Log::get_instance()->flush();
+    // 只记录请求行，头部都保存在 m_request 中
+    if(m_check_state == CHECK_STATE_REQUESTLINE)
+      LOG_INFO("%s", text);
 
     switch (m_check_state) {
       // 从状态机改变 m_check_state 的状态，驱动主状态机执行对应的函数（处理request/header/content）
       case CHECK_STATE_REQUESTLINE:
       {
-        ret = parse_request_line(text);
+        ret = parse_request_line(text, end);
         if(ret == BAD_REQUEST)
           return BAD_REQUEST;
         break;
       }
       case CHECK_STATE_HEADER:
       {
-        ret = parse_headers(text);
-        if(ret == BAD_REQUEST)
-          return BAD_REQUEST;
+        ret = parse_headers(text, end);
+        if(ret == BAD_REQUEST || ret == NOT_IMPLEMENTED)
+          return ret;
         else if(ret == GET_REQUEST)
           return do_request();
         break;
@@ -444,19 +791,26 @@ http_conn::HTTP_CODE http_conn::process_read()
 
 http_conn::HTTP_CODE http_conn::do_request()
 {
-  strcpy(m_real_file, doc_root);
+  // 客户请求的目标文件的完整路径, doc_root + m_url，只在查找缓存条目时使用
+  char real_file[FILENAME_LEN];
+  memset(real_file, '\0', FILENAME_LEN);
+  strcpy(real_file, doc_root);
   int len = strlen(doc_root);
   // strrchr 指向 m_url 中 '/' 最后一次出现的位置
   const char *p = strrchr(m_url, '/');
 
   if(cgi == 1 && (*(p + 1) == '2' || *(p + 1) == '3'))
   {
+    // 表单过大，没有保存在读缓冲区中
+    if(!m_string)
+      return BAD_REQUEST;
+
     char flag = m_url[1];
 
     char *m_url_real = (char*) malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/");
     strcat(m_url_real, m_url + 2);
-    strncpy(m_real_file + len, m_url_real, FILENAME_LEN - len -1);
+    strncpy(real_file + len, m_url_real, FILENAME_LEN - len -1);
     free(m_url_real);
 
     // 提取用户名和密码
@@ -464,54 +818,128 @@ http_conn::HTTP_CODE http_conn::do_request()
     char name[100], passwd[100];
     int i;
     // 下标从5开始，跳过user,下同
-    for(i = 5; m_string[i] != '&'; ++i)
+    for(i = 5; i < m_content_len && m_string[i] != '&' && i - 5 < 99; ++i)
       name[i - 5] = m_string[i];
     name[i - 5] = '\0';
 
     int j = 0;
-    for(i = i + 10; m_string[i] != '\0'; ++i, ++j)
+    for(i = i + 10; i < m_content_len && j < 99; ++i, ++j)
       passwd[j] = m_string[i];
     passwd[j] = '\0';
 
     // 同步线程注册校验
     if(*(p + 1) == '3')
     {
+#ifdef ASYNCSQL
+      // 异步注册：第一次进入时在 users 中占住用户名，生成 INSERT 交给 process 提交，返回 DB_REQUEST
+      // 数据库完成后工作线程再次调用 do_request，消息体还在读缓冲区中，用户名和密码重新解析一遍
+      // 用户表还在后台加载时，哈希表中没有的用户名可能只是还没读到，先到数据库中查询，确认不存在再 INSERT
+      if(m_db_resumed && !m_db_insert)
+      {
+        m_db_resumed = false;
+        m_db_reserved = false;
+        if(m_db_ok && !m_db_found)
+          return register_user(name, passwd);
+        // 用户名已经存在：哈希表中换成数据库中的密码，加载线程读到这一行时写入的也是同一个值
+        if(m_db_found)
+          users.assign(name, m_db_value.c_str());
+        else
+          users.erase(name, passwd);
+        strcpy(m_url, "/registerError.html");
+      }
+      else if(m_db_resumed)
+      {
+        m_db_resumed = false;
+        if(m_db_ok)
+          strcpy(m_url, "/log.html");
+        else
+          strcpy(m_url, "/registerError.html");
+      }
+      else if(!users.insert(name, passwd))
+        strcpy(m_url, "/registerError.html");
+      else if(!users_loaded.load(std::memory_order_acquire))
+      {
+        m_db_task = new sql_task;
+        m_db_task->sql = "SELECT passwd FROM user WHERE username=?";
+        m_db_task->params.push_back(name);
+        m_db_insert = false;
+        m_db_reserved = true;
+        m_db_passwd = passwd;
+        return DB_REQUEST;
+      }
+      else
+        return register_user(name, passwd);
+#else
       // 如果是注册，先检查数据库是否有重名，没有则增加
       // sql_insert 是mysql查询语句，接下来一段等于：
       // insert into user(username,passwd) values(
       // 'name', 'passwd')
-      char *sql_insert = (char*) malloc(sizeof(char) * 200);
-      strcpy(sql_insert, "INSERT INTO user(username,passwd) VALUES(");
-      strcat(sql_insert, "'");
-      strcat(sql_insert, name);
-      strcat(sql_insert, "', '");
-      strcat(sql_insert, passwd);
-      strcat(sql_insert,"')");
-
-      // 首先在哈系表中看看有没有同名
-      if(users.find(name) == users.end())
-      { // 如果没有同名,允许插入数据表和更新 users 哈系表
-        m_lock.lock();
-        int res = mysql_query(mysql, sql_insert);     // 数据插入数据库
-        users.insert(pair<string, string>(name, passwd));   //更新map
-        m_lock.unlock();
+      // 用户名和密码各不超过 99 个字节，缓冲区足够
+      char sql_insert[256];
+      snprintf(sql_insert, sizeof(sql_insert), "INSERT INTO user(username,passwd) VALUES('%s', '%s')", name, passwd);
+
+      // 先在哈希表中占住用户名，同名的并发注册只有一个能成功，写库失败再让出
+      // 用户表还在后台加载时，哈希表中没有的用户名可能只是还没读到，先到数据库中确认不存在
+      string db_passwd;
+      if(users.insert(name, passwd))
+      {
+        MYSQL* mysql = db ? db->get() : NULL;         // 到这里才从连接池获取连接
+        int res = 1;
+        if(mysql && !users_loaded.load(std::memory_order_acquire) && query_passwd(mysql, name, &db_passwd))
+          users.assign(name, db_passwd.c_str());      // 用户名已经存在，换成数据库中的密码
+        else if(mysql)
+          res = mysql_query(mysql, sql_insert);       // 数据插入数据库
 
         if(!res)
           strcpy(m_url, "/log.html");
         else
+        {
+          // 只让出自己占住的条目，加载用户表时可能已经换成了数据库中的同名用户
+          if(db_passwd.empty())
+            users.erase(name, passwd);
           strcpy(m_url, "/registerError.html");
+        }
       }
       else
         strcpy(m_url, "/registerError.html");
+#endif
     }
     //如果是登录
     else if(*(p + 1) == '2')
     {
-      // 根据哈系表判断 name 和 passwd
-      if(users.find(name) != users.end() && users[name] == passwd)
+      // 根据哈希表判断 name 和 passwd
+      // 用户表还在后台加载时，哈希表中查不到的用户到数据库中确认
+#ifdef ASYNCSQL
+      if(m_db_resumed)
+      {
+        m_db_resumed = false;
+        if(m_db_ok && m_db_found && m_db_value == passwd)
+          strcpy(m_url, "/welcome.html");
+        else
+          strcpy(m_url, "/logError.html");
+      }
+      else if(users.check(name, passwd))
         strcpy(m_url, "/welcome.html");   // 登录成功
+      else if(!users_loaded.load(std::memory_order_acquire))
+      {
+        m_db_task = new sql_task;
+        m_db_task->sql = "SELECT passwd FROM user WHERE username=?";
+        m_db_task->params.push_back(name);
+        return DB_REQUEST;
+      }
+      else
+        strcpy(m_url, "/logError.html");
+#else
+      string db_passwd;
+      MYSQL* mysql = NULL;
+      if(users.check(name, passwd))
+        strcpy(m_url, "/welcome.html");   // 登录成功
+      else if(!users_loaded.load(std::memory_order_acquire) && db && (mysql = db->get()) &&
+              query_passwd(mysql, name, &db_passwd) && db_passwd == passwd)
+        strcpy(m_url, "/welcome.html");
       else
         strcpy(m_url, "/logError.html");
+#endif
     }
   }
 
@@ -520,7 +948,7 @@ http_conn::HTTP_CODE http_conn::do_request()
     //???
     char *m_url_real = (char*)malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/register.html");
-    strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+    strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
     free(m_url_real);
   }
@@ -528,7 +956,7 @@ http_conn::HTTP_CODE http_conn::do_request()
   {
     char *m_url_real = (char*) malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/log.html");
-    strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+    strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
     free(m_url_real);
   }
@@ -536,7 +964,7 @@ http_conn::HTTP_CODE http_conn::do_request()
   {
     char *m_url_real = (char*) malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/picture.html");
-    strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+    strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
     free(m_url_real);
   }
@@ -544,48 +972,59 @@ http_conn::HTTP_CODE http_conn::do_request()
   {
     char *m_url_real = (char*) malloc(sizeof(char) * 200);
     strcpy(m_url_real, "/video.html");
-    strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
+    strncpy(real_file + len, m_url_real, strlen(m_url_real));
 
     free(m_url_real);
   }
+  else if(m_url[1] == '\0')
+    strncpy(real_file + len, "/index.html", FILENAME_LEN - len - 1);   // 如果 url = "/",则显示默认页面
   else
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    strncpy(real_file + len, m_url, FILENAME_LEN - len - 1);
 
-  // 以下获取 m_real_file 的属性
-  //stat(fileName, buf)，将fileName的文件状态复制到buf中，成功返回 0,失败-1
-  if(stat(m_real_file, &m_file_stat) < 0)
+  // 从静态文件缓存中取出目标文件的条目，命中时不再需要 stat、open 和 mmap
+  // 条目的引用由本连接持有，直到响应发送完毕调用 unmap 才释放
+  m_file_entry = file_cache::get_instance()->acquire(real_file);
+  if(!m_file_entry || !m_file_entry->exist)
     return NO_RESOURCE;
 
+  // 文件的状态，包括是否存在、是否为目录、是否可读、文件大小等
+
   // st_mode:文件的类型和存取权限
-  if(!(m_file_stat.st_mode & S_IROTH))  // S_IROTH: Read by others
+  if(!(m_file_entry->st.st_mode & S_IROTH))  // S_IROTH: Read by others
     return FORBIDDEN_REQUEST;
-  if(S_ISDIR(m_file_stat.st_mode))  // 如果是目录
-    return BAD_REQUEST;
+  if(S_ISDIR(m_file_entry->st.st_mode))  // 如果是目录
+    return NO_RESOURCE;
+
+#ifdef MMAPFILE
+  // 文件的只读映射由缓存条目持有，多个连接共享同一份映射
+  m_file_address = file_cache::get_instance()->map_file(m_file_entry);
+  if(m_file_entry->st.st_size != 0 && !m_file_address)
+    return INTERNAL_ERROR;
+#endif
 
-  int fd = open(m_real_file, O_RDONLY);
-  // 将文件映射到进程地址空间，实现不同进程共享该文件，只需要调用该 m_file_address 指针即可
-  // void *mmap (void *__addr, size_t __len, int __prot, int __flags, int __fd, __off_t __offset)
-  m_file_address = (char*) mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  close(fd);
   return FILE_REQUEST;
 }
 
+// 释放正在处理的请求和发送队列中的响应占用的文件资源：归还缓存条目的引用，映射和描述符由缓存统一管理
 void http_conn::unmap()
 {
-  if(m_file_address)
+  m_file_address = 0;
+  if(m_file_entry)
   {
-    // 解除映射
-    munmap(m_file_address, m_file_stat.st_size);
-    m_file_address = 0;
+    file_cache::get_instance()->release(m_file_entry);
+    m_file_entry = NULL;
   }
+  for(int i=0; i<m_batch_count; ++i)
+    file_cache::get_instance()->release(m_batch_entries[i]);
+  m_batch_count = 0;
 }
 
-// 将响应报文发送给客户端
+// 将发送队列中的响应报文发送给客户端
+// 连续的内存段（头部、完整响应、mmap 的文件）合并成一次 sendmsg，文件段（SENDFILE）调用 sendfile
+// 返回 false 表示需要关闭连接
 bool http_conn::write()
 {
-  // 发送的数据在 m_iv 数组中，m_iv[0]是头部信息，[1]是文件内容
   int temp = 0;
-  int newadd = 0;
 
   // 如果发送的数据为0
   if(bytes_to_send == 0)
@@ -595,212 +1034,744 @@ bool http_conn::write()
     return true;
   }
 
-  while(1)
+  while(m_seg_idx < m_seg_count)
   {
-    // writev用于一次函数调用中写多个非连续的缓冲区
-    // 返回已写字节数
-    temp = writev(m_sockfd, m_iv, m_iv_count);
-
-    // 正常发送
-    if(temp >= 0)
+    segment* seg = &m_segs[m_seg_idx];
+    if(seg->fd == -1)
     {
-      bytes_have_send += temp;                // 更新已发送字节数
-      newadd = bytes_have_send - m_write_idx; // 偏移文件iovec的指针
+      struct iovec iv[MAX_SEGMENT];
+      int count = 0;
+      int j = m_seg_idx;
+      for(; j < m_seg_count && m_segs[j].fd == -1; ++j, ++count)
+      {
+        iv[count].iov_base = m_segs[j].base;
+        iv[count].iov_len = m_segs[j].len;
+      }
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iv;
+      msg.msg_iovlen = count;
+      // 后面还有文件段时带上 MSG_MORE，内核会把头部和文件开头攒成满包再发
+      temp = sendmsg(m_sockfd, &msg, (j < m_seg_count) ? MSG_MORE : 0);
     }
     else
     {
-      // 判断是否是缓冲区已满
+      // sendfile 会推进 seg->offset，发送被打断后从这里继续
+      temp = sendfile(m_sockfd, seg->fd, &seg->offset, seg->len);
+      // 文件在发送过程中被截断，无法再发出剩余的内容
+      if(temp == 0)
+      {
+        unmap();
+        return false;
+      }
+    }
+
+    if(temp < 0)
+    {
+      // 缓冲区已满，重新注册写事件，下次从未发送的位置继续
       if(errno == EAGAIN)
       {
-        // 第一个iovec头部信息发送完，发送第二个iovec
-        if(bytes_have_send >= m_iv[0].iov_len)
-        {
-          m_iv[0].iov_len = 0;    // 不再发[0]
-          m_iv[1].iov_base = m_file_address + newadd;
-          m_iv[1].iov_len = bytes_to_send;
-        }
-        // 继续发送第一个iovec头部信息的数据
-        else
-        {
-          m_iv[0].iov_base = m_write_buf + bytes_have_send;
-          m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
-        }
-        // 重新注册写事件
         modfd(m_epollfd, m_sockfd, EPOLLOUT);
         return true;
       }
-      //如果发送失败，但不是缓冲区问题，取消映射
       unmap();
       return false;
     }
 
+    bytes_have_send += temp;                // 更新已发送字节数
     bytes_to_send -= temp;
 
-    // 如果数据发送完毕
-    if(bytes_to_send <= 0)
+    // 按已发送的字节数依次推进发送队列
+    while(temp > 0)
     {
-      unmap();
-      modfd(m_epollfd, m_sockfd, EPOLLIN);
-      if(m_linger)
-      {
-        init();     // 保持连接，不关闭，重新初始化 http 对象
-        return true;
-      }
-      else
-        return false;
+      seg = &m_segs[m_seg_idx];
+      int n = (temp < seg->len) ? temp : seg->len;
+      if(seg->fd == -1)
+        seg->base += n;
+      seg->len -= n;
+      temp -= n;
+      if(seg->len == 0)
+        ++m_seg_idx;
     }
   }
+
+  // 这一批响应发送完毕
+  unmap();
+  if(m_close_after_write)
+    return false;
+
+  init_output();
+  free_buffers();
+  // 读缓冲区中还有流水线请求未处理，由调用者交给线程池，此时不能重新注册 EPOLLIN
+  if(has_pending())
+    return true;
+  modfd(m_epollfd, m_sockfd, EPOLLIN);
+  return true;
 }
 
-// 响应报文的填写
-bool http_conn::add_response(const char *format, ...)
+// 响应报文的状态行和头部写入 m_response，end_response 之前还可以用 m_response.header 追加其他头部
+void http_conn::begin_response(int status, const char* type, long content_length)
 {
-  if(m_write_idx >= WRITE_BUFFER_SIZE)
+  m_response.begin();
+  m_response.status_line(status);
+  m_response.date();
+  if(type)
+    m_response.content_type(type);
+  m_response.content_length(content_length);
+  m_response.connection(m_linger);
+}
+
+// 头部写完，作为一段追加到发送队列
+bool http_conn::end_response()
+{
+  m_response.blank_line();
+  char* base = NULL;
+  int len = 0;
+  if(!m_response.end(&base, &len))
+  {
+    LOG_ERROR("response header too large");
     return false;
+  }
+  add_segment(base, len, -1, 0);
+  return true;
+}
 
-  va_list arg_list;
-  va_start(arg_list, format);
-  // 将可变参数写入写缓冲区，返回写入数据的长度
-  int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-  // 如果写入的数据超过缓冲区的剩余空间，报错
-  if(len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
+// 预先序列化的头部直接作为一段，m_response 中只写入 Date 的值和空行，不需要格式化
+// 共享的头部、Date 和之后的内容是相邻的段，由一次 sendmsg 发出
+bool http_conn::add_prebuilt(const string& header)
+{
+  m_response.begin();
+  m_response.date_tail();
+  char* base = NULL;
+  int len = 0;
+  if(!m_response.end(&base, &len))
   {
-    va_end(arg_list);
+    LOG_ERROR("response header too large");
     return false;
   }
-  m_write_idx += len;     // 更新 m_write_idx 的位置
-  va_end(arg_list);
-  LOG_INFO("request:%s", m_write_buf);
-  Log::get_instance()->flush();
+  add_segment((char*) header.data(), header.size(), -1, 0);
+  add_segment(base, len, -1, 0);
   return true;
 }
 
-// 响应报文的状态行：
-// HTTP/1.1 200 OK
-bool http_conn::add_status_line(int status, const char *title)
+// 错误页面：预先序列化的头部之后是静态的页面内容
+bool http_conn::add_error(const error_response& error)
 {
-  return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
+  if(!add_prebuilt(error.header[m_linger ? 1 : 0]))
+    return false;
+  add_segment((char*) error.form, error.form_len, -1, 0);
+  return true;
 }
 
-// 响应报文的消息报头，包括内容长度、是否保持连接、添加空行
-bool http_conn::add_headers(int content_length)
+// 整个文件的 200 响应头部只和条目、编码、是否长连接有关，第一次使用时序列化，保存在缓存条目中供所有连接共享
+// 多个线程可能同时生成，只有第一个发布成功，其余的释放自己的那份
+const string* http_conn::get_file_header(CONTENT_ENCODING encoding, file_variant* variant)
 {
-  add_content_length(content_length);     // 报文的长度
-  add_linger();                           // 是否保持连接
-  add_blank_line();                       // 添加空行
+  std::atomic<string*>& slot = m_file_entry->headers[encoding][m_linger ? 1 : 0];
+  string* header = slot.load(std::memory_order_acquire);
+  if(header)
+    return header;
+
+  char buf[512];
+  http_response builder;
+  builder.init(buf, sizeof(buf));
+  builder.begin();
+  builder.status_line(200);
+  builder.content_type(m_file_entry->mime);
+  builder.content_length(variant ? variant->size : m_file_entry->st.st_size);
+  builder.connection(m_linger);
+  add_file_headers(builder, encoding);
+  if(variant)
+  {
+    const char* name = compressor::name(encoding);
+    builder.header("Content-Encoding", name, strlen(name));
+  }
+  builder.date_name();
+  char* base = NULL;
+  int len = 0;
+  if(!builder.end(&base, &len))
+  {
+    LOG_ERROR("response header too large");
+    return NULL;
+  }
+
+  header = new string(base, len);
+  string* expected = NULL;
+  if(!slot.compare_exchange_strong(expected, header, std::memory_order_acq_rel))
+  {
+    delete header;
+    header = expected;
+  }
+  return header;
+}
+
+// 取出小文件的内容，第一次使用时读入内存，保存在缓存条目中供所有连接共享
+// 多个线程可能同时读入，只有第一个发布成功，其余的释放自己的那份
+const char* http_conn::get_small_content()
+{
+  char* content = m_file_entry->content.load(std::memory_order_acquire);
+  if(content)
+    return content;
+
+  off_t size = m_file_entry->st.st_size;
+  content = (char*) malloc(size);
+  if(!content)
+    return NULL;
+  if(pread(m_file_entry->fd, content, size, 0) != size)
+  {
+    free(content);
+    return NULL;
+  }
+
+  char* expected = NULL;
+  if(!m_file_entry->content.compare_exchange_strong(expected, content, std::memory_order_acq_rel))
+  {
+    free(content);
+    content = expected;
+  }
+  return content;
 }
 
-bool http_conn::add_content_length(int content_length)
+// 解析 ";q=0.5" 形式的参数中的 q 值，以千分之一为单位；没有 q 参数时为 1000，格式不对时为 0
+static int parse_qvalue(const char* p, const char* end)
 {
-  return add_response("Content-Length:%d\r\n", content_length);
+  while(p < end)
+  {
+    while(p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+      ++p;
+    if(end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=')
+    {
+      p += 2;
+      if(p == end || *p < '0' || *p > '1')
+        return 0;
+      int q = (*p++ - '0') * 1000;
+      if(p < end && *p == '.')
+      {
+        ++p;
+        for(int scale = 100; scale > 0 && p < end && *p >= '0' && *p <= '9'; scale /= 10)
+          q += (*p++ - '0') * scale;
+      }
+      return q > 1000 ? 1000 : q;
+    }
+    const char* semi = (const char*) memchr(p, ';', end - p);
+    p = semi ? semi : end;
+  }
+  return 1000;
 }
 
-bool http_conn::add_content_type()
+// Accept-Encoding 中 coding 的 q 值，没有列出时取 "*" 的 q 值，都没有时为 0
+static int accept_quality(str_view accept, const char* coding)
 {
-  return add_response("Content-Type:%s\r\n", "text/html");
+  int len = strlen(coding);
+  int star = 0;
+  const char* p = accept.data;
+  const char* end = accept.data + accept.len;
+  while(p < end)
+  {
+    const char* comma = (const char*) memchr(p, ',', end - p);
+    const char* item_end = comma ? comma : end;
+    while(p < item_end && (*p == ' ' || *p == '\t'))
+      ++p;
+    const char* name = p;
+    while(p < item_end && *p != ';' && *p != ' ' && *p != '\t')
+      ++p;
+    int name_len = p - name;
+    if(name_len == len && strncasecmp(name, coding, len) == 0)
+      return parse_qvalue(p, item_end);
+    if(name_len == 1 && *name == '*')
+      star = parse_qvalue(p, item_end);
+    p = comma ? comma + 1 : end;
+  }
+  return star;
 }
 
-bool http_conn::add_linger()
+// 按 Accept-Encoding 选择目标文件的压缩变体，q 值高的优先，相同时按 CONTENT_ENCODING 的顺序
+// 客户端不接受或者文件没有可用的变体时返回 NULL，发送原文件
+file_variant* http_conn::get_variant(CONTENT_ENCODING* encoding)
 {
-  return add_response("Connection:%s\r\n", (m_linger == true) ? "keep-alive":"close");
+  str_view accept = m_request.header(HEADER_ACCEPT_ENCODING);
+  if(accept.empty())
+    return NULL;
+  int q[ENCODING_NUMBER];
+  for(int i=0; i<ENCODING_NUMBER; ++i)
+    q[i] = compressor::supported((CONTENT_ENCODING) i) ? accept_quality(accept, compressor::name((CONTENT_ENCODING) i)) : 0;
+
+  while(true)
+  {
+    int best = -1;
+    for(int i=0; i<ENCODING_NUMBER; ++i)
+    {
+      if(q[i] > 0 && (best == -1 || q[i] > q[best]))
+        best = i;
+    }
+    if(best == -1)
+      return NULL;
+    file_variant* variant = file_cache::get_instance()->get_variant(m_file_entry, (CONTENT_ENCODING) best);
+    if(variant)
+    {
+      *encoding = (CONTENT_ENCODING) best;
+      return variant;
+    }
+    q[best] = 0;
+  }
 }
 
-bool http_conn::add_blank_line()
+// 目标文件的 ETag："修改时间-大小"，压缩变体再加上编码的名称，和原文件区分开
+int http_conn::make_etag(char* out, CONTENT_ENCODING encoding)
 {
-  return add_response("%s", "\r\n");
+  char* p = out;
+  *p++ = '"';
+  p += http_response::format_hex(p, m_file_entry->st.st_mtime);
+  *p++ = '-';
+  p += http_response::format_hex(p, m_file_entry->st.st_size);
+  if(encoding != ENCODING_IDENTITY)
+  {
+    const char* name = compressor::name(encoding);
+    *p++ = '-';
+    memcpy(p, name, strlen(name));
+    p += strlen(name);
+  }
+  *p++ = '"';
+  return p - out;
 }
 
-// 添加文本 content
-bool http_conn::add_content(const char *content)
+// 文件响应共有的头部，客户端用 ETag 或 Last-Modified 作为 If-Range 的值
+void http_conn::add_file_headers(http_response& response, CONTENT_ENCODING encoding)
 {
-  return add_response("%s", content);
+  char etag[MAX_ETAG_LEN];
+  response.header("Accept-Ranges", "bytes", sizeof("bytes") - 1);
+  response.header("ETag", etag, make_etag(etag, encoding));
+  response.last_modified(m_file_entry->st.st_mtime);
+  if(m_file_entry->compressible)
+    response.header("Vary", "Accept-Encoding", sizeof("Accept-Encoding") - 1);
 }
 
-//根据 do_request 的返回状态，子线程调用 process_write向m_write_buf写入响应报文
-bool http_conn::process_write(HTTP_CODE ret)
+// 目标文件的 [offset, offset + len) 追加到发送队列，和整个文件的发送方式相同，只是起点和长度不同
+void http_conn::add_file_segment(off_t offset, off_t len)
 {
-  switch(ret)
+  // 小文件：内容在内存中，和头部一起由一次 sendmsg 发送，不需要映射文件
+  if(m_file_entry->st.st_size <= SMALL_FILE_SIZE)
   {
-    case INTERNAL_ERROR:
+    const char* content = get_small_content();
+    if(content)
     {
-      add_status_line(500, error_500_title);
-      add_headers(strlen(error_500_form));
-      if(!add_content(error_500_form))
-        return false;
+      add_segment((char*) content + offset, len, -1, 0);
+      return;
+    }
+  }
+#ifdef MMAPFILE
+  // 指向mmap返回的文件指针
+  add_segment(m_file_address + offset, len, -1, 0);
+#endif
+#ifdef SENDFILE
+  // 文件内容由 write 调用 sendfile 发送，共享缓存条目中的文件描述符，偏移各自独立
+  add_segment(NULL, len, m_file_entry->fd, offset);
+#endif
+}
+
+// If-Range 是强校验：ETag 必须完全一致（弱 ETag 不匹配），时间必须和 Last-Modified 完全一致
+bool http_conn::if_range_match(str_view value)
+{
+  while(value.len > 0 && (value.data[0] == ' ' || value.data[0] == '\t'))
+  {
+    ++value.data;
+    --value.len;
+  }
+  if(value.len > 0 && value.data[0] == '"')
+  {
+    char etag[MAX_ETAG_LEN];
+    int len = make_etag(etag, ENCODING_IDENTITY);
+    return value.len == len && memcmp(value.data, etag, len) == 0;
+  }
+  if(value.len != http_response::DATE_LEN)
+    return false;
+  char date[http_response::DATE_LEN];
+  http_response::format_date(date, m_file_entry->st.st_mtime);
+  return memcmp(value.data, date, http_response::DATE_LEN) == 0;
+}
+
+// 解析一个范围的端点，最多 18 位十进制，不会溢出
+static bool parse_offset(const char** p, const char* end, off_t* value)
+{
+  const char* s = *p;
+  off_t v = 0;
+  while(s < end && *s >= '0' && *s <= '9' && s - *p < 18)
+    v = v * 10 + (*s++ - '0');
+  if(s == *p || (s < end && *s >= '0' && *s <= '9'))
+    return false;
+  *p = s;
+  *value = v;
+  return true;
+}
+
+// 解析 "bytes=0-99, 200-, -50"，可满足的范围按出现的顺序写入 ranges，超出文件末尾的部分截掉
+// 返回可满足的范围数，0 表示都不可满足；格式错误、单位不是 bytes 或者范围多于 max 个时返回 -1
+static int parse_range(str_view value, off_t size, http_conn::byte_range* ranges, int max)
+{
+  const char* p = value.data;
+  const char* end = value.data + value.len;
+  if(value.len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+    return -1;
+  p += 6;
+
+  int count = 0;
+  int specs = 0;
+  while(true)
+  {
+    while(p < end && (*p == ' ' || *p == '\t' || *p == ','))
+      ++p;
+    if(p == end)
       break;
+    if(++specs > max)
+      return -1;
+
+    off_t from = -1;
+    off_t to = -1;
+    if(*p != '-' && !parse_offset(&p, end, &from))
+      return -1;
+    if(p == end || *p != '-')
+      return -1;
+    ++p;
+    if(p < end && *p >= '0' && *p <= '9' && !parse_offset(&p, end, &to))
+      return -1;
+    while(p < end && (*p == ' ' || *p == '\t'))
+      ++p;
+    if(p < end && *p != ',')
+      return -1;
+
+    if(from == -1)
+    {
+      // "-n"：最后 n 个字节
+      if(to == -1)
+        return -1;
+      if(to == 0)
+        continue;
+      from = to >= size ? 0 : size - to;
+      to = size - 1;
     }
-    case BAD_REQUEST:
+    else
     {
-      add_status_line(404, error_404_title);
-      add_headers(strlen(error_404_form));
-      if(!add_content(error_404_form))
-        return false;
-      break;
+      if(to != -1 && to < from)
+        return -1;
+      if(from >= size)
+        continue;
+      if(to == -1 || to >= size)
+        to = size - 1;
     }
-    case FORBIDDEN_REQUEST:
+    ranges[count].from = from;
+    ranges[count].to = to;
+    ++count;
+  }
+  return specs > 0 ? count : -1;
+}
+
+// 请求的范围，只有 GET 才处理 Range；If-Range 不一致时文件已经变了，发送整个文件
+// 返回值同 parse_range：-1 发送整个文件，0 回复 416
+int http_conn::get_ranges(byte_range* ranges)
+{
+  if(m_method != GET)
+    return -1;
+  str_view range = m_request.header(HEADER_RANGE);
+  if(range.empty())
+    return -1;
+  if(m_request.has_header(HEADER_IF_RANGE) && !if_range_match(m_request.header(HEADER_IF_RANGE)))
+    return -1;
+  return parse_range(range, m_file_entry->st.st_size, ranges, MAX_RANGES);
+}
+
+// multipart/byteranges 的分隔符，进程启动时随机生成
+static string make_boundary()
+{
+  std::random_device rd;
+  unsigned long v = ((unsigned long) rd() << 32) | rd();
+  char buf[16];
+  return string(buf, http_response::format_hex(buf, v));
+}
+
+static const string range_boundary = make_boundary();
+static const string multipart_type = "multipart/byteranges; boundary=" + range_boundary;
+
+// 206 响应，范围总是针对原文件，不使用压缩变体
+// 一个范围：Content-Range 加上文件的这一部分
+// 多个范围：multipart/byteranges，先把每个部分的头部和结尾的分隔行写入 m_response，算出消息体的长度，
+// 再写响应的头部；发送队列中是响应头部、（部分头部、文件的一部分）……、结尾，文件内容都不复制
+bool http_conn::add_ranges(const byte_range* ranges, int count)
+{
+  off_t size = m_file_entry->st.st_size;
+  if(count == 1)
+  {
+    off_t len = ranges[0].to - ranges[0].from + 1;
+    begin_response(206, m_file_entry->mime, len);
+    m_response.content_range(ranges[0].from, ranges[0].to, size);
+    add_file_headers(m_response, ENCODING_IDENTITY);
+    if(!end_response())
+      return false;
+    add_file_segment(ranges[0].from, len);
+    return true;
+  }
+
+  char* part_base[MAX_RANGES + 1];
+  int part_len[MAX_RANGES + 1];
+  long total = 0;
+  for(int i=0; i<=count; ++i)
+  {
+    m_response.begin();
+    if(i < count)
     {
-      add_status_line(403, error_403_title);
-      add_headers(strlen(error_403_form));
-      if(!add_content(error_403_form))
-        return false;
-      break;
+      m_response.boundary(range_boundary.c_str(), range_boundary.size(), false);
+      m_response.content_type(m_file_entry->mime);
+      m_response.content_range(ranges[i].from, ranges[i].to, size);
+      m_response.blank_line();
+      total += ranges[i].to - ranges[i].from + 1;
+    }
+    else
+      m_response.boundary(range_boundary.c_str(), range_boundary.size(), true);
+    if(!m_response.end(&part_base[i], &part_len[i]))
+    {
+      LOG_ERROR("response header too large");
+      return false;
     }
+    total += part_len[i];
+  }
+
+  begin_response(206, multipart_type.c_str(), total);
+  add_file_headers(m_response, ENCODING_IDENTITY);
+  if(!end_response())
+    return false;
+  for(int i=0; i<count; ++i)
+  {
+    add_segment(part_base[i], part_len[i], -1, 0);
+    add_file_segment(ranges[i].from, ranges[i].to - ranges[i].from + 1);
+  }
+  add_segment(part_base[count], part_len[count], -1, 0);
+  return true;
+}
+
+//根据 do_request 的返回状态，子线程调用 process_write 把响应的头部写入 m_response，并把头部和内容追加到发送队列
+bool http_conn::process_write(HTTP_CODE ret)
+{
+  // 这一批的第一个响应才申请发送队列和写缓冲区
+  if(!m_out_block && !alloc_output())
+    return false;
+  switch(ret)
+  {
+    // 错误页面发送预先序列化好的响应
+    case INTERNAL_ERROR:
+      return add_error(error_500_response);
+    case BAD_REQUEST:
+      // 请求的边界可能已经错乱，读缓冲区中剩下的数据不能再当作请求解析，发送完后关闭连接
+      m_linger = false;
+      return add_error(error_400_response);
+    case NOT_IMPLEMENTED:
+      m_linger = false;
+      return add_error(error_501_response);
+    case NO_RESOURCE:
+      return add_error(error_404_response);
+    case FORBIDDEN_REQUEST:
+      return add_error(error_403_response);
     case FILE_REQUEST:
     {
-      add_status_line(200, ok_200_title);
-      if(m_file_stat.st_size != 0)
+      off_t size = m_file_entry->st.st_size;
+      if(size == 0)
       {
-        add_headers(m_file_stat.st_size);
-        // 第一个iovec指针指向响应报文缓冲区，长度为m_write_idx
-        m_iv[0].iov_base = m_write_buf;
-        m_iv[0].iov_len = m_write_idx;
-        // 第二个iovec指向mmap返回的文件指针，长度为文件大小
-        m_iv[1].iov_base = m_file_address;
-        m_iv[1].iov_len = m_file_stat.st_size;
-        m_iv_count = 2;
-        // 发送的所有数据为响应头部和文件大小
-        bytes_to_send = m_write_idx + m_file_stat.st_size;
+        // 如果请求资源为空，则返回一个空 html
+        static const char ok_string[] = "<html><body></body></html>";
+        begin_response(200, m_file_entry->mime, sizeof(ok_string) - 1);
+        if(!end_response())
+          return false;
+        add_segment((char*) ok_string, sizeof(ok_string) - 1, -1, 0);
         return true;
       }
-      else
+
+      // 范围请求：只发送请求的部分；都不可满足时回复 416
+      byte_range ranges[MAX_RANGES];
+      int range_count = get_ranges(ranges);
+      if(range_count > 0)
+        return add_ranges(ranges, range_count);
+      if(range_count == 0)
       {
-        // 如果请求资源为空，则返回一个空 html
-        const char* ok_string = "<html><body></body></html>";
-        add_headers(strlen(ok_string));
-        if(!add_content(ok_string))
-          return false;
+        begin_response(416, NULL, 0);
+        m_response.content_range_unsatisfied(size);
+        return end_response();
       }
+
+      // 可压缩的文件按 Accept-Encoding 选择变体，无论是否压缩都带上 Vary，让缓存按编码区分
+      CONTENT_ENCODING encoding = ENCODING_IDENTITY;
+      file_variant* variant = m_file_entry->compressible ? get_variant(&encoding) : NULL;
+
+      // 头部缓存在条目中，只补上 Date，不需要格式化
+      const string* header = get_file_header(encoding, variant);
+      if(!header || !add_prebuilt(*header))
+        return false;
+
+      // 压缩变体和原文件的发送方式相同：小的从内存和头部一起 sendmsg，大的 sendfile
+      if(variant)
+      {
+#ifdef SENDFILE
+        if(variant->size > SMALL_FILE_SIZE)
+        {
+          add_segment(NULL, variant->size, variant->fd, 0);
+          return true;
+        }
+#endif
+        add_segment(variant->address, variant->size, -1, 0);
+        return true;
+      }
+
+      add_file_segment(0, size);
+      return true;
     }
     default:
       return false;
   }
-  // 除了 FILE_REQUEST外，其余状态只申请一个iovec，指向响应报文缓冲区
-  m_iv[0].iov_base = m_write_buf;
-  m_iv[0].iov_len = m_write_idx;
-  m_iv_count = 1;
-  bytes_to_send = m_write_idx;
-  return true;
+}
+
+// 生成注册的 INSERT，由 process 提交
+// 预处理语句的参数，不拼接到语句中；同一时间段的注册由 sql_executor 合并成一条多行 INSERT
+http_conn::HTTP_CODE http_conn::register_user(const char* name, const char* passwd)
+{
+  m_db_task = new sql_task;
+  m_db_task->insert = &user_insert;
+  m_db_task->params.push_back(name);
+  m_db_task->params.push_back(passwd);
+  m_db_insert = true;
+  return DB_REQUEST;
+}
+
+// 异步数据库操作完成，在事件循环中由完成回调调用
+bool http_conn::db_finish(sql_task* task)
+{
+  m_db_ok = task->ok;
+  // 注册写入失败，让出占住的用户名；只删除自己占住的条目，加载用户表时可能已经换成了数据库中的同名用户
+  if(task->insert && !task->ok)
+    users.erase(task->params[0], task->params[1]);
+  // 查询的结果集在回调返回后释放，先取出第一行第一列
+  m_db_found = false;
+  if(task->result)
+  {
+    MYSQL_ROW row = mysql_fetch_row(task->result);
+    if(row && row[0])
+    {
+      m_db_found = true;
+      m_db_value = row[0];
+    }
+  }
+  int expected = DB_PENDING;
+  if(m_db_state.compare_exchange_strong(expected, DB_DONE))
+    return true;
+  // 等待期间已经超时，由调用者关闭连接
+  // 注册前的查询不会再回到 do_request，在这里处理占住的用户名：已经存在则换成数据库中的密码，否则让出
+  if(m_db_reserved)
+  {
+    if(m_db_found)
+      users.assign(task->params[0], m_db_value);
+    else
+      users.erase(task->params[0], m_db_passwd);
+    m_db_reserved = false;
+  }
+  m_db_state = DB_IDLE;
+  m_db_resumed = false;
+  return false;
+}
+
+// 定时器到期时调用，以下两种情况不能现在关闭连接，只标记为 DB_ABANDONED：
+// 1. 正在等待数据库，数据库线程完成后还会访问它，由完成回调关闭
+// 2. 数据库已经完成，连接已经交给工作线程，由 process 处理完后关闭
+bool http_conn::abandon_db()
+{
+  int expected = DB_PENDING;
+  if(m_db_state.compare_exchange_strong(expected, DB_ABANDONED))
+    return true;
+  expected = DB_DONE;
+  return m_db_state.compare_exchange_strong(expected, DB_ABANDONED);
+}
+
+// 从数据库操作返回的请求处理完毕，工作线程交还连接：状态改为 next（DB_IDLE 或者又提交了数据库操作的 DB_PENDING）
+// 处理期间定时器已经到期时返回 false，由调用者关闭连接
+bool http_conn::finish_db(int next)
+{
+  int expected = DB_DONE;
+  if(m_db_state.compare_exchange_strong(expected, next))
+    return true;
+  m_db_state = DB_IDLE;
+  m_db_resumed = false;
+  return false;
 }
 
 // 处理 http 请求的入口函数
+// 读缓冲区中可能有多个流水线请求：依次解析，把响应按顺序追加到同一个发送队列，最后一次性发出
 void http_conn::process()
 {
-  // 进来首先解析请求报文,保存返回的状态
-  HTTP_CODE read_ret = process_read();
-  // 如果还没读取完，则继续读取
-  if(read_ret == NO_REQUEST)
+#ifdef ASYNCSQL
+  // 数据库操作已经完成，回到暂停的请求继续处理
+  // 从这里到重新注册事件之前连接都归工作线程，定时器到期只会把 DB_DONE 改成 DB_ABANDONED
+  bool resumed = m_db_state != DB_IDLE;
+  m_db_resumed = resumed;
+#endif
+  do
+  {
+    HTTP_CODE read_ret;
+#ifdef ASYNCSQL
+    if(m_db_resumed)
+      read_ret = do_request();
+    else
+#endif
+    // 进来首先解析请求报文,保存返回的状态
+    read_ret = process_read();
+    // 如果还没读取完，则继续读取
+    if(read_ret == NO_REQUEST)
+      break;
+#ifdef ASYNCSQL
+    // 提交数据库操作后立即返回，已经放入发送队列的流水线响应等这个请求完成后一起发送
+    // EPOLLONESHOT 下连接此时不监听任何事件，不会被其他工作线程处理，直到完成回调把它重新放回线程池
+    if(read_ret == DB_REQUEST)
+    {
+      sql_task* task = m_db_task;
+      m_db_task = NULL;
+      task->callback = db_complete;
+      task->arg = this;
+      if(!resumed)
+        m_db_state = DB_PENDING;
+      else if(!finish_db(DB_PENDING))
+      {
+        // 注册前的查询之后生成的 INSERT 不再提交，让出占住的用户名
+        if(task->insert)
+          users.erase(task->params[0], task->params[1]);
+        delete task;
+        close_conn();
+        return;
+      }
+      sql_executor::get_instance()->submit(task);
+      return;
+    }
+#endif
+    // 根据解析后的状态填写响应报文
+    if(!process_write(read_ret))
+    {
+#ifdef ASYNCSQL
+      if(resumed)
+        finish_db(DB_IDLE);
+#endif
+      close_conn();
+      return;
+    }
+    finish_request();
+  } while(can_pipeline());
+
+#ifdef ASYNCSQL
+  if(resumed && !finish_db(DB_IDLE))
+  {
+    close_conn();
+    return;
+  }
+#endif
+
+  // 没有完整的请求，继续读取
+  if(m_seg_count == 0)
   {
     modfd(m_epollfd, m_sockfd, EPOLLIN);
     return;
   }
-  // 根据解析后的状态填写响应报文
-  bool write_ret = process_write(read_ret);
-  if(!write_ret)
-    close_conn();
   // 编写好响应报文后，注册 EPOLLOUT，主线程检测到写就绪事件，调用 http_conn::write 将报文发给客户端
   modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
-
-
-
-
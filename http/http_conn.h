@@ -24,17 +24,44 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <atomic>
 
 #include "../locker/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../CGImysql/sql_executor.h"
+#include "../cache/file_cache.h"
+#include "http_scan.h"
+#include "http_request.h"
+#include "http_response.h"
+
+#define ASYNCSQL      // 注册时的数据库写入交给 sql_executor 异步执行，工作线程不等待数据库
+
+struct error_response;        // 预先序列化的错误页面，在 http_conn.cpp 中定义
 
 // 使用有限状态机实现的 http 连接处理类
 class http_conn
 {
 public:
   static const int FILENAME_LEN = 200;            // 文件名的最大长度
-  static const int READ_BUFFER_SIZE = 2048;       // 读缓冲区的大小
-  static const int WRITE_BUFFER_SIZE = 1024;      // 写缓冲区的大小
+  static const int READ_BUFFER_SIZE = 2048;       // 读缓冲区的初始大小
+  static const int MAX_READ_BUFFER_SIZE = 65536;  // 读缓冲区最多扩容到的大小，即请求行和头部的上限
+  static const int MAX_BUFFERED_BODY = 8192;      // 不超过该长度的消息体完整保存在读缓冲区中，更长的流式处理
+  static const int WRITE_BUFFER_SIZE = 1024;      // 写缓冲区的大小，和发送队列一起从缓冲区池中申请，写不下时溢出到更大的缓冲区
+  static const int MAX_PIPELINE = 8;              // 一批最多合并发送的流水线响应数
+  static const int MAX_RANGES = 8;                // 一个 Range 头部最多的范围数，更多时发送整个文件
+  // 一个响应最多的段数：普通响应是预先序列化的头部、Date 和内容三段，
+  // multipart/byteranges 是头部、每个部分的头部和内容、结尾的分隔行
+  static const int MAX_RESPONSE_SEGMENT = MAX_RANGES * 2 + 2;
+  // 发送队列的最大段数：MAX_PIPELINE 个普通响应，或者前面的普通响应之后再跟一个 multipart 响应
+  static const int MAX_SEGMENT = MAX_PIPELINE * 3 + MAX_RESPONSE_SEGMENT - 3;
+  static const int MAX_ETAG_LEN = 48;             // "修改时间-大小-编码"，都是十六进制
+
+  // Range 中的一个范围，to 包含在内
+  struct byte_range
+  {
+    off_t from;
+    off_t to;
+  };
 
   // http 请求的方法，目前只实现 GET 和 POST
   enum METHOD
@@ -68,7 +95,18 @@ public:
     FORBIDDEN_REQUEST,        // 客户没有权限请求该资源
     FILE_REQUEST,             // 文件请求
     INTERNAL_ERROR,           // 服务器内部错误
-    CLOSED_CONNECTION         // 客户断开连接
+    CLOSED_CONNECTION,        // 客户断开连接
+    DB_REQUEST,               // 需要等待异步数据库操作（ASYNCSQL）
+    NOT_IMPLEMENTED           // 请求使用了不支持的功能，如 Transfer-Encoding
+  };
+
+  // 异步数据库操作的状态（ASYNCSQL）
+  enum DB_STATE
+  {
+    DB_IDLE = 0,              // 没有数据库操作
+    DB_PENDING,               // 已经提交，等待完成，此时连接不在内核事件表中监听任何事件
+    DB_DONE,                  // 已经完成，工作线程继续处理请求，处理完才重新注册事件
+    DB_ABANDONED              // 等待或者继续处理期间连接超时，完成回调或者工作线程处理完后关闭连接
   };
 
   // 行的读取状态，从状态机
@@ -80,80 +118,130 @@ public:
   };
 
 public:
-  http_conn(){}
+  http_conn(): m_read_buf(NULL), m_read_size(0), m_out_block(NULL), m_out_size(0), m_write_buf(NULL),
+               m_file_entry(NULL), m_file_address(0), m_segs(NULL), m_batch_entries(NULL), m_batch_count(0),
+               m_db_state(DB_IDLE), m_db_ok(false), m_db_task(NULL), m_db_insert(false), m_db_resumed(false),
+               m_db_reserved(false) {}
   ~http_conn(){}
 
 public:
-  void init(int sockfd, const sockaddr_in& addr);   // 初始化新接受的连接
+  void init(int sockfd, const sockaddr_in& addr, int epollfd);   // 初始化新接受的连接，epollfd 为所属 reactor 的内核事件表
   void close_conn(bool real_close = true);          // 关闭连接
   void process();                                   // 处理客户请求
   bool read_once();                                 // 非阻塞读
   bool write();                                     // 非阻塞写
+  bool has_pending() { return m_read_idx > 0; }     // 读缓冲区中是否还有未处理的流水线数据
+  bool is_writing() { return m_seg_idx < m_seg_count; }   // 发送队列中是否还有没发出去的响应
+  bool reading_body() { return m_check_state == CHECK_STATE_CONTENT; }   // 请求行和头部已经读完，正在接收消息体
   sockaddr_in *get_address() { return &m_address;}   // 返回地址
+  int get_sockfd() { return m_sockfd; }
+  const http_request& get_request() const { return m_request; }   // 正在处理的请求
+  bool db_finish(sql_task* task);                   // 数据库操作完成，返回 false 表示连接已被放弃，需要关闭
+  bool abandon_db();                                // 连接超时，正在等待数据库或者刚从数据库返回时返回 true，由它们关闭连接
   void init_mysql_result(connection_pool *connPool);
 
 private:
   void init();                                      // 初始化连接
+  void init_request();                              // 初始化一个请求的解析状态
+  void init_output();                               // 初始化发送队列
+  void finish_request();                            // 一个请求处理完毕，准备解析下一个
+  bool can_pipeline();                              // 能否继续合并下一个请求的响应
+  void add_segment(char* base, int len, int fd, off_t offset);
+  bool alloc_output();                              // 从缓冲区池申请发送队列和写缓冲区
+  void free_buffers();                              // 连接空闲时把缓冲区还给缓冲区池
   HTTP_CODE process_read();                         // 解析 http 请求
   bool process_write(HTTP_CODE ret);                // 填充 http 应答
 
   // 下面一组函数用来被 process_read 调用解析 http 请求
-  HTTP_CODE parse_request_line(char* text);
-  HTTP_CODE parse_headers(char* text);
+  HTTP_CODE parse_request_line(char* text, char* end);    // [text, end) 是去掉 \r\n 的一行
+  HTTP_CODE parse_headers(char* text, char* end);
   HTTP_CODE parse_content(char* text);
   HTTP_CODE do_request();
+  HTTP_CODE register_user(const char* name, const char* passwd);   // 生成注册的 INSERT（ASYNCSQL）
+  bool finish_db(int next);                         // 从数据库返回的请求处理完，交还连接
   char* get_line() {return m_read_buf + m_start_line;};
+  bool grow_read_buffer(int size);
+  void shrink_read_buffer();
   LINE_STATUS parse_line();
 
   // 下面一组函数被 process_write 调用填充 http 应答
-  void unmap();
-  bool add_response(const char* format, ...);
-  bool add_content(const char* content);
-  bool add_status_line(int status, const char* title);
-  bool add_headers(int content_length);
-  bool add_content_type();
-  bool add_content_length(int content_length);
-  bool add_linger();
-  bool add_blank_line();
+  void unmap();                                     // 释放目标文件的缓存条目
+  void begin_response(int status, const char* type, long content_length);   // 状态行和通用的头部
+  bool end_response();                              // 空行，把头部追加到发送队列
+  bool add_prebuilt(const string& header);          // 预先序列化的头部，补上 Date 和空行
+  bool add_error(const error_response& error);      // 预先序列化的错误页面
+  const char* get_small_content();                  // 小文件缓存在内存中的内容
+  const string* get_file_header(CONTENT_ENCODING encoding, file_variant* variant);   // 缓存在条目中的 200 响应头部
+  file_variant* get_variant(CONTENT_ENCODING* encoding);   // 按 Accept-Encoding 选择的压缩变体
+  // Accept-Ranges、ETag、Last-Modified、Vary
+  void add_file_headers(http_response& response, CONTENT_ENCODING encoding);
+  void add_file_segment(off_t offset, off_t len);   // 目标文件的 [offset, offset + len)，不复制
+  int make_etag(char* out, CONTENT_ENCODING encoding);   // 目标文件的 ETag，返回长度，out 至少 MAX_ETAG_LEN 字节
+  bool if_range_match(str_view value);              // If-Range 是否和目标文件当前的 ETag 或 Last-Modified 一致
+  int get_ranges(byte_range* ranges);               // 请求的范围
+  bool add_ranges(const byte_range* ranges, int count);   // 206 响应
 
 public:
-  // 所有 socket 上的事件都被注册到同一个 epoll 内核事件表中
-  static int m_epollfd;
-  static int m_user_count;      // 统计用户数量
-  MYSQL *mysql;
+  static std::atomic<int> m_user_count;      // 统计用户数量，多个 reactor 和工作线程会同时修改
+  connectionRAII* db;                        // 工作线程处理本连接期间的数据库连接，调用 db->get() 时才真正获取
+  std::atomic<int> worker_id;                // 上次处理该连接的工作线程，线程池按它分配任务（POOL_STEAL）
 
 private:
   int m_sockfd;                           // 本 http 连接的 socket
+  int m_epollfd;                          // 本连接注册到的内核事件表，即接受它的 reactor 的 epollfd
   sockaddr_in m_address;                  // 对方的 socket 地址
 
-  char m_read_buf[READ_BUFFER_SIZE];      // 读缓冲区
+  char* m_read_buf;                       // 读缓冲区，从缓冲区池中申请，按需扩容，空闲时缩回初始大小
+  int m_read_size;                        // 读缓冲区的大小
   int m_read_idx;                         // 读缓冲区中已经读入的数据的最后一个字节的下一个位置
   int m_checked_idx;                      // 当前正在分析的字符在区中的位置
   int m_start_line;                       // 当前正在解析的行的起始位置
-  char m_write_buf[WRITE_BUFFER_SIZE];    // 写缓冲区
-  int m_write_idx;                        // 写区待发送的字节数
+  // 发送队列、文件条目表和写缓冲区共用一块从缓冲区池申请的内存，只在有响应要发送时持有
+  char* m_out_block;
+  int m_out_size;
+  char* m_write_buf;                      // 写缓冲区，响应头部的内联空间
+  http_response m_response;               // 把这一批响应的头部依次写入写缓冲区
 
   CHECK_STATE m_check_state;              // 主状态机的状态
   METHOD m_method;                        // 请求的类型
 
-  // 客户请求的目标文件的完整路径, doc_root + m_url
-  char m_real_file[FILENAME_LEN];
   char* m_url;                             // 客户请求的目标文件的文件名
-  char* m_version;                         // http 协议版本号
-  char* m_host;                            // 主机号
-  int m_content_len;                       // 请求消息体的长度
+  http_request m_request;                  // 请求行和全部头部，都是读缓冲区中的片段
+  long m_content_len;                      // 请求消息体的长度
   bool m_linger;                            // 请求是否保持连接
 
-  char* m_file_address;                     // 目标文件的地址
-  // 文件的状态，包括是否存在、是否为目录、是否可读、文件大小等
-  struct stat m_file_stat;
-  struct iovec m_iv[2];                       // io 内存块,有一个数据指针和数据长度
-  int m_iv_count;                             // 被写内存块的数量
+  file_entry* m_file_entry;                 // 目标文件在静态文件缓存中的条目
+  char* m_file_address;                     // 目标文件的地址（MMAPFILE）
+  // 发送队列中的一段：fd 为 -1 时是内存块，否则是文件中 [offset, offset + len) 的部分
+  struct segment
+  {
+    char* base;
+    int len;
+    int fd;
+    off_t offset;
+  };
+  segment* m_segs;                            // 发送队列，依次保存这一批响应的各段
+  int m_seg_count;                            // 发送队列的段数
+  int m_seg_idx;                              // 下一个要发送的段
+  file_entry** m_batch_entries;               // 这一批响应持有的文件条目，发送完毕后释放
+  int m_batch_count;
+  bool m_close_after_write;                   // 这一批中有不保持连接的请求，发送完后关闭连接
 
   int cgi;                                    // post 的时候才启用
   char* m_string;                             // 存储消息体数据
+  long m_body_read;                           // 流式处理时已经消费的消息体字节数
   int bytes_to_send;
   int bytes_have_send;
+
+  std::atomic<int> m_db_state;                // 异步数据库操作的状态，见 DB_STATE
+  bool m_db_ok;                               // 数据库操作是否成功
+  sql_task* m_db_task;                        // do_request 生成、等待 process 提交的数据库操作
+  bool m_db_found;                            // 查询是否返回了结果
+  string m_db_value;                          // 查询结果第一行的第一列
+  bool m_db_insert;                           // 等待的是注册的 INSERT，否则是查询
+  bool m_db_resumed;                          // do_request 是从数据库操作返回后再次进入的
+  bool m_db_reserved;                         // 等待的是注册前的查询，users 中占住了用户名，密码在 m_db_passwd
+  string m_db_passwd;                         // 连接被放弃时用来让出占住的用户名
 };
 
 #endif //XLAOTINYWEBSERVER_HTTP_CONN_H
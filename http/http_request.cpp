@@ -0,0 +1,95 @@
+//
+// Created by acg on 1/6/22.
+//
+
+#include "http_request.h"
+
+static const int HEADER_HASH_SIZE = 64;           // 哈希值的范围，switch 编译成跳转表
+static const int MIN_HEADER_LEN = 2;              // 识别的头部名称的最短和最长长度
+static const int MAX_HEADER_LEN = 25;
+
+// 完美哈希：长度、第二个字符、最后一个字符的线性组合，系数是对 HTTP_HEADER_LIST 搜索得到的
+// | 0x20 把大写字母转成小写，头部名称中的 '-' 和数字不受影响
+// constexpr，case 标签中的哈希值在编译期算出
+static constexpr unsigned header_hash(const char* name, int len)
+{
+  return (len * 5 + ((unsigned char) name[1] | 0x20) * 9 + ((unsigned char) name[len - 1] | 0x20)) &
+         (HEADER_HASH_SIZE - 1);
+}
+
+#define HTTP_HEADER_NAME(id, name) name,
+static const char* const header_names[] = {
+  HTTP_HEADER_LIST(HTTP_HEADER_NAME)
+};
+#undef HTTP_HEADER_NAME
+
+#define HTTP_HEADER_LEN(id, name) sizeof(name) - 1,
+static const int header_lens[] = {
+  HTTP_HEADER_LIST(HTTP_HEADER_LEN)
+};
+#undef HTTP_HEADER_LEN
+
+HTTP_HEADER http_request::lookup(const char* name, int len)
+{
+  if(len < MIN_HEADER_LEN || len > MAX_HEADER_LEN)
+    return HEADER_UNKNOWN;
+
+  HTTP_HEADER h;
+  switch(header_hash(name, len))
+  {
+#define HTTP_HEADER_CASE(id, str) case header_hash(str, sizeof(str) - 1): h = id; break;
+    HTTP_HEADER_LIST(HTTP_HEADER_CASE)
+#undef HTTP_HEADER_CASE
+    default:
+      return HEADER_UNKNOWN;
+  }
+  // 哈希值相同的只有这一个识别的头部，名称一致才是它
+  if(header_lens[h] != len || strncasecmp(header_names[h], name, len) != 0)
+    return HEADER_UNKNOWN;
+  return h;
+}
+
+const char* http_request::name_of(HTTP_HEADER h)
+{
+  return h < HEADER_NUMBER ? header_names[h] : "";
+}
+
+void http_request::clear(const char* base)
+{
+  m_base = base;
+  memset(&m_method, 0, sizeof(m_method));
+  m_path = m_query = m_version = m_body = m_method;
+  m_count = 0;
+  m_present = 0;
+}
+
+void http_request::add_header(const char* name, int name_len, const char* value, int value_len)
+{
+  if(m_count < MAX_HEADERS)
+  {
+    set(m_names[m_count], name, name_len);
+    set(m_values[m_count], value, value_len);
+    ++m_count;
+  }
+
+  HTTP_HEADER h = lookup(name, name_len);
+  if(h != HEADER_UNKNOWN && !has_header(h))
+  {
+    set(m_known[h], value, value_len);
+    m_present |= 1u << h;
+  }
+}
+
+str_view http_request::header(const char* name) const
+{
+  int len = strlen(name);
+  HTTP_HEADER h = lookup(name, len);
+  if(h != HEADER_UNKNOWN)
+    return header(h);
+  for(int i=0; i<m_count; ++i)
+  {
+    if(m_names[i].len == len && strncasecmp(m_base + m_names[i].off, name, len) == 0)
+      return view(m_values[i]);
+  }
+  return str_view();
+}
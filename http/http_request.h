@@ -0,0 +1,142 @@
+//
+// Created by acg on 1/6/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_HTTP_REQUEST_H
+#define XLAOTINYWEBSERVER_HTTP_REQUEST_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+// 读缓冲区中的一段字符，类似 C++17 的 string_view：不复制，也不保证以 '\0' 结尾
+struct str_view
+{
+  const char* data;               // 不存在时为 NULL
+  int len;
+
+  str_view(): data(NULL), len(0) {}
+  str_view(const char* d, int l): data(d), len(l) {}
+
+  bool empty() const { return len == 0; }
+  bool equals(const char* s) const { return (int) strlen(s) == len && memcmp(data, s, len) == 0; }
+  bool iequals(const char* s) const { return (int) strlen(s) == len && strncasecmp(data, s, len) == 0; }
+};
+
+// 识别的请求头部，HEADER_xxx 是它在 http_request 中的下标
+// 新增头部时加在列表中即可，名称按 RFC 的写法，比较时不区分大小写
+#define HTTP_HEADER_LIST(X) \
+  X(HEADER_HOST, "Host") \
+  X(HEADER_CONNECTION, "Connection") \
+  X(HEADER_KEEP_ALIVE, "Keep-Alive") \
+  X(HEADER_CONTENT_LENGTH, "Content-Length") \
+  X(HEADER_CONTENT_TYPE, "Content-Type") \
+  X(HEADER_CONTENT_ENCODING, "Content-Encoding") \
+  X(HEADER_TRANSFER_ENCODING, "Transfer-Encoding") \
+  X(HEADER_ACCEPT, "Accept") \
+  X(HEADER_ACCEPT_ENCODING, "Accept-Encoding") \
+  X(HEADER_ACCEPT_LANGUAGE, "Accept-Language") \
+  X(HEADER_ACCEPT_CHARSET, "Accept-Charset") \
+  X(HEADER_USER_AGENT, "User-Agent") \
+  X(HEADER_REFERER, "Referer") \
+  X(HEADER_COOKIE, "Cookie") \
+  X(HEADER_AUTHORIZATION, "Authorization") \
+  X(HEADER_ORIGIN, "Origin") \
+  X(HEADER_CACHE_CONTROL, "Cache-Control") \
+  X(HEADER_PRAGMA, "Pragma") \
+  X(HEADER_IF_NONE_MATCH, "If-None-Match") \
+  X(HEADER_IF_MODIFIED_SINCE, "If-Modified-Since") \
+  X(HEADER_IF_MATCH, "If-Match") \
+  X(HEADER_IF_UNMODIFIED_SINCE, "If-Unmodified-Since") \
+  X(HEADER_IF_RANGE, "If-Range") \
+  X(HEADER_RANGE, "Range") \
+  X(HEADER_EXPECT, "Expect") \
+  X(HEADER_UPGRADE, "Upgrade") \
+  X(HEADER_UPGRADE_INSECURE_REQUESTS, "Upgrade-Insecure-Requests") \
+  X(HEADER_TE, "TE") \
+  X(HEADER_X_FORWARDED_FOR, "X-Forwarded-For") \
+  X(HEADER_X_REAL_IP, "X-Real-IP") \
+  X(HEADER_DNT, "DNT")
+
+#define HTTP_HEADER_ENUM(id, name) id,
+enum HTTP_HEADER
+{
+  HTTP_HEADER_LIST(HTTP_HEADER_ENUM)
+  HEADER_NUMBER,                    // 识别的头部个数
+  HEADER_UNKNOWN = HEADER_NUMBER    // 不认识的头部
+};
+#undef HTTP_HEADER_ENUM
+
+static_assert(HEADER_NUMBER <= 32, "http_request::m_present has 32 bits");
+
+// 一个 http 请求的解析结果，各部分都是读缓冲区中的片段，不复制
+// 1. 片段保存为相对读缓冲区起始位置的偏移和长度（各 16 位），读缓冲区扩容换了地址时只需要更新 m_base
+// 2. 所有头部按出现的顺序保存，最多 MAX_HEADERS 个；识别的头部另外按 HTTP_HEADER 下标保存值，O(1) 取得
+// 3. 头部名称到 HTTP_HEADER 用完美哈希查找：哈希值只取长度、第二个字符和最后一个字符，
+//    在编译期算出每个识别的头部的哈希值作为 switch 的分支，有冲突时编译报 duplicate case value，
+//    换 header_hash 中的系数重新选择即可；命中分支后再比较一次名称
+class http_request
+{
+public:
+  static const int MAX_HEADERS = 32;          // 按顺序保存的头部数，超出的只保留识别的头部
+  static const int MAX_BUFFER = 65536;        // 片段的偏移和长度都是 16 位，读缓冲区不能超过 64KB
+
+  http_request() { clear(NULL); }
+
+  void clear(const char* base);               // 开始解析新的请求
+  void set_base(const char* base) { m_base = base; }   // 读缓冲区换了地址
+
+  // 以下由 http_conn 解析时填写，参数是读缓冲区中的指针
+  void set_method(const char* p, int len) { set(m_method, p, len); }
+  void set_path(const char* p, int len) { set(m_path, p, len); }
+  void set_query(const char* p, int len) { set(m_query, p, len); }
+  void set_version(const char* p, int len) { set(m_version, p, len); }
+  void set_body(const char* p, int len) { set(m_body, p, len); }
+  void add_header(const char* name, int name_len, const char* value, int value_len);
+
+  str_view method() const { return view(m_method); }
+  str_view path() const { return view(m_path); }          // 不含查询字符串
+  str_view query() const { return view(m_query); }        // '?' 之后的部分，没有时长度为 0
+  str_view version() const { return view(m_version); }
+  str_view body() const { return view(m_body); }          // 只有保存在读缓冲区中的小消息体
+  bool has_header(HTTP_HEADER h) const { return m_present & (1u << h); }
+  // 同名的头部有多个时取第一个，没有时 data 为 NULL
+  str_view header(HTTP_HEADER h) const { return has_header(h) ? view(m_known[h]) : str_view(); }
+  str_view header(const char* name) const;                // 按名称查找，包括不识别的头部
+
+  int header_count() const { return m_count; }
+  str_view header_name(int i) const { return view(m_names[i]); }
+  str_view header_value(int i) const { return view(m_values[i]); }
+
+  static HTTP_HEADER lookup(const char* name, int len);   // 头部名称对应的下标，不识别时返回 HEADER_UNKNOWN
+  static const char* name_of(HTTP_HEADER h);
+
+private:
+  struct span
+  {
+    uint16_t off;
+    uint16_t len;
+  };
+
+  void set(span& s, const char* p, int len)
+  {
+    s.off = p - m_base;
+    s.len = len;
+  }
+  str_view view(const span& s) const { return str_view(m_base + s.off, s.len); }
+
+private:
+  const char* m_base;                 // 读缓冲区
+  span m_method;
+  span m_path;
+  span m_query;
+  span m_version;
+  span m_body;
+  int m_count;                        // m_names 和 m_values 中的头部数
+  span m_names[MAX_HEADERS];
+  span m_values[MAX_HEADERS];
+  uint32_t m_present;                 // 出现了哪些识别的头部，第 HTTP_HEADER 位
+  span m_known[HEADER_NUMBER];        // 识别的头部的值
+};
+
+#endif //XLAOTINYWEBSERVER_HTTP_REQUEST_H
@@ -0,0 +1,302 @@
+//
+// Created by acg on 1/7/22.
+//
+
+#include "http_response.h"
+#include "../buffer/buffer_pool.h"
+
+// 00 到 99 的十进制表示，format_uint 每次取两位
+static const char digits2[] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+void http_response::init(char* buf, int size)
+{
+  m_buf = buf;
+  m_size = size;
+  m_idx = 0;
+  m_start = 0;
+  m_failed = false;
+}
+
+void http_response::release()
+{
+  for(int i=0; i<m_spill_count; ++i)
+    buffer_pool::get_instance()->free(m_spills[i], m_spill_sizes[i]);
+  m_spill_count = 0;
+  m_buf = NULL;
+  m_size = 0;
+  m_idx = 0;
+  m_start = 0;
+}
+
+void http_response::begin()
+{
+  m_start = m_idx;
+  m_failed = false;
+}
+
+bool http_response::end(char** base, int* len)
+{
+  if(m_failed)
+  {
+    // 丢弃写了一半的响应，之前的响应不受影响
+    m_idx = m_start;
+    return false;
+  }
+  *base = m_buf + m_start;
+  *len = m_idx - m_start;
+  return true;
+}
+
+// 申请一块能放下当前响应和 need 字节的溢出缓冲区，把当前响应已经写好的部分搬过去
+bool http_response::spill(int need)
+{
+  if(m_failed || !m_buf || m_spill_count == MAX_SPILL)
+  {
+    m_failed = true;
+    return false;
+  }
+  int used = m_idx - m_start;
+  int size = MIN_SPILL_SIZE;
+  while(size < used + need)
+    size <<= 1;
+  int real_size = 0;
+  char* buf = buffer_pool::get_instance()->alloc(size, &real_size);
+  if(!buf)
+  {
+    m_failed = true;
+    return false;
+  }
+  memcpy(buf, m_buf + m_start, used);
+  m_spills[m_spill_count] = buf;
+  m_spill_sizes[m_spill_count] = real_size;
+  ++m_spill_count;
+  m_buf = buf;
+  m_size = real_size;
+  m_start = 0;
+  m_idx = used;
+  return true;
+}
+
+const char* http_response::reason(int status)
+{
+  switch(status)
+  {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 416: return "Range Not Satisfiable";
+    case 500: return "Internal Error";
+    case 501: return "Not Implemented";
+    default: return "Unknown";
+  }
+}
+
+// 完整的状态行，每个状态码一个字面量
+void http_response::status_line(int status)
+{
+  switch(status)
+  {
+    case 200: append_literal("HTTP/1.1 200 OK\r\n"); break;
+    case 206: append_literal("HTTP/1.1 206 Partial Content\r\n"); break;
+    case 304: append_literal("HTTP/1.1 304 Not Modified\r\n"); break;
+    case 400: append_literal("HTTP/1.1 400 Bad Request\r\n"); break;
+    case 403: append_literal("HTTP/1.1 403 Forbidden\r\n"); break;
+    case 404: append_literal("HTTP/1.1 404 Not Found\r\n"); break;
+    case 416: append_literal("HTTP/1.1 416 Range Not Satisfiable\r\n"); break;
+    case 500: append_literal("HTTP/1.1 500 Internal Error\r\n"); break;
+    case 501: append_literal("HTTP/1.1 501 Not Implemented\r\n"); break;
+    default:
+    {
+      // 不常用的状态码拼出来
+      char code[20];
+      append_literal("HTTP/1.1 ");
+      append(code, format_uint(code, status));
+      append_literal(" ");
+      const char* title = reason(status);
+      append(title, strlen(title));
+      append_literal("\r\n");
+    }
+  }
+}
+
+void http_response::date()
+{
+  append_literal("Date: ");
+  append(date_value(), DATE_LEN);
+  append_literal("\r\n");
+}
+
+void http_response::date_tail()
+{
+  append(date_value(), DATE_LEN);
+  append_literal("\r\n\r\n");
+}
+
+void http_response::content_type(const char* type)
+{
+  append_literal("Content-Type: ");
+  append(type, strlen(type));
+  append_literal("\r\n");
+}
+
+void http_response::content_length(long length)
+{
+  char digits[20];
+  append_literal("Content-Length: ");
+  append(digits, format_uint(digits, length));
+  append_literal("\r\n");
+}
+
+void http_response::connection(bool keep_alive)
+{
+  if(keep_alive)
+    append_literal("Connection: keep-alive\r\n");
+  else
+    append_literal("Connection: close\r\n");
+}
+
+void http_response::last_modified(time_t t)
+{
+  char value[DATE_LEN];
+  format_date(value, t);
+  append_literal("Last-Modified: ");
+  append(value, DATE_LEN);
+  append_literal("\r\n");
+}
+
+void http_response::content_range(long from, long to, long size)
+{
+  char digits[20];
+  append_literal("Content-Range: bytes ");
+  append(digits, format_uint(digits, from));
+  append_literal("-");
+  append(digits, format_uint(digits, to));
+  append_literal("/");
+  append(digits, format_uint(digits, size));
+  append_literal("\r\n");
+}
+
+void http_response::content_range_unsatisfied(long size)
+{
+  char digits[20];
+  append_literal("Content-Range: bytes */");
+  append(digits, format_uint(digits, size));
+  append_literal("\r\n");
+}
+
+void http_response::boundary(const char* b, int len, bool last)
+{
+  append_literal("\r\n--");
+  append(b, len);
+  if(last)
+    append_literal("--\r\n");
+  else
+    append_literal("\r\n");
+}
+
+void http_response::header(const char* name, const char* value, int len)
+{
+  append(name, strlen(name));
+  append_literal(": ");
+  append(value, len);
+  append_literal("\r\n");
+}
+
+// 从低位向高位每次转换两位，再整体复制到 out
+int http_response::format_uint(char* out, unsigned long v)
+{
+  char buf[20];
+  char* p = buf + sizeof(buf);
+  while(v >= 100)
+  {
+    int i = (v % 100) * 2;
+    v /= 100;
+    p -= 2;
+    memcpy(p, digits2 + i, 2);
+  }
+  if(v >= 10)
+  {
+    p -= 2;
+    memcpy(p, digits2 + v * 2, 2);
+  }
+  else
+    *--p = '0' + v;
+  int len = buf + sizeof(buf) - p;
+  memcpy(out, p, len);
+  return len;
+}
+
+int http_response::format_hex(char* out, unsigned long v)
+{
+  static const char hex[] = "0123456789abcdef";
+  char buf[16];
+  char* p = buf + sizeof(buf);
+  do
+  {
+    *--p = hex[v & 15];
+    v >>= 4;
+  } while(v);
+  int len = buf + sizeof(buf) - p;
+  memcpy(out, p, len);
+  return len;
+}
+
+// 不用 strftime，星期和月份的缩写不受 locale 影响
+void http_response::format_date(char* out, time_t t)
+{
+  static const char* const weekdays[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+  static const char* const months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char* p = out;
+  memcpy(p, weekdays[tm.tm_wday], 3);
+  memcpy(p + 3, ", ", 2);
+  memcpy(p + 5, digits2 + tm.tm_mday * 2, 2);
+  p[7] = ' ';
+  memcpy(p + 8, months[tm.tm_mon], 3);
+  p[11] = ' ';
+  int year = tm.tm_year + 1900;
+  memcpy(p + 12, digits2 + (year / 100 % 100) * 2, 2);
+  memcpy(p + 14, digits2 + (year % 100) * 2, 2);
+  p[16] = ' ';
+  memcpy(p + 17, digits2 + tm.tm_hour * 2, 2);
+  p[19] = ':';
+  memcpy(p + 20, digits2 + tm.tm_min * 2, 2);
+  p[22] = ':';
+  memcpy(p + 23, digits2 + tm.tm_sec * 2, 2);
+  memcpy(p + 25, " GMT", 4);
+}
+
+// 每个线程缓存上一次格式化的秒和结果，同一秒内的响应直接复制
+struct date_cache
+{
+  time_t sec;
+  char value[http_response::DATE_LEN + 1];
+};
+
+static thread_local date_cache t_date = { (time_t) -1, "" };
+
+const char* http_response::date_value()
+{
+  time_t now = time(NULL);
+  if(now != t_date.sec)
+  {
+    format_date(t_date.value, now);
+    t_date.sec = now;
+  }
+  return t_date.value;
+}
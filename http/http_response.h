@@ -0,0 +1,81 @@
+//
+// Created by acg on 1/7/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_HTTP_RESPONSE_H
+#define XLAOTINYWEBSERVER_HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+// 响应头部的序列化，不使用 printf 一类的格式化
+// 1. 状态行和头部名称都是预先编码好的字面量，直接 memcpy
+// 2. 整数两位一组查表转换成十进制
+// 3. Date 的值每个线程每秒只格式化一次
+// 4. 一批流水线响应的头部依次写在同一块空间里：先用 http_conn 的写缓冲区（内联空间），
+//    写不下时从缓冲区池申请更大的溢出缓冲区，把当前响应已经写好的部分搬过去继续写；
+//    之前的响应已经被发送队列引用，留在原处，溢出缓冲区在这一批发送完后才归还
+// 每个响应的头部是一块连续的内存，和消息体一起作为发送队列中相邻的段，由一次 sendmsg 发出
+class http_response
+{
+public:
+  static const int MAX_SPILL = 4;                   // 一批最多使用的溢出缓冲区数
+  static const int MIN_SPILL_SIZE = 4096;
+  static const int DATE_LEN = 29;                   // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+  http_response(): m_buf(NULL), m_size(0), m_idx(0), m_start(0), m_failed(false), m_spill_count(0) {}
+  ~http_response() { release(); }
+
+  void init(char* buf, int size);                   // 一批的内联空间，release 之后重新设置
+  void release();                                   // 一批发送完毕，归还溢出缓冲区
+
+  void begin();                                     // 开始一个新响应
+  bool end(char** base, int* len);                  // 当前响应的头部写完，返回它的位置；空间不足时返回 false
+
+  // 以下写入当前响应，空间不足时记下失败，由 end 返回
+  void status_line(int status);                     // "HTTP/1.1 200 OK\r\n"
+  void date();                                      // "Date: ...\r\n"
+  // 预先序列化的头部把 Date 放在最后，以 "Date: " 结尾（date_name），每次发送时再补上当前的值和空行（date_tail）
+  void date_name() { append_literal("Date: "); }
+  void date_tail();
+  void content_type(const char* type);
+  void content_length(long length);
+  void connection(bool keep_alive);
+  void header(const char* name, const char* value, int len);   // name 不含 ": "
+  void last_modified(time_t t);
+  void content_range(long from, long to, long size);  // "Content-Range: bytes from-to/size\r\n"，to 包含在内
+  void content_range_unsatisfied(long size);          // "Content-Range: bytes */size\r\n"
+  void boundary(const char* b, int len, bool last);   // multipart 的分隔行 "\r\n--b\r\n"，最后一个是 "\r\n--b--\r\n"
+  void blank_line() { append("\r\n", 2); }
+
+  static const char* reason(int status);            // 状态码对应的原因短语
+  static int format_uint(char* out, unsigned long v);   // 十进制，返回长度，out 至少 20 字节
+  static int format_hex(char* out, unsigned long v);    // 小写十六进制，返回长度，out 至少 16 字节
+  static void format_date(char* out, time_t t);        // http 格式的时间，DATE_LEN 个字节
+  static const char* date_value();                  // 当前时间的 http 格式，DATE_LEN 个字节，不以 '\0' 结尾
+
+private:
+  void append(const char* s, int len)
+  {
+    if(m_idx + len > m_size && !spill(len))
+      return;
+    memcpy(m_buf + m_idx, s, len);
+    m_idx += len;
+  }
+  template <int N>
+  void append_literal(const char (&s)[N]) { append(s, N - 1); }
+  bool spill(int need);                             // 换到更大的溢出缓冲区
+
+private:
+  char* m_buf;                    // 当前写入的缓冲区：内联空间或者最后一个溢出缓冲区
+  int m_size;
+  int m_idx;
+  int m_start;                    // 当前响应在 m_buf 中的起始位置
+  bool m_failed;                  // 当前响应写不下
+  char* m_spills[MAX_SPILL];      // 这一批申请的溢出缓冲区
+  int m_spill_sizes[MAX_SPILL];
+  int m_spill_count;
+};
+
+#endif //XLAOTINYWEBSERVER_HTTP_RESPONSE_H
@@ -0,0 +1,113 @@
+//
+// Created by acg on 1/5/22.
+//
+
+#include "http_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+static const char* find_scalar(const char* p, const char* end, char a, char b)
+{
+  for(; p < end; ++p)
+  {
+    if(*p == a || *p == b)
+      return p;
+  }
+  return end;
+}
+
+#ifdef SCAN_X86
+// 向量实现用 target 属性单独编译，整个程序不需要 -mavx2，不支持的 cpu 上不会执行到这些指令
+
+__attribute__((target("sse4.2")))
+static const char* find_sse42(const char* p, const char* end, char a, char b)
+{
+  // 要查找的字符集合只有前两个字节有效
+  const __m128i set = _mm_setr_epi8(a, b, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  for(; end - p >= 16; p += 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i*) p);
+    int i = _mm_cmpestri(set, 2, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+    if(i < 16)
+      return p + i;
+  }
+  return find_scalar(p, end, a, b);
+}
+
+__attribute__((target("avx2")))
+static const char* find_avx2(const char* p, const char* end, char a, char b)
+{
+  const __m256i va = _mm256_set1_epi8(a);
+  const __m256i vb = _mm256_set1_epi8(b);
+  for(; end - p >= 32; p += 32)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i*) p);
+    __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(block, va), _mm256_cmpeq_epi8(block, vb));
+    unsigned int mask = _mm256_movemask_epi8(eq);
+    if(mask)
+      return p + __builtin_ctz(mask);
+  }
+  // 剩余不足 32 字节时再比较一个 16 字节的块，请求中的大多数行在这里就能找到行尾
+  if(end - p >= 16)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i*) p);
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(va)),
+                              _mm_cmpeq_epi8(block, _mm256_castsi256_si128(vb)));
+    unsigned int mask = _mm_movemask_epi8(eq);
+    if(mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+  return find_scalar(p, end, a, b);
+}
+#endif
+
+static const char* (*const find_funcs[])(const char*, const char*, char, char) = {
+  find_scalar,
+#ifdef SCAN_X86
+  find_sse42,
+  find_avx2
+#endif
+};
+
+// 静态初始化时选择实现，main 开始前就已确定，之后只读，多线程使用不需要同步
+http_scan::LEVEL http_scan::s_level = http_scan::detect();
+http_scan::find_func http_scan::s_find = find_funcs[http_scan::s_level];
+
+http_scan::LEVEL http_scan::detect()
+{
+#ifdef SCAN_X86
+  // 在其他静态初始化中调用 __builtin_cpu_supports 前需要先初始化 cpu 信息
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return AVX2;
+  if(__builtin_cpu_supports("sse4.2"))
+    return SSE42;
+#endif
+  return SCALAR;
+}
+
+bool http_scan::set_level(LEVEL level)
+{
+  if(level > detect())
+    return false;
+  s_level = level;
+  s_find = find_funcs[level];
+  return true;
+}
+
+const char* http_scan::level_name(LEVEL level)
+{
+  switch(level)
+  {
+    case AVX2:
+      return "avx2";
+    case SSE42:
+      return "sse4.2";
+    default:
+      return "scalar";
+  }
+}
@@ -0,0 +1,42 @@
+//
+// Created by acg on 1/5/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_HTTP_SCAN_H
+#define XLAOTINYWEBSERVER_HTTP_SCAN_H
+
+#include <stddef.h>
+
+// 解析 http 请求时的字符查找：在 [begin, end) 中找第一个等于 a 或 b 的字符，没有时返回 end
+// 例如行尾 '\r' '\n'，请求行中分隔的空格和 '\t'，头部的 ':'
+// 有三种实现，第一次使用前按 cpu 支持的指令集选择最快的一种：
+// 1. AVX2：一次比较 32 字节，两次比较的结果合并成位掩码，取最低位的 1
+// 2. SSE4.2：一次比较 16 字节，pcmpestri 一条指令给出第一个匹配的位置
+// 3. 逐字节比较，不是 x86 或者 cpu 不支持时使用；向量实现末尾不足一个块的部分也用它
+// 只读 [begin, end) 之内的字节，不会越过缓冲区的末尾
+class http_scan
+{
+public:
+  enum LEVEL
+  {
+    SCALAR = 0,
+    SSE42,
+    AVX2
+  };
+
+  static const char* find(const char* begin, const char* end, char a, char b) { return s_find(begin, end, a, b); }
+  static char* find(char* begin, char* end, char a, char b) { return (char*) s_find(begin, end, a, b); }
+
+  static LEVEL detect();                  // cpu 支持的最快实现
+  static bool set_level(LEVEL level);     // 指定使用的实现（对比测试用），cpu 不支持时返回 false
+  static LEVEL get_level() { return s_level; }
+  static const char* level_name(LEVEL level);
+
+private:
+  typedef const char* (*find_func)(const char*, const char*, char, char);
+
+  static find_func s_find;
+  static LEVEL s_level;
+};
+
+#endif //XLAOTINYWEBSERVER_HTTP_SCAN_H
@@ -8,6 +8,12 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
 
 // 多线程下线程同步包装类
 
@@ -46,6 +52,12 @@ public:
     return sem_wait(&m_sem) == 0;
   }
 
+  // 不阻塞的等待，sem_value = 0 时直接返回 false
+  bool trywait()
+  {
+    return sem_trywait(&m_sem) == 0;
+  }
+
   // 增加信号量
   bool post()
   {
@@ -91,6 +103,41 @@ private:
   pthread_mutex_t m_mutex;
 };
 
+// 封装读写锁的类
+// 读多写少的共享数据使用：多个读者可以同时持有读锁，写者独占
+class rwlocker
+{
+public:
+  rwlocker()
+  {
+    if(pthread_rwlock_init(&m_rwlock, NULL) != 0)
+      throw std::exception();
+  }
+
+  ~rwlocker()
+  {
+    pthread_rwlock_destroy(&m_rwlock);
+  }
+
+  bool rdlock()
+  {
+    return pthread_rwlock_rdlock(&m_rwlock) == 0;
+  }
+
+  bool wrlock()
+  {
+    return pthread_rwlock_wrlock(&m_rwlock) == 0;
+  }
+
+  bool unlock()
+  {
+    return pthread_rwlock_unlock(&m_rwlock) == 0;
+  }
+
+private:
+  pthread_rwlock_t m_rwlock;
+};
+
 // 封装条件变量的类
 // 条件变量需要配合互斥锁一起使用，而互斥锁通过参数传递使用
 class cond {
@@ -133,4 +180,67 @@ private:
   pthread_cond_t m_cond;
 };
 
+// 封装 futex 的等待/唤醒，用于无锁队列的消费者休眠
+// 只有真正有线程在休眠时，唤醒方才会进入内核，队列忙时 notify 只是一次原子读
+// 使用方法（消费者）：
+//   队列为空 -> key = prepare_wait() -> 再检查一次队列 -> 仍为空则 wait(key)，否则 cancel_wait()
+// 生产者放入数据后调用 notify()
+class futex_event
+{
+public:
+  futex_event(): m_seq(0), m_waiters(0) {}
+
+  // 登记为等待者，返回等待前的序号
+  // 登记之后再检查条件，保证和 notify 之间不会丢失唤醒
+  unsigned int prepare_wait()
+  {
+    m_waiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return m_seq.load();
+  }
+
+  void cancel_wait()
+  {
+    m_waiters.fetch_sub(1);
+  }
+
+  // 序号没有变化时休眠，notify 改变了序号则立即返回
+  // timeout_ms 大于等于 0 时最多休眠这么多毫秒
+  void wait(unsigned int key, int timeout_ms = -1)
+  {
+    struct timespec ts;
+    struct timespec* timeout = NULL;
+    if(timeout_ms >= 0)
+    {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      timeout = &ts;
+    }
+    syscall(SYS_futex, (int*) &m_seq, FUTEX_WAIT_PRIVATE, key, timeout, NULL, 0);
+    m_waiters.fetch_sub(1);
+  }
+
+  // 有等待者时才唤醒，count 为最多唤醒的线程数
+  void notify(int count = 1)
+  {
+    // 与 prepare_wait 中的屏障配对：要么等待者看到新数据，要么这里看到等待者
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_waiters.load() == 0)
+      return;
+    m_seq.fetch_add(1);
+    syscall(SYS_futex, (int*) &m_seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+  }
+
+  void notify_all()
+  {
+    notify(INT_MAX);
+  }
+
+  int waiters() { return m_waiters.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<unsigned int> m_seq;      // futex 字，每次唤醒 +1
+  std::atomic<int> m_waiters;           // 正在等待（或准备等待）的线程数
+};
+
 #endif //LOCKER_H
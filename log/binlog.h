@@ -0,0 +1,104 @@
+//
+// Created by acg on 1/2/22.
+//
+
+#ifndef XLAOTINYWEBSERVER_BINLOG_H
+#define XLAOTINYWEBSERVER_BINLOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// 二进制日志的记录格式，log.cpp 写入、log_decode.cpp 读出
+// 文件由若干记录组成，每条记录第一个字节是类型，多字节整数都是本机字节序
+// 1. FILE  ：文件头，每个日志文件开头一条，8 字节魔数
+// 2. SITE  ：调用点，id(4) + 级别(1) + 格式串长度(2) + 格式串，同一个 id 在事件之前写出
+// 3. SYNC  ：时钟同步，tsc(8) + 墙上时间的纳秒数(8) + 每纳秒的 tsc 滴答数(double 8)
+// 4. EVENT ：一条日志，id(4) + tsc(8) + 参数长度(2) + 参数
+//    每个参数是 1 字节类型 + 原始值：'i' int32，'q' int64，'d' double，'p' 指针，'s' 长度(2) + 字节
+// 格式化推迟到 log_decode 中进行，写日志的线程只复制参数
+#define BINLOG_MAGIC "XLBLOG01"
+#define BINLOG_MAGIC_LEN 8
+
+enum binlog_record_type
+{
+  BINLOG_FILE = 'F',
+  BINLOG_SITE = 'S',
+  BINLOG_SYNC = 'T',
+  BINLOG_EVENT = 'E'
+};
+
+static const int BINLOG_EVENT_HEADER = 1 + 4 + 8 + 2;
+static const int BINLOG_RECORD_MAX = 1024;      // 一条 EVENT 的最大长度，超出的字符串被截断
+
+// 读时间戳计数器，x86 上是 rdtsc，其他平台退化为单调时钟的纳秒数
+static inline uint64_t binlog_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// 参数编码，p 为写入位置，end 为缓冲区末尾，空间不够时丢弃这个参数
+static inline void binlog_put(char*& p, char* end, char type, const void* v, int size)
+{
+  if(end - p < 1 + size)
+  {
+    p = end;
+    return;
+  }
+  *p++ = type;
+  memcpy(p, v, size);
+  p += size;
+}
+
+static inline void binlog_encode_arg(char*& p, char* end, int v) { binlog_put(p, end, 'i', &v, 4); }
+static inline void binlog_encode_arg(char*& p, char* end, unsigned int v) { binlog_put(p, end, 'i', &v, 4); }
+static inline void binlog_encode_arg(char*& p, char* end, long v) { int64_t x = v; binlog_put(p, end, 'q', &x, 8); }
+static inline void binlog_encode_arg(char*& p, char* end, unsigned long v) { uint64_t x = v; binlog_put(p, end, 'q', &x, 8); }
+static inline void binlog_encode_arg(char*& p, char* end, long long v) { int64_t x = v; binlog_put(p, end, 'q', &x, 8); }
+static inline void binlog_encode_arg(char*& p, char* end, unsigned long long v) { uint64_t x = v; binlog_put(p, end, 'q', &x, 8); }
+static inline void binlog_encode_arg(char*& p, char* end, double v) { binlog_put(p, end, 'd', &v, 8); }
+
+static inline void binlog_encode_arg(char*& p, char* end, const char* s)
+{
+  if(!s)
+    s = "(null)";
+  if(end - p < 3)
+  {
+    p = end;
+    return;
+  }
+  size_t len = strlen(s);
+  if(len > (size_t) (end - p - 3))
+    len = end - p - 3;
+  uint16_t n = len;
+  *p++ = 's';
+  memcpy(p, &n, 2);
+  memcpy(p + 2, s, len);
+  p += 2 + len;
+}
+
+static inline void binlog_encode_arg(char*& p, char* end, char* s) { binlog_encode_arg(p, end, (const char*) s); }
+
+template <typename T>
+static inline void binlog_encode_arg(char*& p, char* end, T* ptr)
+{
+  uint64_t x = (uint64_t) (uintptr_t) ptr;
+  binlog_put(p, end, 'p', &x, 8);
+}
+
+static inline void binlog_encode(char*&, char*) {}
+
+template <typename T, typename... Args>
+static inline void binlog_encode(char*& p, char* end, const T& first, const Args&... rest)
+{
+  binlog_encode_arg(p, end, first);
+  binlog_encode(p, end, rest...);
+}
+
+#endif //XLAOTINYWEBSERVER_BINLOG_H
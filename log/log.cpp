@@ -3,7 +3,9 @@
 //
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <pthread.h>
 
@@ -11,39 +13,89 @@
 
 using namespace std;
 
+// 每个线程自己的格式化缓冲区、缓存的时间戳和异步模式的环形缓冲区
+struct log_thread_state
+{
+  char* buf;
+  int buf_size;
+  time_t sec;           // stamp 对应的秒
+  struct tm tm;         // sec 对应的当地时间
+  char stamp[32];       // "2021-12-31 12:00:00."，同一秒内的日志直接复制
+  int stamp_len;
+  log_ring* ring;
+
+  log_thread_state(): buf(NULL), buf_size(0), sec(-1), stamp_len(0), ring(NULL) {}
+
+  ~log_thread_state()
+  {
+    delete[] buf;
+    // 线程退出，缓冲区留给之后的线程，里面还没写出的日志由后台线程照常写出
+    if(ring)
+      ring->in_use.store(false, std::memory_order_release);
+  }
+};
+
+static thread_local log_thread_state t_log;
+
+std::atomic<int> Log::m_level(LOG_LEVEL_DEBUG);
+bool Log::m_binary = false;
+
+static int64_t realtime_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char* const level_str[] = {"[debug]:", "[info]:", "[warn]:", "[error]:"};
+
 Log::Log()
 {
   m_count = 0;
+  m_today = 0;
+  m_fp = NULL;
   m_is_async = false;
+  m_ring_size = 0;
+  m_overflow = OVERFLOW_DROP;
+  m_rings.store(NULL);
+  m_dropped.store(0);
+  m_stop.store(false);
+  m_site_count.store(0);
+  for(int i=0; i<MAX_SITES; ++i)
+  {
+    m_sites[i].format.store(NULL);
+    m_sites[i].written = false;
+  }
+  m_need_header = true;
+  m_tsc0 = 0;
+  m_real0 = 0;
+  m_ticks_per_ns = 1;
+  m_last_sync = 0;
 }
 
 Log::~Log()
 {
+  // 通知后台线程写出剩下的日志后退出
+  if(m_is_async)
+  {
+    m_stop.store(true, std::memory_order_release);
+    m_data_event.notify();
+    pthread_join(m_tid, NULL);
+  }
   if(m_fp != NULL)
     fclose(m_fp);
 }
 
 // 异步写需要设置队列
-bool Log::init(const char *file_name, int log_buf_size, unsigned int max_lines, int max_queue_size)
+bool Log::init(const char *file_name, int log_buf_size, unsigned int max_lines, int max_queue_size, int overflow,
+               bool binary)
 {
-  // 使用队列则说明使用异步
-  if(max_queue_size >= 1)
-  {
-    m_is_async = true;
-    m_log_queue = new block_queue<string>(max_queue_size);    // 创建一个阻塞队列
-    pthread_t tid;      // 线程 ID
-    // 创建线程异步写日志，第三个参数是回调函数
-    pthread_create(&tid, NULL, flush_log_thread, NULL);
-  }
-
   m_log_buf_size = log_buf_size;
-  m_buf = new char[m_log_buf_size];
-  memset(m_buf, '\0', m_log_buf_size);
   m_log_max_lines = max_lines;
 
   time_t t = time(NULL);              // 获取 time_t 类型的当前时间
-  struct tm *sys_tm = localtime(&t);        // 转换成当地时间
-  struct tm my_tm = *sys_tm;
+  struct tm my_tm;
+  localtime_r(&t, &my_tm);            // 转换成当地时间
 
   // strrchr: 在 file_name 文件中搜索 '/' 最后一次出现的位置
   // 所以打印 p 就会显示文件名
@@ -52,16 +104,20 @@ bool Log::init(const char *file_name, int log_buf_size, unsigned int max_lines,
 
   if(p == NULL) // 如果只是一个文件名: "myFile"
   {
+    // 切换文件时也要用到目录名和文件名
+    dir_name[0] = '\0';
+    snprintf(log_name, sizeof(log_name), "%s", file_name);
     // snprintf(char* str, size_t size, const char* format, ...)
     // 将可变参数 ... 按照 format 格式化成字符串，然后复制到 str 中，大小为 size
     // log_full_name:"2021_01_01_myFile"， %02d 表示如果数字不足2位，则左边补0
-    snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_yday + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
+    snprintf(log_full_name, 255, "%d_%02d_%02d_%s", my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, file_name);
   }
   else  // 如果包含路径:"D://myDir//myFile"
   {
     // 因为文件命名要包含当前时间，所以需要分别获取路径名和文件名
     strcpy(log_name, p + 1);                           // p = /myFile，则 p + 1 = myFile
     strncpy(dir_name, file_name, p - file_name + 1);    // 获取 p 前面的路径名
+    dir_name[p - file_name + 1] = '\0';
     // log_full_name: "D://myDir//2021_01_01_myFile"
     snprintf(log_full_name, 255, "%s%d_%02d_%02d_%s", dir_name, my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday, log_name);
   }
@@ -73,107 +129,369 @@ bool Log::init(const char *file_name, int log_buf_size, unsigned int max_lines,
   {
     return false;
   }
+
+  // 二进制日志由后台线程写出，总是异步；先粗略估计 tsc 的频率，之后由后台线程按更长的间隔修正
+  if(binary)
+  {
+    m_binary = true;
+    if(max_queue_size < 1)
+      max_queue_size = 32;
+    m_tsc0 = binlog_tsc();
+    m_real0 = realtime_ns();
+    usleep(10000);
+    m_ticks_per_ns = (double) (binlog_tsc() - m_tsc0) / (realtime_ns() - m_real0);
+  }
+
+  // 使用队列则说明使用异步
+  if(max_queue_size >= 1)
+  {
+    m_is_async = true;
+    m_overflow = overflow;
+    m_ring_size = (size_t) max_queue_size * log_buf_size;
+    // 创建线程异步写日志，第三个参数是回调函数
+    pthread_create(&m_tid, NULL, flush_log_thread, NULL);
+  }
   return true;
 }
 
 // 写日志，主要逻辑函数
 void Log::write_log(int level, const char *format, ...)
 {
+  log_thread_state& st = t_log;
+  if(st.buf_size < m_log_buf_size)
+  {
+    delete[] st.buf;
+    st.buf = new char[m_log_buf_size];
+    st.buf_size = m_log_buf_size;
+  }
+
   struct timeval now = {0, 0};  // 秒、微秒
   gettimeofday(&now, NULL);   // 目前的时间放入 now 中
-  time_t time = now.tv_sec;
-  struct tm *sys_time = localtime(&time);
-  struct tm my_time = *sys_time;
-  char s[16] = {0};
-
-  switch (level) {  // level 即日志的类型，在头文件中已经宏定义了
-    case 0:
-      strcpy(s, "[debug]:");
-      break;
-    case 1:
-      strcpy(s, "[info]:");
-      break;
-    case 2:
-      strcpy(s, "[warn]:");
-      break;
-    case 3:
-      strcpy(s, "[error]:");
-      break;
-    default:
-      strcpy(s, "[info]:");
-      break;
+  // 进入新的一秒才重新调用 localtime 格式化日期和时间
+  if(now.tv_sec != st.sec)
+  {
+    time_t t = now.tv_sec;
+    localtime_r(&t, &st.tm);
+    st.stamp_len = snprintf(st.stamp, sizeof(st.stamp), "%d-%02d-%02d %02d:%02d:%02d.",
+                            st.tm.tm_year + 1900, st.tm.tm_mon + 1, st.tm.tm_mday,
+                            st.tm.tm_hour, st.tm.tm_min, st.tm.tm_sec);
+    st.sec = now.tv_sec;
+  }
+
+  // level 即日志的类型，在头文件中已经宏定义了
+  const char* s = (level >= 0 && level <= 3) ? level_str[level] : level_str[1];
+
+  // 写入的具体时间内容格式："2021-12-31 12:00:00.000123 [info]:"
+  char* buf = st.buf;
+  int n = st.stamp_len;
+  memcpy(buf, st.stamp, n);
+  long usec = now.tv_usec;
+  for(int i=5; i>=0; --i)
+  {
+    buf[n + i] = '0' + usec % 10;
+    usec /= 10;
+  }
+  n += 6;
+  buf[n++] = ' ';
+  int slen = strlen(s);
+  memcpy(buf + n, s, slen);
+  n += slen;
+
+  va_list vaList;             // 可变参数变量，指向参数的指针
+  va_start(vaList, format);   // vaList 指向可变列表的地址，即 format
+
+  // 将可变参数 vaList 按照 format 的格式保存到 buf + n 的位置，末尾留出 '\n' 和 '\0' 的位置
+  // 返回完整内容需要的字符个数，失败返回负值；超过缓冲区时按截断后的长度处理
+  int m = vsnprintf(buf + n, m_log_buf_size - n - 1, format, vaList);
+  va_end(vaList);     // 关闭可变参数的获取
+  if(m < 0)
+    m = 0;
+  else if(m > m_log_buf_size - n - 2)
+    m = m_log_buf_size - n - 2;
+  buf[n + m] = '\n';
+  int len = n + m + 1;
+
+  // 异步写入：放入本线程的缓冲区，由后台线程写入文件
+  if(m_is_async)
+  {
+    push_async(buf, len);
+    return;
   }
 
-  // 写入 log，同时更新 m_count
-  // 文件的打开是代码关键区
+  // 同步写入，加锁后直接写入 m_fp 文件
+  m_mutex.lock();
+  rotate(st.tm, 1);
+  if(m_fp)
+    fwrite(buf, 1, len, m_fp);
+  m_mutex.unlock();
+}
+
+void Log::flush(void)
+{
+  if(m_is_async)
+    return;
   m_mutex.lock();
-  ++m_count;
+  if(m_fp)
+    fflush(m_fp);
+  m_mutex.unlock();
+}
+
+// 同步模式下调用者持有 m_mutex，异步模式下只有后台线程调用
+void Log::rotate(const struct tm& tm, unsigned int lines)
+{
+  unsigned int part = m_count / m_log_max_lines;
+  m_count += lines;
 
   // 如果没有今天的日志 || 写入当前行数超出最大行数:
-  // 需要新建一个文件夹同时打开它
-  if(m_today != my_time.tm_mday || m_count % m_log_max_lines == 0)
+  // 需要新建一个文件同时打开它
+  if(m_today == tm.tm_mday && m_count / m_log_max_lines == part)
+    return;
+
+  char new_log[256] = {0};
+  char tail[16] = {0};      // tail 记录完整日期
+  snprintf(tail, 16, "%d_%02d_%02d_", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+  if(m_today != tm.tm_mday)  // 如果 m_today 过期（今天是新的一天而且还没有日志）
+  {
+    snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
+    m_today = tm.tm_mday;    // 更新 m_today
+    m_count = lines;         // 新的日志
+  }
+  else
+  {
+    // 日志文件太大，新建一个新的
+    snprintf(new_log, 255, "%s%s%s.%u", dir_name, tail, log_name, m_count / m_log_max_lines);
+  }
+
+  if(m_fp)
   {
-    char new_log[256] = {0};
     fflush(m_fp);   // 将缓冲区写入文件然后关闭文件
     fclose(m_fp);
-    char tail[16] = {0};      // tail 记录完整日期
+  }
+  m_fp = fopen(new_log, "a");
+  m_need_header = true;
+}
+
+int Log::register_site(int level, const char* format)
+{
+  Log* log = get_instance();
+  int id = log->m_site_count.fetch_add(1, std::memory_order_relaxed);
+  if(id >= MAX_SITES)
+    return -1;
+  log->m_sites[id].level = level;
+  log->m_sites[id].format.store(format, std::memory_order_release);
+  return id;
+}
+
+void Log::binary_prefix(string& out)
+{
+  // 新文件：文件头，之前登记的调用点要在这个文件中重新写一遍
+  if(m_need_header)
+  {
+    out.append(1, (char) BINLOG_FILE);
+    out.append(BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+    for(int i=0; i<MAX_SITES; ++i)
+      m_sites[i].written = false;
+    m_last_sync = 0;
+  }
+
+  // 本批日志用到的调用点在写日志之前已经登记，这里一定能看到
+  // 其他线程正在登记的调用点可能还没填好，跳过，下一批再写
+  int count = m_site_count.load(std::memory_order_relaxed);
+  if(count > MAX_SITES)
+    count = MAX_SITES;
+  for(int i=0; i<count; ++i)
+  {
+    log_site& site = m_sites[i];
+    const char* format = site.format.load(std::memory_order_acquire);
+    if(site.written || !format)
+      continue;
+    uint32_t id = i;
+    size_t flen = strlen(format);
+    uint16_t len = flen > 65535 ? 65535 : flen;
+    out.append(1, (char) BINLOG_SITE);
+    out.append((const char*) &id, 4);
+    out.append(1, (char) site.level);
+    out.append((const char*) &len, 2);
+    out.append(format, len);
+    site.written = true;
+  }
+
+  // 每秒一条时钟同步，间隔越长 tsc 频率估计得越准
+  int64_t real = realtime_ns();
+  if(m_need_header || real - m_last_sync >= 1000000000LL)
+  {
+    uint64_t tsc = binlog_tsc();
+    if(real - m_real0 >= 1000000000LL)
+      m_ticks_per_ns = (double) (tsc - m_tsc0) / (real - m_real0);
+    out.append(1, (char) BINLOG_SYNC);
+    out.append((const char*) &tsc, 8);
+    out.append((const char*) &real, 8);
+    out.append((const char*) &m_ticks_per_ns, 8);
+    m_last_sync = real;
+  }
+  m_need_header = false;
+}
+
+log_ring* Log::acquire_ring()
+{
+  // 先复用已退出线程留下的缓冲区
+  for(log_ring* r = m_rings.load(std::memory_order_acquire); r; r = r->next)
+  {
+    bool expected = false;
+    if(!r->in_use.load(std::memory_order_relaxed) &&
+       r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+      return r;
+  }
+
+  log_ring* r = new log_ring(m_ring_size);
+  r->next = m_rings.load(std::memory_order_relaxed);
+  while(!m_rings.compare_exchange_weak(r->next, r, std::memory_order_release, std::memory_order_relaxed))
+    ;
+  return r;
+}
 
-    snprintf(tail, 16, "%d_%02d_%02d_", my_time.tm_year + 1900, my_time.tm_mon + 1, my_time.tm_mday);
+void Log::push_async(const char* line, int len)
+{
+  log_thread_state& st = t_log;
+  if(!st.ring)
+    st.ring = acquire_ring();
+  log_ring* ring = st.ring;
 
-    if(m_today != my_time.tm_mday)  // 如果 m_today 过期（今天是新的一天而且还没有日志）
+  while(!ring->push(line, len))
+  {
+    m_data_event.notify();
+    // 后台线程已经退出时也只能丢弃
+    if(m_overflow == OVERFLOW_DROP || m_stop.load(std::memory_order_relaxed))
     {
-      snprintf(new_log, 255, "%s%s%s", dir_name, tail, log_name);
-      m_today = my_time.tm_mday;    // 更新 m_today
-      m_count = 0;                  // 新的日志
+      m_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
     }
-    else
+    unsigned int key = m_space_event.prepare_wait();
+    if(ring->push(line, len))
     {
-      // 日志文件太大，新建一个新的
-      snprintf(new_log, 255, "%s%s%s.%lld", dir_name, tail, log_name, m_count / m_log_max_lines);
+      m_space_event.cancel_wait();
+      return;
     }
-    m_fp = fopen(new_log, "a");
+    m_space_event.wait(key, FLUSH_INTERVAL_MS);
   }
 
-  m_mutex.unlock();
-
-  va_list vaList;             // 可变参数变量，指向参数的指针
-  va_start(vaList, format);   // vaList 指向可变列表的地址，即 format
-
-  string log_str;   // 最终写入文件的内容
-  m_mutex.lock();
+  // 缓冲区过半才唤醒后台线程，否则等它定时醒来，避免每条日志一次系统调用
+  if(ring->head.load(std::memory_order_relaxed) - ring->tail.load(std::memory_order_relaxed) > ring->capacity() / 2)
+    m_data_event.notify();
+}
 
-  // 写入的具体时间内容格式
-  int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s",
-                   my_time.tm_year + 1900, my_time.tm_mon + 1, my_time.tm_mday,
-                   my_time.tm_hour, my_time.tm_min, my_time.tm_sec, now.tv_usec, s);
+size_t Log::drain()
+{
+  // iov[0] 留给二进制模式的前缀
+  struct iovec iov[MAX_IOV];
+  log_ring* rings[MAX_IOV];
+  size_t heads[MAX_IOV];
+  int niov = 1, nring = 0;
+  unsigned int lines = 0;
+  size_t total = 0;
 
-  // 将可变参数 vaList 按照 format 的格式保存到 m_buf + n 的位置，大小为 m_log_buf_size - 1
-  // 返回写入字符的个数，失败返回负值
-  int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, vaList);
+  time_t t = time(NULL);
+  struct tm tm;
+  localtime_r(&t, &tm);
 
-  m_buf[n + m] = '\n';
-  m_buf[n + m + 1] = '\0';
-  log_str = m_buf;
+  log_ring* r = m_rings.load(std::memory_order_acquire);
+  while(r || nring > 0)
+  {
+    if(r && niov + 2 <= MAX_IOV)
+    {
+      size_t head = r->head.load(std::memory_order_acquire);
+      size_t tail = r->tail.load(std::memory_order_relaxed);
+      char* base[2];
+      size_t len[2];
+      int n = r->segments(tail, head, base, len);
+      for(int i=0; i<n; ++i)
+      {
+        iov[niov].iov_base = base[i];
+        iov[niov].iov_len = len[i];
+        ++niov;
+      }
+      if(n > 0)
+      {
+        size_t records = r->records.load(std::memory_order_relaxed);
+        lines += records - r->drained_records;
+        r->drained_records = records;
+        rings[nring] = r;
+        heads[nring] = head;
+        ++nring;
+        total += head - tail;
+      }
+      r = r->next;
+      continue;
+    }
 
-  m_mutex.unlock();
+    // 攒满一批或者所有缓冲区都看过了：切换文件后一次写入，再把空间还给各个线程
+    rotate(tm, lines);
+    m_prefix.clear();
+    if(m_binary)
+      binary_prefix(m_prefix);
+    iov[0].iov_base = (void*) m_prefix.data();
+    iov[0].iov_len = m_prefix.size();
+    write_all(iov, niov);
+    for(int i=0; i<nring; ++i)
+      rings[i]->tail.store(heads[i], std::memory_order_release);
+    niov = 1;
+    nring = 0;
+    lines = 0;
+  }
 
-  // 异步写入，不用加锁，调用方法中有
-  if(m_is_async && !m_log_queue->full())
-    m_log_queue->push(log_str);
+  if(total > 0)
+    m_space_event.notify_all();
+  return total;
+}
 
-  else  // 同步写入，直接调用 fputs 写入 m_fp 文件
+bool Log::write_all(struct iovec* iov, int count)
+{
+  if(!m_fp)
+    return false;
+  int fd = fileno(m_fp);
+  while(count > 0)
   {
-    m_mutex.lock();
-    fputs(log_str.c_str(), m_fp);
-    m_mutex.unlock();
+    ssize_t n = writev(fd, iov, count);
+    if(n < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    // 跳过已经写完的段，调整写了一部分的段
+    while(count > 0 && (size_t) n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if(count > 0)
+    {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
   }
-
-  va_end(vaList);     // 关闭可变参数的获取
+  return true;
 }
 
-void Log::flush(void)
+void Log::async_write_log()
 {
-  m_mutex.lock();
-  fflush(m_fp);
-  m_mutex.unlock();
+  while(true)
+  {
+    bool stop = m_stop.load(std::memory_order_acquire);
+    if(drain() > 0)
+      continue;
+    if(stop)
+      break;
+
+    // 登记为等待者之后再看一次，过半唤醒不会丢失；其余的日志最多等 FLUSH_INTERVAL_MS 写出
+    unsigned int key = m_data_event.prepare_wait();
+    if(drain() > 0)
+    {
+      m_data_event.cancel_wait();
+      continue;
+    }
+    m_data_event.wait(key, FLUSH_INTERVAL_MS);
+  }
 }
@@ -9,13 +9,76 @@
 #include <string>
 #include <stdarg.h>
 #include <pthread.h>
-#include "block_queue.h"
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include "../locker/locker.h"
+#include "log_ring.h"
+#include "binlog.h"
 
 using namespace std;
 
+// 日志级别
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// 编译期的最低级别，低于它的日志调用连同参数的计算都被编译器去掉，例如 g++ -DLOG_MIN_LEVEL=2
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// 每个调用点一个的限流器：interval_ms 毫秒内只放行一次，其余的只计数
+class log_limiter
+{
+public:
+  log_limiter(): m_next(0), m_suppressed(0) {}
+
+  // 放行时通过 suppressed 返回上次放行以来被压下的次数
+  bool allow(int interval_ms, long* suppressed)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long long now = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    long long next = m_next.load(std::memory_order_relaxed);
+    // 多个线程同时到期时只有抢到的那个放行
+    if(now < next || !m_next.compare_exchange_strong(next, now + interval_ms, std::memory_order_relaxed))
+    {
+      m_suppressed.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+private:
+  std::atomic<long long> m_next;        // 下次放行的时刻
+  std::atomic<long> m_suppressed;
+};
+
+// 异步模式：
+// 1. 每个写日志的线程有自己的环形缓冲区（log_ring），格式化后直接写入，不加锁、不分配内存
+// 2. 时间戳的年月日时分秒部分每个线程每秒只格式化一次
+// 3. 后台线程定时（或者缓冲区过半时被唤醒）把所有缓冲区中的日志用一次 writev 写入文件，
+//    按天和按行数切换文件也在后台线程中完成
+// 4. 缓冲区满时按 overflow 策略阻塞等待后台线程写出，或者丢弃并计数
+// 同步模式：格式化后加锁直接写入文件
+// 二进制模式（异步）：不格式化，只把调用点 id、tsc 和原始参数放入缓冲区，由 log_decode 还原成文本
 class Log
 {
 public:
+  // 异步模式缓冲区满时的处理方式
+  enum overflow_policy
+  {
+    OVERFLOW_BLOCK,     // 等待后台线程写出
+    OVERFLOW_DROP       // 丢弃这条日志，计入 dropped()
+  };
+
+  static const int FLUSH_INTERVAL_MS = 50;    // 后台线程空闲时的最长休眠时间，也是日志写入文件的最大延迟
+  static const int MAX_IOV = 64;              // 一次 writev 的最大段数
+  static const int MAX_SITES = 4096;          // 二进制模式最多的调用点个数
+
   // 懒汉单例模式:
   // 第一次需要的时候才会生成单例对象
   // c++11中是线程安全的：
@@ -30,15 +93,61 @@ public:
   static void* flush_log_thread(void* args)
   {
     Log::get_instance()->async_write_log();
+    return NULL;
   }
 
-  // 日志的初始化，包括文件名、缓冲区大小、最大行数、最长日志队列
-  bool init(const char* file_name, int log_buf_size = 8192, unsigned int max_lines = 5000000, int max_queue_size = 0);
+  // 日志的初始化，包括文件名、一条日志的最大长度、最大行数、最长日志队列
+  // max_queue_size 大于 0 时为异步模式，每个线程的缓冲区能放下 max_queue_size 条最长的日志
+  // binary 为 true 时写二进制日志，总是异步
+  bool init(const char* file_name, int log_buf_size = 8192, unsigned int max_lines = 5000000, int max_queue_size = 0,
+            int overflow = OVERFLOW_DROP, bool binary = false);
 
   void write_log(int level, const char* format, ...);
 
+  // 同步模式下把 stdio 缓冲区写入文件；异步模式由后台线程写入，这里什么也不做
   void flush(void);
 
+  long dropped() { return m_dropped.load(std::memory_order_relaxed); }   // 异步模式因缓冲区满丢弃的日志条数
+
+  // 运行时的最低级别，低于它的日志在计算参数之前就返回
+  static void set_level(int level)
+  {
+    if(level < LOG_LEVEL_DEBUG)
+      level = LOG_LEVEL_DEBUG;
+    if(level > LOG_LEVEL_ERROR)
+      level = LOG_LEVEL_ERROR;
+    m_level.store(level, std::memory_order_relaxed);
+  }
+  static int get_level() { return m_level.load(std::memory_order_relaxed); }
+
+  // 日志宏只读这一个原子变量，不经过 get_instance()
+  static std::atomic<int> m_level;
+
+  // 二进制模式，在 init 中设置，之后不再改变
+  static bool m_binary;
+
+  // 调用点第一次执行时登记级别和格式串（字符串常量），返回调用点 id，登记满时返回 -1
+  static int register_site(int level, const char* format);
+
+  // 二进制模式写日志：编码参数后放入本线程的缓冲区
+  template <typename... Args>
+  void write_binary(int site, const Args&... args)
+  {
+    if(site < 0)
+      return;
+    char buf[BINLOG_RECORD_MAX];
+    uint64_t tsc = binlog_tsc();
+    char* p = buf + BINLOG_EVENT_HEADER;
+    binlog_encode(p, buf + sizeof(buf), args...);
+    uint32_t id = site;
+    uint16_t len = p - buf - BINLOG_EVENT_HEADER;
+    buf[0] = BINLOG_EVENT;
+    memcpy(buf + 1, &id, 4);
+    memcpy(buf + 5, &tsc, 8);
+    memcpy(buf + 13, &len, 2);
+    push_async(buf, p - buf);
+  }
+
   // 既然是单例模式，则不允许通过拷贝和赋值运算符去复制出一个新对象
   Log(const Log&)=delete;
   Log& operator=(const Log&)=delete;
@@ -50,18 +159,13 @@ private:
   Log();
   ~Log();
 
-  // 异步写入日志
-  void* async_write_log()
-  {
-    string single_log;
-    // 从阻塞队列中取出一个日志 string，写入文件
-    while(m_log_queue->pop(single_log))
-    {
-      m_mutex.lock();
-      fputs(single_log.c_str(), m_fp);        // 第二个参数，指向 FILE 的指针
-      m_mutex.unlock();
-    }
-  }
+  void async_write_log();                      // 后台写线程的主循环
+  size_t drain();                             // 把所有缓冲区中的日志写入文件，返回写出的字节数
+  bool write_all(struct iovec* iov, int count);
+  log_ring* acquire_ring();                   // 为当前线程取一个空闲的缓冲区，没有则新建
+  void push_async(const char* line, int len);
+  void rotate(const struct tm& tm, unsigned int lines);   // 计入 lines 行，需要时按天或按行数切换文件
+  void binary_prefix(std::string& out);       // 二进制模式下写在一批日志之前的文件头、新登记的调用点和时钟同步
 
 
 private:
@@ -72,16 +176,84 @@ private:
   unsigned int m_count;                       // 日志行数记录
   int m_today;                                // 按天分类，记录今天
   FILE *m_fp;                                 // 打开 log 的文件指针
-  char *m_buf;
-  block_queue<string> *m_log_queue;           // 阻塞队列
   bool m_is_async;                            // 是否开启异步
-  locker m_mutex;                             // 需要互斥锁
+  locker m_mutex;                             // 同步模式写文件时加锁
+
+  // 异步模式
+  size_t m_ring_size;                         // 每个线程缓冲区的容量
+  int m_overflow;
+  std::atomic<log_ring*> m_rings;             // 所有线程的缓冲区
+  std::atomic<long> m_dropped;
+  std::atomic<bool> m_stop;
+  futex_event m_data_event;                   // 后台线程在这里休眠
+  futex_event m_space_event;                  // OVERFLOW_BLOCK 时写日志的线程在这里等待空间
+  pthread_t m_tid;
+
+  // 二进制模式
+  // 调用点的登记表都是平凡类型，进程退出析构 Log 时仍在写日志的线程不会访问到已释放的内存
+  struct log_site
+  {
+    int level;
+    std::atomic<const char*> format;          // 填好之后才设置，后台线程看到非空才写出
+    bool written;                             // 当前文件中是否已经写出，只有后台线程访问
+  };
+  log_site m_sites[MAX_SITES];                // 下标即调用点 id
+  std::atomic<int> m_site_count;
+  bool m_need_header;                         // 打开了新文件，需要写文件头，只有后台线程访问
+  uint64_t m_tsc0;                            // init 时的 tsc 和墙上时间，用来估计 tsc 频率
+  int64_t m_real0;
+  double m_ticks_per_ns;
+  int64_t m_last_sync;                        // 上次写 SYNC 记录的墙上时间
+  string m_prefix;
 };
 
+// 编译期级别是常量，不满足时整个分支被去掉；运行时级别只是一次 relaxed 读，满足后才计算参数
+#define LOG_ENABLED(level) ((level) >= LOG_MIN_LEVEL && (level) >= Log::m_level.load(std::memory_order_relaxed))
+
+// 按模式写一条日志：二进制模式下调用点的静态变量在第一次执行时登记格式串
+#define LOG_WRITE(level, format, ...) \
+  do { \
+    if(Log::m_binary) \
+    { \
+      static const int log_site_ = Log::register_site(level, format); \
+      Log::get_instance()->write_binary(log_site_, ##__VA_ARGS__); \
+    } \
+    else \
+      Log::get_instance()->write_log(level, format, ##__VA_ARGS__); \
+  } while(0)
+
+#define LOG_BASE(level, format, ...) \
+  do { \
+    if(LOG_ENABLED(level)) \
+      LOG_WRITE(level, format, ##__VA_ARGS__); \
+  } while(0)
+
+// 限流的日志：同一个调用点 interval_ms 毫秒内最多写一条，并记下这期间被压下的条数
+#define LOG_BASE_RATE(level, interval_ms, format, ...) \
+  do { \
+    if(LOG_ENABLED(level)) \
+    { \
+      static log_limiter log_limiter_; \
+      long log_suppressed_ = 0; \
+      if(log_limiter_.allow(interval_ms, &log_suppressed_)) \
+      { \
+        LOG_WRITE(level, format, ##__VA_ARGS__); \
+        if(log_suppressed_ > 0) \
+          LOG_WRITE(level, "(%ld similar messages suppressed)", log_suppressed_); \
+      } \
+    } \
+  } while(0)
+
 // 定义日志文件类型的四个宏
-#define LOG_DEBUG(format, ...) Log::get_instance()->write_log(0, format, ##__VA_ARGS__)
-#define LOG_INFO(format, ...) Log::get_instance()->write_log(1, format, ##__VA_ARGS__)
-#define LOG_WARN(format, ...) Log::get_instance()->write_log(2, format, ##__VA_ARGS__)
-#define LOG_ERROR(format, ...) Log::get_instance()->write_log(3, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_BASE(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_BASE(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_BASE(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_BASE(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+// 高频日志使用的限流版本
+#define LOG_RATE_INTERVAL_MS 1000
+#define LOG_DEBUG_RATE(format, ...) LOG_BASE_RATE(LOG_LEVEL_DEBUG, LOG_RATE_INTERVAL_MS, format, ##__VA_ARGS__)
+#define LOG_INFO_RATE(format, ...) LOG_BASE_RATE(LOG_LEVEL_INFO, LOG_RATE_INTERVAL_MS, format, ##__VA_ARGS__)
+#define LOG_WARN_RATE(format, ...) LOG_BASE_RATE(LOG_LEVEL_WARN, LOG_RATE_INTERVAL_MS, format, ##__VA_ARGS__)
 
 #endif //XLAOTINYWEBSERVER_LOG_H
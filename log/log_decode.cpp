@@ -0,0 +1,368 @@
+//
+// Created by acg on 1/2/22.
+//
+// 二进制日志的解码工具：把 Log 二进制模式写出的文件还原成与文本模式相同的格式
+// 1. SITE 记录登记调用点的级别和格式串，FILE 记录（新文件）清空之前的登记
+// 2. EVENT 记录的时间由最近一条 SYNC 记录换算：墙上时间 + (tsc - 同步时的 tsc) / 每纳秒的滴答数
+// 3. 按格式串逐个解析转换说明，取出对应的参数，交给 snprintf 格式化
+// 用法：./log_decode [日志文件...]，不给文件时读标准输入，结果写到标准输出
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "binlog.h"
+
+using namespace std;
+
+struct site
+{
+  bool valid;
+  int level;
+  string format;
+};
+
+struct decoder
+{
+  vector<site> sites;
+  bool synced;
+  uint64_t sync_tsc;
+  int64_t sync_real;
+  double ticks_per_ns;
+  long events;
+  long errors;
+};
+
+static const char* const level_str[] = {"[debug]:", "[info]:", "[warn]:", "[error]:"};
+
+// 按 spec 格式化 value 并追加到 out
+template <typename T>
+static void append_format(string& out, const string& spec, T value)
+{
+  int n = snprintf(NULL, 0, spec.c_str(), value);
+  if(n <= 0)
+    return;
+  size_t old = out.size();
+  out.resize(old + n + 1);
+  snprintf(&out[old], n + 1, spec.c_str(), value);
+  out.resize(old + n);
+}
+
+// 一个编码后的参数
+struct arg
+{
+  char type;
+  int64_t i;
+  double d;
+  string s;
+};
+
+// 取出下一个参数，参数已经用完或者数据不完整时返回 false
+static bool next_arg(const char*& p, const char* end, arg& a)
+{
+  if(p >= end)
+    return false;
+  a.type = *p++;
+  switch(a.type)
+  {
+    case 'i':
+    {
+      if(end - p < 4)
+        return false;
+      int32_t v;
+      memcpy(&v, p, 4);
+      a.i = v;
+      p += 4;
+      return true;
+    }
+    case 'q':
+    case 'p':
+      if(end - p < 8)
+        return false;
+      memcpy(&a.i, p, 8);
+      p += 8;
+      return true;
+    case 'd':
+      if(end - p < 8)
+        return false;
+      memcpy(&a.d, p, 8);
+      p += 8;
+      return true;
+    case 's':
+    {
+      if(end - p < 2)
+        return false;
+      uint16_t len;
+      memcpy(&len, p, 2);
+      p += 2;
+      if(end - p < len)
+        return false;
+      a.s.assign(p, len);
+      p += len;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// 用参数还原格式串
+static void render(const string& fmt, const char* p, const char* end, string& out)
+{
+  size_t n = fmt.size();
+  size_t i = 0;
+  while(i < n)
+  {
+    if(fmt[i] != '%')
+    {
+      out += fmt[i++];
+      continue;
+    }
+    if(i + 1 < n && fmt[i + 1] == '%')
+    {
+      out += '%';
+      i += 2;
+      continue;
+    }
+
+    // % [标志] [宽度] [.精度] [长度] 转换字符，长度修饰统一换成与参数匹配的
+    size_t j = i + 1;
+    while(j < n && strchr("-+ #0", fmt[j]))
+      ++j;
+    while(j < n && isdigit((unsigned char) fmt[j]))
+      ++j;
+    if(j < n && fmt[j] == '.')
+    {
+      ++j;
+      while(j < n && isdigit((unsigned char) fmt[j]))
+        ++j;
+    }
+    size_t length_start = j;
+    while(j < n && strchr("hlLqjzt", fmt[j]))
+      ++j;
+    if(j >= n)
+    {
+      out.append(fmt, i, string::npos);
+      break;
+    }
+    char conv = fmt[j];
+    string spec = fmt.substr(i, length_start - i);
+    i = j + 1;
+
+    arg a;
+    if(!next_arg(p, end, a))
+    {
+      out += "<?>";
+      p = end;
+      continue;
+    }
+
+    // 参数类型与转换字符不一致时按参数的类型输出
+    if(a.type == 's')
+    {
+      if(conv == 's')
+        append_format(out, spec + "s", a.s.c_str());
+      else
+        out += a.s;
+      continue;
+    }
+    switch(conv)
+    {
+      case 'd':
+      case 'i':
+        append_format(out, spec + "lld", (long long) (a.type == 'd' ? (long long) a.d : a.i));
+        break;
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+      {
+        // 32 位的参数不知道原来是否有符号，按无符号的 32 位还原
+        unsigned long long v = a.type == 'i' ? (unsigned long long) (uint32_t) a.i : (unsigned long long) a.i;
+        append_format(out, spec + "ll" + conv, v);
+        break;
+      }
+      case 'c':
+        append_format(out, spec + "c", (int) a.i);
+        break;
+      case 'f':
+      case 'F':
+      case 'e':
+      case 'E':
+      case 'g':
+      case 'G':
+      case 'a':
+      case 'A':
+        append_format(out, spec + conv, a.type == 'd' ? a.d : (double) a.i);
+        break;
+      case 'p':
+        append_format(out, spec + "p", (void*) (uintptr_t) a.i);
+        break;
+      default:
+        append_format(out, spec + "lld", (long long) a.i);
+        break;
+    }
+  }
+}
+
+static void print_event(decoder& d, uint32_t id, uint64_t tsc, const char* args, uint16_t len)
+{
+  if(id >= d.sites.size() || !d.sites[id].valid)
+  {
+    ++d.errors;
+    return;
+  }
+  const site& s = d.sites[id];
+
+  int64_t real = 0;
+  if(d.synced)
+    real = d.sync_real + (int64_t) ((double) (int64_t) (tsc - d.sync_tsc) / d.ticks_per_ns);
+  time_t sec = real / 1000000000LL;
+  long usec = (real % 1000000000LL) / 1000;
+  struct tm tm;
+  localtime_r(&sec, &tm);
+
+  char head[64];
+  const char* level = (s.level >= 0 && s.level <= 3) ? level_str[s.level] : level_str[1];
+  snprintf(head, sizeof(head), "%d-%02d-%02d %02d:%02d:%02d.%06ld %s", tm.tm_year + 1900, tm.tm_mon + 1,
+           tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, usec, level);
+
+  string line = head;
+  render(s.format, args, args + len, line);
+  line += '\n';
+  fwrite(line.data(), 1, line.size(), stdout);
+  ++d.events;
+}
+
+static void decode(decoder& d, const vector<char>& data)
+{
+  const char* p = data.data();
+  const char* end = p + data.size();
+  while(p < end)
+  {
+    char type = *p;
+    switch(type)
+    {
+      case BINLOG_FILE:
+        if(end - p < 1 + BINLOG_MAGIC_LEN || memcmp(p + 1, BINLOG_MAGIC, BINLOG_MAGIC_LEN) != 0)
+        {
+          fprintf(stderr, "bad file header\n");
+          return;
+        }
+        d.sites.clear();
+        d.synced = false;
+        p += 1 + BINLOG_MAGIC_LEN;
+        break;
+
+      case BINLOG_SITE:
+      {
+        if(end - p < 8)
+          return;
+        uint32_t id;
+        uint16_t len;
+        memcpy(&id, p + 1, 4);
+        memcpy(&len, p + 6, 2);
+        if(end - p < 8 + len)
+          return;
+        if(id >= d.sites.size())
+          d.sites.resize(id + 1);
+        d.sites[id].valid = true;
+        d.sites[id].level = p[5];
+        d.sites[id].format.assign(p + 8, len);
+        p += 8 + len;
+        break;
+      }
+
+      case BINLOG_SYNC:
+        if(end - p < 25)
+          return;
+        memcpy(&d.sync_tsc, p + 1, 8);
+        memcpy(&d.sync_real, p + 9, 8);
+        memcpy(&d.ticks_per_ns, p + 17, 8);
+        if(d.ticks_per_ns <= 0)
+          d.ticks_per_ns = 1;
+        d.synced = true;
+        p += 25;
+        break;
+
+      case BINLOG_EVENT:
+      {
+        if(end - p < BINLOG_EVENT_HEADER)
+          return;
+        uint32_t id;
+        uint64_t tsc;
+        uint16_t len;
+        memcpy(&id, p + 1, 4);
+        memcpy(&tsc, p + 5, 8);
+        memcpy(&len, p + 13, 2);
+        // 文件末尾不完整的记录（还在写）直接结束
+        if(end - p < BINLOG_EVENT_HEADER + len)
+          return;
+        print_event(d, id, tsc, p + BINLOG_EVENT_HEADER, len);
+        p += BINLOG_EVENT_HEADER + len;
+        break;
+      }
+
+      default:
+        fprintf(stderr, "unknown record type 0x%02x at offset %ld\n", (unsigned char) type, (long) (p - data.data()));
+        return;
+    }
+  }
+}
+
+static bool read_all(FILE* fp, vector<char>& data)
+{
+  char buf[65536];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    data.insert(data.end(), buf, buf + n);
+  return !ferror(fp);
+}
+
+int main(int argc, char* argv[])
+{
+  decoder d;
+  d.synced = false;
+  d.sync_tsc = 0;
+  d.sync_real = 0;
+  d.ticks_per_ns = 1;
+  d.events = 0;
+  d.errors = 0;
+
+  if(argc <= 1)
+  {
+    vector<char> data;
+    if(!read_all(stdin, data))
+    {
+      perror("stdin");
+      return 1;
+    }
+    decode(d, data);
+  }
+  for(int i=1; i<argc; ++i)
+  {
+    FILE* fp = fopen(argv[i], "rb");
+    if(!fp)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    vector<char> data;
+    bool ok = read_all(fp, data);
+    fclose(fp);
+    if(!ok)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    decode(d, data);
+  }
+
+  if(d.errors > 0)
+    fprintf(stderr, "%ld events with unknown call site\n", d.errors);
+  return 0;
+}
@@ -0,0 +1,93 @@
+//
+// Created by acg on 12/31/21.
+//
+
+#ifndef XLAOTINYWEBSERVER_LOG_RING_H
+#define XLAOTINYWEBSERVER_LOG_RING_H
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+// 单生产者单消费者的字节环形缓冲区，异步日志中每个写日志的线程一个
+// 1. 生产者（写日志的线程）只修改 head，消费者（后台写线程）只修改 tail，不需要加锁
+// 2. 保存的是格式化好的日志行，消费者直接把 [tail, head) 交给 writev，不用再拷贝
+// 3. 线程退出时只把 in_use 清零，缓冲区留给之后的新线程复用，剩下的日志照常由后台线程写出
+class log_ring
+{
+public:
+  explicit log_ring(size_t capacity): next(NULL)
+  {
+    // 向上取整到 2 的幂
+    size_t size = 1024;
+    while(size < capacity)
+      size <<= 1;
+    m_size = size;
+    m_data = new char[size];
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    records.store(0, std::memory_order_relaxed);
+    drained_records = 0;
+    in_use.store(true, std::memory_order_relaxed);
+  }
+
+  ~log_ring()
+  {
+    delete[] m_data;
+  }
+
+  log_ring(const log_ring&)=delete;
+  log_ring& operator=(const log_ring&)=delete;
+
+  size_t capacity() { return m_size; }
+
+  // 生产者调用：剩余空间不足 len 时返回 false
+  bool push(const char* line, size_t len)
+  {
+    size_t h = head.load(std::memory_order_relaxed);
+    if(m_size - (h - tail.load(std::memory_order_acquire)) < len)
+      return false;
+    size_t pos = h & (m_size - 1);
+    size_t first = m_size - pos < len ? m_size - pos : len;
+    memcpy(m_data + pos, line, first);
+    memcpy(m_data, line + first, len - first);
+    records.store(records.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    head.store(h + len, std::memory_order_release);
+    return true;
+  }
+
+  // 消费者调用：把 [from, to) 拆成最多两段连续内存，返回段数
+  int segments(size_t from, size_t to, char** base, size_t* len)
+  {
+    if(from == to)
+      return 0;
+    size_t pos = from & (m_size - 1);
+    size_t n = to - from;
+    base[0] = m_data + pos;
+    if(pos + n <= m_size)
+    {
+      len[0] = n;
+      return 1;
+    }
+    len[0] = m_size - pos;
+    base[1] = m_data;
+    len[1] = n - len[0];
+    return 2;
+  }
+
+public:
+  std::atomic<size_t> head;       // 已写入的总字节数，生产者修改
+  std::atomic<size_t> records;    // 写入的记录（日志行）总数，生产者修改，用于按行数切换文件
+  char m_pad0[64];
+  std::atomic<size_t> tail;       // 已写出的总字节数，消费者修改
+  size_t drained_records;         // 已经计入行数的记录数，只有消费者访问
+  char m_pad1[64];
+  std::atomic<bool> in_use;       // 是否有线程正在使用
+  log_ring* next;                 // 所有缓冲区串成链表，只在头部插入，节点不会被删除
+
+private:
+  char* m_data;
+  size_t m_size;
+};
+
+#endif //XLAOTINYWEBSERVER_LOG_RING_H
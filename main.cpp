@@ -10,19 +10,43 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #include "./locker/locker.h"
 #include "./threadPool/threadPool.h"
-#include "./timer/time_heap.h"
+#include "./timer/time_wheel.h"
 #include "./http/http_conn.h"
 #include "./log/log.h"
+#include "./buffer/buffer_pool.h"
 
 #define MAX_FD 65536                // 最大文件描述符
 #define MAX_EVENT_NUMBER 10000      // 最大事件数
-#define TIMESLOT 30                  // 最小超时时间
+#define TIMER_TICK_MS 10            // timerfd 的触发间隔，与时间轮的滴答一致
+#define HEADER_TIMEOUT_MS 10000     // 连接建立或开始一个新请求后，必须在此时间内发完请求行和头部
+#define BODY_TIMEOUT_MS 10000       // 接收消息体时两次读到数据之间最多间隔的时间
+#define IDLE_TIMEOUT_MS 60000       // 长连接两个请求之间最多空闲的时间
+#define WRITE_TIMEOUT_MS 30000      // 发送响应时对方超过此时间不接收就关闭连接
+#define STAT_INTERVAL_MS 30000      // 记录内存占用的间隔
+#define MAX_REACTOR_NUMBER 64       // 最多的事件循环（reactor）线程数
+#define FILE_CACHE_BYTES (64 * 1024 * 1024)   // 静态文件缓存的字节预算
+#define SQL_THREAD_NUMBER 4         // 异步数据库执行器的线程数（ASYNCSQL，在 http_conn.h 中定义），不超过连接池的连接数
+//#define PINCONN                     // 访问数据库的线程各自固定持有一个连接，不再每次经过连接池
+#define MAX_PINNED_CONN 4           // 最多固定的连接数，连接池共 8 个连接
+
+//#define LOCKFREEPOOL                // 线程池使用无锁环形队列，默认为链表 + 互斥锁 + 信号量
+//#define STEALPOOL                   // 线程池的每个工作线程一个队列，连接交给上次处理它的线程，空闲线程窃取
+//#define ELASTICPOOL                 // 线程池的线程数随负载在 MIN_THREAD_NUMBER 和 MAX_THREAD_NUMBER 之间伸缩
+#define MIN_THREAD_NUMBER 8
+#define MAX_THREAD_NUMBER 64
 
 //#define SYNLOG                      // 同步写日志
 #define ASYNLOG                     // 异步写日志
+//#define BINLOG                      // 异步写二进制日志，用 make log_decode 编译的 log/log_decode 还原成文本
+                                    // 三种方式只能选一种，Log::init 不能调用两次
+#if (defined(SYNLOG) + defined(ASYNLOG) + defined(BINLOG)) > 1
+#error "SYNLOG, ASYNLOG and BINLOG are mutually exclusive"
+#endif
+#define LOG_LEVEL LOG_LEVEL_INFO    // 启动时的日志级别，运行中 SIGUSR1 降低一级（更详细），SIGUSR2 提高一级
 
 #define listenfdET                  // 监听非阻塞ET
 //#define listenfdLT                  // 监听阻塞LT
@@ -32,11 +56,30 @@ extern int addfd(int epollfd, int fd, bool one_shot);
 void removefd(int epollfd, int fd);
 int setNonBlocking(int fd);
 
-// 设置定时器相关的参数
-static int pipefd[2];                 // 父子进程通信管道，传递信号
-static time_heap timer_heap;
-static int epollfd = 0;
-static bool isAlarm = false;
+// 一个 reactor 就是一个事件循环，独占自己的内核事件表、监听 socket、信号管道、timerfd 和时间轮
+// 多 reactor 时每个 reactor 的监听 socket 都以 SO_REUSEPORT 绑定同一个端口，由内核把新连接分散到各个 reactor
+// users 和 users_timer 仍以 fd 为下标：fd 在进程内唯一，且一个 connfd 只注册在接受它的 reactor 上，
+// 所以每个 reactor 实际只访问属于自己的那一部分
+struct reactor
+{
+  int id;
+  int epollfd;
+  int listenfd;
+  int pipefd[2];                      // 信号处理函数通过它通知本 reactor
+  int timerfd;                        // 时间轮上有定时器时每 TIMER_TICK_MS 毫秒可读一次
+  bool timer_armed;
+  unsigned long long last_stat;       // 上次记录内存占用的时刻
+  time_wheel timer_wheel;             // 本 reactor 上连接的定时器
+  bool stop;
+  pthread_t tid;
+};
+
+static reactor reactors[MAX_REACTOR_NUMBER];
+static int reactor_number = 1;
+
+static http_conn* users = NULL;
+static client_data* users_timer = NULL;
+static threadPool<http_conn>* pool = NULL;
 
 // 信号处理函数
 void sig_handler(int sig)
@@ -47,7 +90,9 @@ void sig_handler(int sig)
   int msg = sig;
 
   // 传入信号的信号序号，但是 send 接受字符，转换一下
-  send(pipefd[1], (char*)&msg, 1, 0);
+  // 信号是进程级别的，每个 reactor 都要收到
+  for(int i=0; i<reactor_number; ++i)
+    send(reactors[i].pipefd[1], (char*)&msg, 1, 0);
   errno = save_errno;
 }
 
@@ -64,34 +109,101 @@ void addsig(int sig, void(handler)(int), bool restart = true)
   assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-// 定时处理任务，不断定时触发 SIGALRM 信号
-void timer_handler()
+// 进程的常驻内存（RSS），单位 KB，读取失败返回 -1
+// /proc/self/statm 的第二列是常驻内存的页数
+long get_rss_kb()
+{
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if(!fp)
+    return -1;
+  long size = 0, resident = 0;
+  int ret = fscanf(fp, "%ld %ld", &size, &resident);
+  fclose(fp);
+  if(ret != 2)
+    return -1;
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// 开启或停止 reactor 的 timerfd：时间轮上没有定时器时停掉，空闲的 reactor 不会被周期性唤醒
+// 0 号 reactor 还要定时记录内存占用，它的 timerfd 一直开着
+void arm_timer(reactor* r, bool on)
 {
-  timer_heap.tick();
-  heap_timer* temp = nullptr;
-  if(!isAlarm && (temp = timer_heap.Top()))
+  if(r->timer_armed == on)
+    return;
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if(on)
   {
-    time_t delay = temp->expire - time(nullptr);
-    if(delay <= 0) delay = 1;
-    alarm(delay);
-    isAlarm = true;
+    its.it_value.tv_nsec = TIMER_TICK_MS * 1000000L;
+    its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
   }
+  timerfd_settime(r->timerfd, 0, &its, NULL);
+  r->timer_armed = on;
+}
+
+// 定时处理任务，timerfd 可读时调用，各 reactor 只处理自己的时间轮
+// 0 号 reactor 每 STAT_INTERVAL_MS 毫秒记录一次内存占用，用来观察大量空闲连接时的内存
+// 返回 true 表示还有超时的定时器没处理完
+bool timer_handler(reactor* r)
+{
+  bool more = r->timer_wheel.tick();
+  if(r->id == 0)
+  {
+    unsigned long long now = time_wheel::now_ms();
+    if(now - r->last_stat >= STAT_INTERVAL_MS)
+    {
+      LOG_INFO("rss:%ldKB users:%d buffer pool in use:%zuKB free:%zuKB log dropped:%ld", get_rss_kb(),
+               (int)http_conn::m_user_count, buffer_pool::get_instance()->bytes_in_use() / 1024,
+               buffer_pool::get_instance()->bytes_free() / 1024, Log::get_instance()->dropped());
+      long acquires = 0, waits = 0, wait_us = 0;
+      connection_pool::getInstance()->waitStats(&acquires, &waits, &wait_us);
+      LOG_INFO("sql pool acquires:%ld waits:%ld wait:%ldus free:%d", acquires, waits, wait_us,
+               connection_pool::getInstance()->getFreeConn());
+#ifdef STEALPOOL
+      long local_hits = 0, steals = 0;
+      pool->steal_stats(&local_hits, &steals);
+      LOG_INFO("thread pool local hits:%ld steals:%ld", local_hits, steals);
+#endif
+#ifdef ELASTICPOOL
+      long grows = 0, shrinks = 0;
+      pool->resize_stats(&grows, &shrinks);
+      LOG_INFO("thread pool threads:%d grows:%ld shrinks:%ld", pool->thread_count(), grows, shrinks);
+#endif
+      r->last_stat = now;
+    }
+  }
+  else if(r->timer_wheel.size() == 0)
+    arm_timer(r, false);
+  return more;
 }
 
 // 定时器回调函数，删除非活跃的socket的注册事件，并关闭
+// 由时间轮在超时时调用，或者在连接出错时直接调用，之后定时器都会被回收
 void cb_func(client_data *user_data)
 {
-  // 1. 从内核事件表中删除事件
-  epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
   assert(user_data);
+  user_data->timer = NULL;
+  // 连接正在等待数据库操作，由完成回调关闭
+  if(users[user_data->sockfd].abandon_db())
+    return;
+  // 1. 从所属 reactor 的内核事件表中删除事件
+  epoll_ctl(user_data->epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
   // 2. 关闭文件fd
   close(user_data->sockfd);
   // 3. 更新连接的用户
   http_conn::m_user_count--;
-  // 4. 设置当前无正在处理定时事件
-  isAlarm = false;
   LOG_INFO("close fd %d", user_data->sockfd);
-  Log::get_instance()->flush();
+}
+
+// 异步数据库操作的完成回调，在 0 号 reactor 中由 sql_executor::dispatch 调用
+// 把连接重新交给线程池继续处理请求；等待期间连接已经超时则在这里关闭
+void db_complete(sql_task* task)
+{
+  http_conn* conn = (http_conn*) task->arg;
+  if(conn->db_finish(task))
+    pool->append(conn);
+  else
+    cb_func(&users_timer[conn->get_sockfd()]);
 }
 
 void show_error(int connfd, const char* info)
@@ -101,46 +213,9 @@ void show_error(int connfd, const char* info)
   close(connfd);
 }
 
-int main(int argc, char* argv[])
+// 创建监听 socket，多 reactor 时开启 SO_REUSEPORT
+int create_listenfd(int port, bool reuse_port)
 {
-#ifdef ASYNLOG
-  Log::get_instance()->init("ServerLog", 2000, 800000, 8);      // 异步写日志
-#endif
-
-#ifdef SYNLOG
-  Log::get_instance()->init("ServerLog", 2000, 800000, 0);  // 同步写日志
-#endif
-
-  if(argc <= 1)
-  {
-    printf("you need to input ip、port\n", basename(argv[0]));
-    return 1;
-  }
-
-  int port = atoi(argv[1]);
-
-  addsig(SIGPIPE, SIG_IGN);
-
-  // 创建数据库连接池
-  connection_pool* connPool = connection_pool::getInstance();
-  connPool->init("localhost", "root", "xxx", "test", 3306, 8);
-
-  // 创建线程池
-  threadPool<http_conn> *pool = NULL;
-  try {
-    pool = new threadPool<http_conn>(connPool);
-  }
-  catch (...)
-  {
-    return 1;
-  }
-
-  http_conn* users = new http_conn[MAX_FD];
-  assert(users);
-
-  // 初始化数据库读取表
-  users->init_mysql_result(connPool);
-
   int listenfd = socket(PF_INET, SOCK_STREAM, 0);
   assert(listenfd >= 0);
 
@@ -153,41 +228,74 @@ int main(int argc, char* argv[])
 
   int flag = 1;
   setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+  if(reuse_port)
+  {
+    ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+    assert(ret >= 0);
+  }
   ret = bind(listenfd, (sockaddr*)&address, sizeof(address));
   assert(ret >= 0);
   ret = listen(listenfd, 5);
   assert(ret >= 0);
+  return listenfd;
+}
+
+// 初始化 reactor：内核事件表、监听 socket、信号管道
+void init_reactor(reactor* r, int id, int port)
+{
+  r->id = id;
+  r->stop = false;
+  r->listenfd = create_listenfd(port, reactor_number > 1);
 
   // 创建内核事件表
-  epoll_event events[MAX_EVENT_NUMBER];
-  epollfd = epoll_create(5);
-  assert(epollfd != -1);
+  r->epollfd = epoll_create(5);
+  assert(r->epollfd != -1);
 
   // 将监听 fd 注册到内核事件表，不能是 one_shot
-  addfd(epollfd, listenfd, false);
-  http_conn::m_epollfd = epollfd;
+  addfd(r->epollfd, r->listenfd, false);
 
   // 创建父子通信管道
-  ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pipefd);
+  int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, r->pipefd);
   assert(ret != -1);
-  setNonBlocking(pipefd[1]);    // 写管道不阻塞，写满直接返回errno
-  addfd(epollfd, pipefd[0], false);   // 注册管道的读事件
-
-  // 信号处理函数，只关注 alarm 和 ctrl + c 发送的信号
-  addsig(SIGALRM, sig_handler, false);
-  addsig(SIGTERM, sig_handler, false);
-  bool stop_server = false;
+  setNonBlocking(r->pipefd[1]);    // 写管道不阻塞，写满直接返回errno
+  addfd(r->epollfd, r->pipefd[0], false);   // 注册管道的读事件
+
+  // 定时器不再依赖 SIGALRM，由 timerfd 直接在事件循环中触发
+  r->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  assert(r->timerfd != -1);
+  addfd(r->epollfd, r->timerfd, false);
+  r->timer_armed = false;
+  r->last_stat = time_wheel::now_ms();
+  if(id == 0)
+    arm_timer(r, true);
+}
 
-  client_data* users_timer = new client_data[MAX_FD];
+// 将新连接注册到 reactor 上，并为其创建定时器
+void add_client(reactor* r, int connfd, const sockaddr_in& client_address)
+{
+  // 将 connfd 注册到内核，同时初始化连接
+  users[connfd].init(connfd, client_address, r->epollfd);
+
+  users_timer[connfd].address = client_address;
+  users_timer[connfd].sockfd = connfd;
+  users_timer[connfd].epollfd = r->epollfd;
+  // 新连接必须在 HEADER_TIMEOUT_MS 内发来完整的请求
+  users_timer[connfd].timer = r->timer_wheel.add_timer(HEADER_TIMEOUT_MS, cb_func, &users_timer[connfd]);
+  arm_timer(r, true);
+}
 
+// 事件循环：只要不发 SIGTERM，则一直执行下面的语句（服务器一直运行）
+void* event_loop(void* arg)
+{
+  reactor* r = (reactor*) arg;
+  epoll_event* events = new epoll_event[MAX_EVENT_NUMBER];
   bool timeout = false;
-  alarm(TIMESLOT);        // 定时触发 alarm
-
+  bool timer_pending = false;     // 时间轮中还有超时的定时器没处理完，不能阻塞等待
+  int ret = 0;
 
-  // 只要不发 SIGTERM，则一直执行下面的语句（服务器一直运行）
-  while(!stop_server)
+  while(!r->stop)
   {
-    int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+    int number = epoll_wait(r->epollfd, events, MAX_EVENT_NUMBER, timer_pending ? 0 : -1);
     if(number < 0 && errno != EINTR)
     {
       LOG_ERROR("%s", "epoll failure");
@@ -199,12 +307,12 @@ int main(int argc, char* argv[])
       int sockfd = events[i].data.fd;
 
       // 如果是新到的客户连接
-      if(sockfd == listenfd)
+      if(sockfd == r->listenfd)
       {
         struct sockaddr_in client_address;
         socklen_t client_address_len = sizeof(client_address);
 #ifdef listenfdLT
-        int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_address_len);
+        int connfd = accept(r->listenfd, (struct sockaddr*)&client_address, &client_address_len);
         if(connfd < 0 && errno != 11)
         {
           LOG_ERROR("%s:errno is:%d", "accept error", errno);
@@ -216,27 +324,13 @@ int main(int argc, char* argv[])
           LOG_ERROR("%s", "Internal server busy");
           continue;
         }
-        // 将 connfd 注册到内核，同时初始化连接
-        users[connfd].init(connfd, client_address);
-
-        users_timer[connfd].address = client_address;
-        users_timer[connfd].sockfd = connfd;
-        auto timer = new heap_timer(TIMESLOT);    //timer的expire为 当前+TIMESLOT
-        timer->user_data = &users_timer[connfd];
-        timer->cb_func = cb_func;
-        timer_heap.add_timer(timer);
-        if(!isAlarm)
-        {
-          isAlarm = true;
-          alarm(TIMESLOT);
-        }
-        users_timer[connfd].timer = timer;
+        add_client(r, connfd, client_address);
 #endif
 
 #ifdef listenfdET
         while(1)
           {
-          int connfd = accept(listenfd, (struct sockaddr*)&client_address, &client_address_len);
+          int connfd = accept(r->listenfd, (struct sockaddr*)&client_address, &client_address_len);
           if(connfd < 0)
           {
             LOG_ERROR("%s:errno is:%d", "accept error", errno);
@@ -248,40 +342,37 @@ int main(int argc, char* argv[])
             LOG_ERROR("%s", "Internal server busy");
             continue;
           }
-          users[connfd].init(connfd, client_address);
-
-          users_timer[connfd].address = client_address;
-          users_timer[connfd].sockfd = connfd;
-          auto timer = new heap_timer(TIMESLOT);    //timer的expire为 当前+TIMESLOT
-          timer->user_data = &users_timer[connfd];
-          timer->cb_func = cb_func;
-          timer_heap.add_timer(timer);
-          if(!isAlarm)
-          {
-            isAlarm = true;
-            alarm(TIMESLOT);
-          }
-          users_timer[connfd].timer = timer;
+          add_client(r, connfd, client_address);
           }
         continue;
 #endif
       }
-      // 连接关闭事件
+      // 时间轮的滴答，必须读出到期次数，否则 timerfd 一直可读
+      else if(sockfd == r->timerfd)
+      {
+        uint64_t expirations;
+        if(read(r->timerfd, &expirations, sizeof(expirations)) > 0)
+          timeout = true;
+      }
+#ifdef ASYNCSQL
+      // 数据库操作完成，只注册在 0 号 reactor 上
+      else if(r->id == 0 && sockfd == sql_executor::get_instance()->get_eventfd())
+        sql_executor::get_instance()->dispatch();
+#endif
+      // 连接关闭事件，工作线程 close_conn 时 shutdown 的连接也从这里关闭
       else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
       {
         // 服务器关闭连接，移除定时器
         auto timer = users_timer[sockfd].timer;
-        timer->cb_func(&users_timer[sockfd]); // 删除连接，关闭fd
-        if(timer)
-          timer_heap.del_timer(timer);
+        cb_func(&users_timer[sockfd]); // 删除连接，关闭fd
+        r->timer_wheel.del_timer(timer);
       }
 
-      // 主程序处理信号
-      else if((sockfd == pipefd[0]) && (events[i].events & EPOLLIN))
+      // 处理信号
+      else if((sockfd == r->pipefd[0]) && (events[i].events & EPOLLIN))
       {
-        int sig;
         char signals[1024];
-        ret = recv(pipefd[0], signals, sizeof(signals), 0);
+        ret = recv(r->pipefd[0], signals, sizeof(signals), 0);
         if(ret == -1)
           continue;
         else if(ret == 0)
@@ -292,13 +383,17 @@ int main(int argc, char* argv[])
           {
             switch(signals[i])
             {
-              case SIGALRM:
-              {
-                timeout = true;
-                break;
-              }
               case SIGTERM:
-                stop_server = true;
+                r->stop = true;
+                break;
+              // 日志级别是进程级别的，只由 0 号 reactor 调整
+              case SIGUSR1:
+              case SIGUSR2:
+                if(r->id == 0)
+                {
+                  Log::set_level(Log::get_level() + (signals[i] == SIGUSR1 ? -1 : 1));
+                  LOG_WARN("log level set to %d", Log::get_level());
+                }
                 break;
             }
           }
@@ -309,28 +404,32 @@ int main(int argc, char* argv[])
       else if(events[i].events & EPOLLIN)
       {
         auto timer = users_timer[sockfd].timer;
+        // 读之前读缓冲区为空，说明这是一个新请求的开始（EPOLLONESHOT 保证此时没有工作线程在处理该连接）
+        bool new_request = !users[sockfd].has_pending();
         if(users[sockfd].read_once())
         {
           LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
-          Log::get_instance()->flush();
 
-          // 将处理好的读完成事件放入请求队列中
-          pool->append(users + sockfd);
-
-          // 该连接活跃，更新定时器在链表中的位置
-          if(timer)
+          // 新请求开始计算请求超时；请求行和头部后续到达的数据不延长期限，防止慢速发送一直占着连接
+          // 已经在接收消息体时每次读到数据都重新计时，大的上传只要数据一直在到达就不会中途超时
+          if(timer && new_request)
+          {
+            r->timer_wheel.adjust_timer(timer, HEADER_TIMEOUT_MS);
+            LOG_INFO_RATE("%s", "adjust timer once");
+          }
+          else if(timer && users[sockfd].reading_body())
           {
-            time_t curr = time(NULL);
-            timer->expire = curr + 2 * TIMESLOT;
-            LOG_INFO("%s", "adjust timer once");
-            Log::get_instance()->flush();
+            r->timer_wheel.adjust_timer(timer, BODY_TIMEOUT_MS);
+            LOG_INFO_RATE("%s", "adjust timer once");
           }
+
+          // 将处理好的读完成事件放入请求队列中
+          pool->append(users + sockfd);
         }
         else
         {
-          timer->cb_func(&users_timer[sockfd]);
-          if(timer)
-            timer_heap.del_timer(timer);
+          cb_func(&users_timer[sockfd]);
+          r->timer_wheel.del_timer(timer);
         }
       }
       else if(events[i].events & EPOLLOUT)
@@ -339,36 +438,153 @@ int main(int argc, char* argv[])
         if(users[sockfd].write())
         {
           LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
-          Log::get_instance()->flush();
 
-          // 活跃节点，更新定时器
+          // 活跃节点，更新定时器：还没发完的从这次发送算起，
+          // 发完后读缓冲区中还有流水线请求的算作新请求，否则进入长连接空闲
+          bool pending = users[sockfd].has_pending();
           if(timer)
           {
-            time_t curr = time(NULL);
-            timer->expire = curr + 2 * TIMESLOT;
-            LOG_INFO("%s", "adjust timer once");
-            Log::get_instance()->flush();
+            int timeout_ms = IDLE_TIMEOUT_MS;
+            if(users[sockfd].is_writing())
+              timeout_ms = WRITE_TIMEOUT_MS;
+            else if(pending)
+              timeout_ms = HEADER_TIMEOUT_MS;
+            r->timer_wheel.adjust_timer(timer, timeout_ms);
+            LOG_INFO_RATE("%s", "adjust timer once");
           }
+
+          // 读缓冲区中还有流水线请求，等这一批响应全部发完再交给线程池处理
+          // 还没发完时 write 已经重新注册了 EPOLLOUT，此时交给工作线程会和下一次 write 同时操作发送队列
+          if(pending && !users[sockfd].is_writing())
+            pool->append(users + sockfd);
         }
         else
         {
-          timer->cb_func(&users_timer[sockfd]);
-          if(timer)
-            timer_heap.del_timer(timer);
+          cb_func(&users_timer[sockfd]);
+          r->timer_wheel.del_timer(timer);
         }
       }
     }
     if(timeout)
     {
       // 超时则执行超时处理函数
-      timer_handler();
+      timer_pending = timer_handler(r);
       timeout = false;
     }
+    // 上次没处理完的超时定时器，处理完一批事件后接着处理
+    else if(timer_pending)
+      timer_pending = r->timer_wheel.tick();
+  }
+  delete[] events;
+  return r;
+}
+
+int main(int argc, char* argv[])
+{
+#if defined(ASYNLOG)
+  Log::get_instance()->init("ServerLog", 2000, 800000, 32, Log::OVERFLOW_DROP);      // 异步写日志，每个线程 64KB 缓冲区，写满丢弃
+#elif defined(SYNLOG)
+  Log::get_instance()->init("ServerLog", 2000, 800000, 0);  // 同步写日志
+#elif defined(BINLOG)
+  Log::get_instance()->init("ServerLog.bin", 2000, 800000, 32, Log::OVERFLOW_DROP, true);    // 二进制日志
+#endif
+  Log::set_level(LOG_LEVEL);
+
+  if(argc <= 1)
+  {
+    printf("usage: %s port [reactor_number]\n", basename(argv[0]));
+    return 1;
+  }
+
+  int port = atoi(argv[1]);
+
+  // 事件循环线程数，默认为 1（单 reactor），传 0 则按 CPU 核数开启
+  if(argc > 2)
+  {
+    reactor_number = atoi(argv[2]);
+    if(reactor_number <= 0)
+      reactor_number = sysconf(_SC_NPROCESSORS_ONLN);
+    if(reactor_number > MAX_REACTOR_NUMBER)
+      reactor_number = MAX_REACTOR_NUMBER;
+  }
+
+  addsig(SIGPIPE, SIG_IGN);
+
+  // 静态文件缓存，inotify 监听文件变化
+  file_cache::get_instance()->init(FILE_CACHE_BYTES);
+
+  // 创建数据库连接池
+  connection_pool* connPool = connection_pool::getInstance();
+  connPool->init("localhost", "root", "xxx", "test", 3306, 8);
+
+  // 异步数据库执行器：工作线程不再持有数据库连接
+#ifdef ASYNCSQL
+  if(!sql_executor::get_instance()->init(connPool, SQL_THREAD_NUMBER))
+    return 1;
+  connection_pool* workerConnPool = NULL;
+#else
+  connection_pool* workerConnPool = connPool;
+#endif
+
+  // 创建线程池
+  try {
+#if defined(LOCKFREEPOOL)
+    pool = new threadPool<http_conn>(workerConnPool, 8, 10000, POOL_MPMC);
+#elif defined(STEALPOOL)
+    pool = new threadPool<http_conn>(workerConnPool, 8, 10000, POOL_STEAL);
+#elif defined(ELASTICPOOL)
+    pool = new threadPool<http_conn>(workerConnPool, MIN_THREAD_NUMBER, 10000, POOL_ELASTIC, MAX_THREAD_NUMBER);
+#else
+    pool = new threadPool<http_conn>(workerConnPool);
+#endif
+  }
+  catch (...)
+  {
+    return 1;
+  }
+
+  users = new http_conn[MAX_FD];
+  assert(users);
+
+#ifdef PINCONN
+  // 在启动加载线程之前设置：加载线程也会固定一个连接，加载完线程退出时归还
+  connPool->setMaxPinned(MAX_PINNED_CONN);
+#endif
+  // 在后台加载用户表，不等加载完就开始接受请求，静态请求不受影响
+  users->init_mysql_result(connPool);
+
+  users_timer = new client_data[MAX_FD];
+
+  // 创建所有 reactor，0 号 reactor 运行在主线程上
+  for(int i=0; i<reactor_number; ++i)
+    init_reactor(&reactors[i], i, port);
+#ifdef ASYNCSQL
+  addfd(reactors[0].epollfd, sql_executor::get_instance()->get_eventfd(), false);
+#endif
+
+  // 信号处理函数，关注 kill 发送的 SIGTERM 和调整日志级别的 SIGUSR1/SIGUSR2，定时由各 reactor 的 timerfd 负责
+  addsig(SIGTERM, sig_handler, false);
+  addsig(SIGUSR1, sig_handler, false);
+  addsig(SIGUSR2, sig_handler, false);
+
+  for(int i=1; i<reactor_number; ++i)
+  {
+    int ret = pthread_create(&reactors[i].tid, NULL, event_loop, &reactors[i]);
+    assert(ret == 0);
+  }
+  LOG_INFO("server start with %d reactor(s)", reactor_number);
+  event_loop(&reactors[0]);
+
+  for(int i=0; i<reactor_number; ++i)
+  {
+    if(i > 0)
+      pthread_join(reactors[i].tid, NULL);
+    close(reactors[i].epollfd);
+    close(reactors[i].listenfd);
+    close(reactors[i].pipefd[1]);
+    close(reactors[i].pipefd[0]);
+    close(reactors[i].timerfd);
   }
-  close(epollfd);
-  close(listenfd);
-  close(pipefd[1]);
-  close(pipefd[0]);
   delete[] users;
   delete[] users_timer;
   delete pool;
@@ -0,0 +1,148 @@
+//
+// Created by acg on 12/30/21.
+//
+
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <exception>
+
+// 自旋等待时让出流水线资源
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// 有界的多生产者多消费者无锁队列（Dmitry Vyukov 的环形队列）
+// 1. 容量为 2 的幂，槽在构造时一次分配，入队出队不再分配内存
+// 2. 每个槽带一个序号：等于入队位置时可写，等于入队位置 + 1 时可读，生产者和消费者只竞争各自的位置计数
+// 3. 队满时 push 失败、队空时 pop 失败，都不阻塞，休眠和唤醒由使用者（futex_event）负责
+// 4. pop_batch 一次 CAS 取走连续的多个任务，减少消费者之间的竞争
+template <typename T>
+class mpmc_queue
+{
+public:
+  explicit mpmc_queue(size_t capacity)
+  {
+    // 向上取整到 2 的幂
+    size_t size = 2;
+    while(size < capacity)
+      size <<= 1;
+    m_mask = size - 1;
+    m_cells = new cell[size];
+    for(size_t i=0; i<size; ++i)
+      m_cells[i].seq.store(i, std::memory_order_relaxed);
+    m_enqueue_pos.store(0, std::memory_order_relaxed);
+    m_dequeue_pos.store(0, std::memory_order_relaxed);
+  }
+
+  ~mpmc_queue()
+  {
+    delete[] m_cells;
+  }
+
+  mpmc_queue(const mpmc_queue&)=delete;
+  mpmc_queue& operator=(const mpmc_queue&)=delete;
+
+  bool push(const T& data)
+  {
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    cell* c;
+    while(true)
+    {
+      c = &m_cells[pos & m_mask];
+      size_t seq = c->seq.load(std::memory_order_acquire);
+      long diff = (long) seq - (long) pos;
+      if(diff == 0)
+      {
+        // 槽可写，抢占这个位置
+        if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(diff < 0)
+        return false;     // 槽还没被消费，队列已满
+      else
+        pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    }
+    c->data = data;
+    c->seq.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& data)
+  {
+    return pop_batch(&data, 1) == 1;
+  }
+
+  // 最多取出 max 个任务，返回取出的个数，队空返回 0
+  int pop_batch(T* out, int max)
+  {
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    int n;
+    while(true)
+    {
+      // 从 pos 开始数出连续可读的槽
+      n = 0;
+      while(n < max)
+      {
+        cell* c = &m_cells[(pos + n) & m_mask];
+        size_t seq = c->seq.load(std::memory_order_acquire);
+        if((long) seq - (long) (pos + n + 1) != 0)
+          break;
+        ++n;
+      }
+      if(n == 0)
+      {
+        size_t seq = m_cells[pos & m_mask].seq.load(std::memory_order_acquire);
+        if((long) seq - (long) (pos + 1) < 0)
+          return 0;       // 队列为空
+        pos = m_dequeue_pos.load(std::memory_order_relaxed);   // 被其他消费者抢先了
+        continue;
+      }
+      if(m_dequeue_pos.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+        break;
+    }
+
+    // [pos, pos + n) 已经归本线程所有，取出数据后把槽还给生产者
+    for(int i=0; i<n; ++i)
+    {
+      cell* c = &m_cells[(pos + i) & m_mask];
+      out[i] = c->data;
+      c->seq.store(pos + i + m_mask + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // 近似的元素个数，只用于统计
+  size_t size_approx()
+  {
+    size_t enq = m_enqueue_pos.load(std::memory_order_relaxed);
+    size_t deq = m_dequeue_pos.load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+  }
+
+private:
+  struct cell
+  {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  // 生产者和消费者的位置放在不同的缓存行，避免伪共享
+  char m_pad0[64];
+  cell* m_cells;
+  size_t m_mask;
+  char m_pad1[64];
+  std::atomic<size_t> m_enqueue_pos;
+  char m_pad2[64];
+  std::atomic<size_t> m_dequeue_pos;
+  char m_pad3[64];
+};
+
+#endif //MPMC_QUEUE_H
@@ -6,28 +6,85 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <deque>
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
 
 // 引用 locker 线程同步类，因为工作队列被所有线程共享
 #include "../locker/locker.h"
 #include "../CGImysql/sql_connection_pool.h"
+#include "../log/log.h"
+#include "mpmc_queue.h"
 
-template <typename T>    // T 表示任务类
+// 请求队列的实现方式
+enum pool_mode
+{
+  POOL_LIST = 0,      // 双向链表 + 互斥锁 + 信号量
+  POOL_MPMC,          // 无锁环形队列 + futex，批量出队
+  POOL_STEAL,         // 每个工作线程一个双端队列，空闲的线程从其他线程窃取
+  POOL_ELASTIC        // 链表队列，线程数在 [thread_number, max_thread_number] 之间随负载伸缩
+};
+
+// T 表示任务类，需要有 connectionRAII* db 成员和 process 方法
+// POOL_STEAL 模式还需要 std::atomic<int> worker_id 成员：上次处理它的工作线程，-1 表示还没有被处理过
+// 工作线程写、主线程读，只需要 relaxed 访问
+template <typename T>
 class threadPool
 {
 public:
-  threadPool(connection_pool *connPool, int thread_number = 8, int max_request = 10000);
+  static const int POP_BATCH = 4;       // POOL_MPMC 模式一次最多取出的任务数，取多了会让同一批的任务互相等待
+  static const int SPIN_COUNT = 64;     // POOL_MPMC 模式队列为空时休眠前自旋的次数
+  // POOL_ELASTIC 模式：没有空闲线程，并且排队的任务数或最早的任务等待时间超过阈值时增加线程
+  static const int GROW_QUEUE_DEPTH = 16;
+  static const int GROW_WAIT_MS = 50;
+  static const int GROW_INTERVAL_MS = 10;     // 两次增加线程的最小间隔，避免一次突发创建过多线程
+  static const int RETIRE_IDLE_MS = 30000;    // 超过最小线程数的线程空闲这么久后退出
+
+  // POOL_ELASTIC 模式下 thread_number 为最小线程数，max_thread_number 为最大线程数
+  threadPool(connection_pool *connPool, int thread_number = 8, int max_request = 10000, int mode = POOL_LIST,
+             int max_thread_number = 0);
   ~threadPool();
   bool append(T *request);    // 往请求队列中加入任务
+  int thread_count() { return m_live_threads.load(std::memory_order_relaxed); }   // 当前的工作线程数
+  void resize_stats(long* grows, long* shrinks)     // POOL_ELASTIC 模式累计增加和退出的线程数
+  {
+    *grows = m_grows.load(std::memory_order_relaxed);
+    *shrinks = m_shrinks.load(std::memory_order_relaxed);
+  }
+  // POOL_STEAL 模式的统计：在上次处理它的线程上执行的任务数、被其他线程窃取的任务数
+  void steal_stats(long* local_hits, long* steals);
 
 private:
   // 工作线程的运行函数，不断从请求队列中取出任务并执行
   static void* worker(void* arg);
   void run();
+  void run_mpmc();
+  void run_steal(int id);
+  T* steal(int id);           // 从其他线程的队列尾部窃取一个任务
+  bool queues_empty();        // POOL_STEAL 模式所有线程的队列是否都为空
+  void run_elastic();
+  void grow();                // 增加一个工作线程
+  void handle(T* request);    // 处理一个任务
+
+  // POOL_STEAL 模式下每个工作线程的队列
+  // 主线程从尾部放入，所属线程从头部取，窃取者从尾部取，竞争者不多，用一把小锁保护
+  struct worker_queue
+  {
+    locker lock;
+    std::deque<T*> tasks;
+    futex_event event;                  // 所属线程在这里休眠
+    std::atomic<long> local_hits;
+    std::atomic<long> steals;
+    char pad[64];                       // 不同线程的队列放在不同的缓存行
+  };
 
 private:
+  int m_mode;                   // 请求队列的实现方式，见 pool_mode
   int m_thread_number;          // 线程池中的线程数
   int m_max_requests;           // 请求队列中最大的请求数
   pthread_t *m_threads;         // 描述线程池的数组
@@ -36,15 +93,58 @@ private:
   sem m_queueStat;              // 信号量，说明是否有任务需要处理
   bool m_stop;                  // 是否结束线程
   connection_pool *m_connPool;  // 数据库连接池
+  mpmc_queue<T*>* m_ring;       // POOL_MPMC 模式的请求队列
+  futex_event m_ring_event;     // POOL_MPMC 模式的工作线程在这里休眠
+  worker_queue* m_queues;       // POOL_STEAL 模式每个工作线程的队列
+  std::atomic<int> m_next_id;   // 工作线程启动时依次领取的编号
+  std::atomic<unsigned int> m_next_target;  // 新连接轮流分配给各个工作线程
+
+  // POOL_ELASTIC 模式
+  struct elastic_task
+  {
+    T* request;
+    unsigned long long enqueue_ms;      // 入队时刻，用来计算排队时间
+  };
+  std::list<elastic_task> m_elastic_queue;  // 请求队列，由 m_queueLocker 保护
+  cond m_elastic_cond;                      // 空闲线程在这里等待
+  int m_max_thread_number;
+  int m_idle_threads;                       // 正在等待任务的线程数，由 m_queueLocker 保护
+  unsigned long long m_last_grow;           // 上次增加线程的时刻，由 m_queueLocker 保护
+  std::atomic<int> m_live_threads;          // 当前的工作线程数
+  std::atomic<long> m_grows;
+  std::atomic<long> m_shrinks;
+  std::atomic<int> m_running;               // 还没有从 run 返回的工作线程数，析构时等它归零再释放队列
+
+  static unsigned long long now_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
 };
 
 template <typename T>
-threadPool<T>::threadPool(connection_pool* connPool, int thread_number, int max_requests):
-m_thread_number(thread_number), m_max_requests(max_requests),
-m_stop(false), m_threads(NULL), m_connPool(connPool)
+threadPool<T>::threadPool(connection_pool* connPool, int thread_number, int max_requests, int mode, int max_thread_number):
+m_mode(mode), m_thread_number(thread_number), m_max_requests(max_requests),
+m_stop(false), m_threads(NULL), m_connPool(connPool), m_ring(NULL), m_queues(NULL), m_next_id(0), m_next_target(0),
+m_max_thread_number(max_thread_number), m_idle_threads(0), m_last_grow(0), m_live_threads(thread_number), m_grows(0), m_shrinks(0), m_running(0)
 {
   if((thread_number <= 0) || (max_requests <= 0))
     throw std::exception();
+  if(m_mode == POOL_ELASTIC && m_max_thread_number < m_thread_number)
+    m_max_thread_number = m_thread_number;
+
+  if(m_mode == POOL_MPMC)
+    m_ring = new mpmc_queue<T*>(max_requests);
+  if(m_mode == POOL_STEAL)
+  {
+    m_queues = new worker_queue[thread_number];
+    for(int i=0; i<thread_number; ++i)
+    {
+      m_queues[i].local_hits = 0;
+      m_queues[i].steals = 0;
+    }
+  }
 
   m_threads = new pthread_t[m_thread_number];
   if(!m_threads)
@@ -54,8 +154,10 @@ m_stop(false), m_threads(NULL), m_connPool(connPool)
   for(int i=0; i<thread_number; ++i)
   {
     // 第三个参数制定新建线程需要执行的函数
+    ++m_running;
     if(pthread_create(m_threads + i, NULL, worker, this) != 0)
     {
+      --m_running;
       delete [] m_threads;
       throw std::exception();
     }
@@ -73,11 +175,100 @@ threadPool<T>::~threadPool()
 {
   delete [] m_threads;
   m_stop = true;
+
+  // 工作线程是脱离的，不能 join：反复唤醒所有休眠的线程，直到它们都从 run 返回，再释放它们访问的队列
+  // 只唤醒一次不够，线程可能在检查 m_stop 之后、登记休眠之前错过这次唤醒
+  while(m_running > 0)
+  {
+    m_ring_event.notify_all();
+    for(int i=0; m_queues && i<m_thread_number; ++i)
+      m_queues[i].event.notify_all();
+    m_queueLocker.lock();
+    m_elastic_cond.broadcast();
+    m_queueLocker.unlock();
+    if(m_mode == POOL_LIST)
+      m_queueStat.post();
+    usleep(1000);
+  }
+  delete m_ring;
+  delete [] m_queues;
 }
 
 template <typename T>
 bool threadPool<T>::append(T * request)
 {
+  // 无锁队列：入队后只在有工作线程休眠时才唤醒
+  if(m_mode == POOL_MPMC)
+  {
+    if(!m_ring->push(request))
+      return false;
+    m_ring_event.notify();
+    return true;
+  }
+
+  // 放到上次处理该连接的线程的队列，连接的状态还在那个核的缓存中
+  if(m_mode == POOL_STEAL)
+  {
+    int id = request->worker_id.load(std::memory_order_relaxed);
+    if(id < 0 || id >= m_thread_number)
+      id = m_next_target++ % m_thread_number;
+    worker_queue* q = &m_queues[id];
+    q->lock.lock();
+    if(q->tasks.size() >= (size_t)(m_max_requests / m_thread_number + 1))
+    {
+      q->lock.unlock();
+      return false;
+    }
+    q->tasks.push_back(request);
+    q->lock.unlock();
+
+    // 所属线程在休眠则唤醒它；它正在忙，就唤醒一个休眠的线程来窃取
+    if(q->event.waiters() > 0)
+      q->event.notify();
+    else
+    {
+      for(int i=1; i<m_thread_number; ++i)
+      {
+        worker_queue* idle = &m_queues[(id + i) % m_thread_number];
+        if(idle->event.waiters() > 0)
+        {
+          idle->event.notify();
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  if(m_mode == POOL_ELASTIC)
+  {
+    unsigned long long now = now_ms();
+    bool need_grow = false;
+    m_queueLocker.lock();
+    if(m_elastic_queue.size() > (size_t) m_max_requests)
+    {
+      m_queueLocker.unlock();
+      return false;
+    }
+    elastic_task task = {request, now};
+    m_elastic_queue.push_back(task);
+
+    // 所有线程都在忙（可能阻塞在数据库上），而任务积压或者已经等了太久，增加线程
+    if(m_idle_threads == 0 && m_live_threads < m_max_thread_number && now - m_last_grow >= GROW_INTERVAL_MS &&
+       (m_elastic_queue.size() >= GROW_QUEUE_DEPTH || now - m_elastic_queue.front().enqueue_ms >= GROW_WAIT_MS))
+    {
+      need_grow = true;
+      m_last_grow = now;
+      ++m_live_threads;
+    }
+    m_elastic_cond.signal();
+    m_queueLocker.unlock();
+
+    if(need_grow)
+      grow();
+    return true;
+  }
+
   // 操作工作队列一定要加锁，因为它被所有线程共享
   m_queueLocker.lock();
   if(m_workQueue.size() > m_max_requests)
@@ -97,12 +288,29 @@ void* threadPool<T>::worker(void* arg)
 {
   threadPool* pool = (threadPool*) arg;
   pool->run();
-  return pool;
+  --pool->m_running;          // 之后不能再访问 pool，析构函数可能已经返回
+  return NULL;
 }
 
 template <typename T>
 void threadPool<T>::run()
 {
+  if(m_mode == POOL_MPMC)
+  {
+    run_mpmc();
+    return;
+  }
+  if(m_mode == POOL_STEAL)
+  {
+    run_steal(m_next_id++);
+    return;
+  }
+  if(m_mode == POOL_ELASTIC)
+  {
+    run_elastic();
+    return;
+  }
+
   while(!m_stop)
   {
     m_queueStat.wait();       // 阻塞等待 sem > 0
@@ -119,10 +327,207 @@ void threadPool<T>::run()
     if(!request)
       continue;
 
-    // 工作线程处理工作
-    connectionRAII mysqlcon(&request->mysql, m_connPool);
-    request->process();                             // 调用模板类的 process 方法，即 http 类的 process
+    handle(request);
+  }
+}
+
+template <typename T>
+void threadPool<T>::run_mpmc()
+{
+  T* batch[POP_BATCH];
+  while(!m_stop)
+  {
+    int n = m_ring->pop_batch(batch, POP_BATCH);
+
+    // 队列为空：先自旋一小会儿，仍然没有任务再休眠
+    for(int i=0; n == 0 && i < SPIN_COUNT; ++i)
+    {
+      cpu_relax();
+      n = m_ring->pop_batch(batch, POP_BATCH);
+    }
+    if(n == 0)
+    {
+      unsigned int key = m_ring_event.prepare_wait();
+      n = m_ring->pop_batch(batch, POP_BATCH);
+      if(n == 0)
+      {
+        m_ring_event.wait(key);
+        continue;
+      }
+      m_ring_event.cancel_wait();
+    }
+
+    // 本线程处理这一批时，队列中还有任务则唤醒一个同伴
+    if(m_ring->size_approx() > 0)
+      m_ring_event.notify();
+
+    for(int i=0; i<n; ++i)
+    {
+      if(batch[i])
+        handle(batch[i]);
+    }
+  }
+}
+
+template <typename T>
+T* threadPool<T>::steal(int id)
+{
+  for(int i=1; i<m_thread_number; ++i)
+  {
+    worker_queue* q = &m_queues[(id + i) % m_thread_number];
+    q->lock.lock();
+    if(!q->tasks.empty())
+    {
+      T* request = q->tasks.back();
+      q->tasks.pop_back();
+      q->lock.unlock();
+      return request;
+    }
+    q->lock.unlock();
+  }
+  return NULL;
+}
+
+template <typename T>
+void threadPool<T>::run_steal(int id)
+{
+  worker_queue* self = &m_queues[id];
+  int spin = 0;
+  while(!m_stop)
+  {
+    // 先取自己队列头部的任务，没有再去窃取
+    self->lock.lock();
+    T* request = NULL;
+    if(!self->tasks.empty())
+    {
+      request = self->tasks.front();
+      self->tasks.pop_front();
+    }
+    self->lock.unlock();
+
+    if(request)
+      ++self->local_hits;
+    else if((request = steal(id)) != NULL)
+      ++self->steals;
+
+    if(request)
+    {
+      spin = 0;
+      request->worker_id.store(id, std::memory_order_relaxed);
+      handle(request);
+      continue;
+    }
+
+    // 都没有任务：自旋几轮后休眠，登记之后再检查一次所有线程的队列，避免错过唤醒
+    // 只检查自己的不够：登记之前主线程放到忙碌线程队列中的任务，看不到休眠者，不会唤醒任何线程
+    if(spin++ < SPIN_COUNT)
+    {
+      cpu_relax();
+      continue;
+    }
+    spin = 0;
+    unsigned int key = self->event.prepare_wait();
+    if(queues_empty())
+      self->event.wait(key);
+    else
+      self->event.cancel_wait();
+  }
+}
+
+template <typename T>
+bool threadPool<T>::queues_empty()
+{
+  for(int i=0; i<m_thread_number; ++i)
+  {
+    worker_queue* q = &m_queues[i];
+    q->lock.lock();
+    bool empty = q->tasks.empty();
+    q->lock.unlock();
+    if(!empty)
+      return false;
+  }
+  return true;
+}
+
+template <typename T>
+void threadPool<T>::steal_stats(long* local_hits, long* steals)
+{
+  *local_hits = 0;
+  *steals = 0;
+  for(int i=0; m_queues && i<m_thread_number; ++i)
+  {
+    *local_hits += m_queues[i].local_hits.load(std::memory_order_relaxed);
+    *steals += m_queues[i].steals.load(std::memory_order_relaxed);
+  }
+}
+
+// 调用者已经把 m_live_threads 加 1
+template <typename T>
+void threadPool<T>::grow()
+{
+  pthread_t tid;
+  ++m_running;
+  if(pthread_create(&tid, NULL, worker, this) != 0)
+  {
+    --m_running;
+    --m_live_threads;
+    LOG_ERROR("thread pool grow failed:%d", errno);
+    return;
   }
+  pthread_detach(tid);
+  ++m_grows;
+  LOG_INFO("thread pool grow to %d threads", (int) m_live_threads);
+}
+
+template <typename T>
+void threadPool<T>::run_elastic()
+{
+  while(!m_stop)
+  {
+    m_queueLocker.lock();
+    bool retire = false;
+    while(m_elastic_queue.empty() && !m_stop)
+    {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += RETIRE_IDLE_MS / 1000;
+      ++m_idle_threads;
+      bool signaled = m_elastic_cond.timeWait(m_queueLocker.get(), deadline);
+      --m_idle_threads;
+      // 空闲超时并且线程数多于最小值，本线程退出
+      if(!signaled && m_elastic_queue.empty() && m_live_threads > m_thread_number)
+      {
+        --m_live_threads;
+        ++m_shrinks;
+        retire = true;
+        break;
+      }
+    }
+    if(retire || m_stop)
+    {
+      m_queueLocker.unlock();
+      if(retire)
+        LOG_INFO("thread pool shrink to %d threads", (int) m_live_threads);
+      return;
+    }
+
+    T* request = m_elastic_queue.front().request;
+    m_elastic_queue.pop_front();
+    m_queueLocker.unlock();
+    if(request)
+      handle(request);
+  }
+}
+
+template <typename T>
+void threadPool<T>::handle(T* request)
+{
+  // 工作线程处理工作
+  // 数据库连接在任务第一次访问数据库时才从连接池获取（db->get()），静态请求不经过连接池
+  // 任务处理完后可能立即被其他工作线程取走，db 只在 process 期间有效，返回后不再访问 request
+  connectionRAII mysqlcon(m_connPool);
+  request->db = &mysqlcon;
+  request->process();                             // 调用模板类的 process 方法，即 http 类的 process
 }
 
 
@@ -3,7 +3,6 @@
 //
 
 #include "time_heap.h"
-#include "../log/log.h"
 
 time_heap::time_heap() = default;
 
@@ -34,9 +33,6 @@ void time_heap::tick()
   auto curr = time(NULL);
   while(!timer_pqueue.empty())
   {
-    LOG_INFO("%s", "timer tick");
-    Log::get_instance()->flush();
-
     // 让堆顶元素和当前时间对比
     auto timer = timer_pqueue.top();
     // 没超时
@@ -46,6 +42,7 @@ void time_heap::tick()
     if(timer->cb_func)
       timer->cb_func(timer->user_data);
     timer_pqueue.pop();
+    delete timer;
   }
 }
 
@@ -3,17 +3,8 @@
 #include <queue>
 #include <time.h>
 
-#define BUFFER_SIZE 64
-
-class heap_timer;
-
-struct client_data
-{
-  sockaddr_in address;
-  int sockfd;
-  char buf[BUFFER_SIZE];
-  heap_timer* timer;
-};
+// 服务器已改用 time_wheel，时间堆只保留用于对比测试
+struct client_data;
 
 class heap_timer
 {
@@ -0,0 +1,192 @@
+//
+// Created by acg on 12/29/21.
+//
+
+#include <time.h>
+
+#include "time_wheel.h"
+
+time_wheel::time_wheel(int max_expire)
+{
+  for(int i=0; i<ROOT_SIZE; ++i)
+    list_init(&m_root[i]);
+  for(int l=0; l<LEVEL_NUMBER; ++l)
+    for(int i=0; i<LEVEL_SIZE; ++i)
+      list_init(&m_levels[l][i]);
+  m_current = now_ms() / TICK_MS;
+  m_max_expire = max_expire;
+  m_count = 0;
+  m_free = NULL;
+}
+
+time_wheel::~time_wheel()
+{
+  for(size_t i=0; i<m_chunks.size(); ++i)
+    delete[] m_chunks[i];
+}
+
+unsigned long long time_wheel::now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void time_wheel::list_add(tw_timer* head, tw_timer* timer)
+{
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+void time_wheel::list_del(tw_timer* timer)
+{
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+tw_timer* time_wheel::alloc_node()
+{
+  if(!m_free)
+  {
+    tw_timer* chunk = new tw_timer[NODE_CHUNK];
+    m_chunks.push_back(chunk);
+    for(int i=0; i<NODE_CHUNK; ++i)
+    {
+      chunk[i].next = m_free;
+      m_free = &chunk[i];
+    }
+  }
+  tw_timer* timer = m_free;
+  m_free = timer->next;
+  return timer;
+}
+
+void time_wheel::free_node(tw_timer* timer)
+{
+  timer->cb_func = NULL;
+  timer->user_data = NULL;
+  timer->next = m_free;
+  m_free = timer;
+}
+
+void time_wheel::insert(tw_timer* timer)
+{
+  unsigned long long expire = timer->expire;
+  // 已经超时的挂在当前槽，下一次 tick 时处理
+  if(expire < m_current)
+    expire = m_current;
+
+  unsigned long long idx = expire - m_current;
+  if(idx < ROOT_SIZE)
+  {
+    list_add(&m_root[expire & (ROOT_SIZE - 1)], timer);
+    return;
+  }
+
+  for(int l=0; l<LEVEL_NUMBER; ++l)
+  {
+    int shift = ROOT_BITS + l * LEVEL_BITS;
+    if(idx < (1ULL << (shift + LEVEL_BITS)))
+    {
+      list_add(&m_levels[l][(expire >> shift) & (LEVEL_SIZE - 1)], timer);
+      return;
+    }
+  }
+
+  // 超出时间轮的范围，先放在最远的槽，级联下来时会重新计算位置
+  int shift = ROOT_BITS + (LEVEL_NUMBER - 1) * LEVEL_BITS;
+  expire = m_current + (1ULL << (shift + LEVEL_BITS)) - 1;
+  list_add(&m_levels[LEVEL_NUMBER - 1][(expire >> shift) & (LEVEL_SIZE - 1)], timer);
+}
+
+void time_wheel::cascade(int level, int index)
+{
+  tw_timer* head = &m_levels[level][index];
+  if(list_empty(head))
+    return;
+
+  // 先把整条链表摘下来，再逐个重新插入，插入时可能又落回同一层的其他槽
+  tw_timer* timer = head->next;
+  head->prev->next = NULL;
+  list_init(head);
+  while(timer)
+  {
+    tw_timer* next = timer->next;
+    insert(timer);
+    timer = next;
+  }
+}
+
+tw_timer* time_wheel::add_timer(int timeout_ms, void (*cb_func)(client_data *), client_data* user_data)
+{
+  tw_timer* timer = alloc_node();
+  timer->cb_func = cb_func;
+  timer->user_data = user_data;
+  // 向上取整，保证不会早于 timeout_ms 超时
+  timer->expire = (now_ms() + timeout_ms + TICK_MS - 1) / TICK_MS;
+  insert(timer);
+  ++m_count;
+  return timer;
+}
+
+void time_wheel::adjust_timer(tw_timer* timer, int timeout_ms)
+{
+  if(!timer)  return;
+  list_del(timer);
+  timer->expire = (now_ms() + timeout_ms + TICK_MS - 1) / TICK_MS;
+  insert(timer);
+}
+
+void time_wheel::del_timer(tw_timer* timer)
+{
+  if(!timer)  return;
+  list_del(timer);
+  free_node(timer);
+  --m_count;
+}
+
+bool time_wheel::tick()
+{
+  unsigned long long target = now_ms() / TICK_MS;
+  int expired = 0;
+
+  while(true)
+  {
+    // 处理当前槽：槽中的定时器都已经到期
+    tw_timer* head = &m_root[m_current & (ROOT_SIZE - 1)];
+    while(!list_empty(head))
+    {
+      // 本次处理的数量已达上限，停在当前槽，下次从这里继续
+      if(expired >= m_max_expire)
+        return true;
+
+      tw_timer* timer = head->next;
+      list_del(timer);
+      --m_count;
+      ++expired;
+      if(timer->cb_func)
+        timer->cb_func(timer->user_data);
+      free_node(timer);
+    }
+
+    if(m_current >= target)
+      break;
+
+    // 转到下一个滴答，第 0 层转完一圈时从上层级联，上层也转完一圈时继续往上
+    ++m_current;
+    if((m_current & (ROOT_SIZE - 1)) == 0)
+    {
+      for(int l=0; l<LEVEL_NUMBER; ++l)
+      {
+        int index = (m_current >> (ROOT_BITS + l * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+        cascade(l, index);
+        if(index != 0)
+          break;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,91 @@
+//
+// Created by acg on 12/29/21.
+//
+
+#ifndef XLAOTINYWEBSERVER_TIME_WHEEL_H
+#define XLAOTINYWEBSERVER_TIME_WHEEL_H
+
+#include <netinet/in.h>
+#include <vector>
+
+class tw_timer;
+
+struct client_data
+{
+  sockaddr_in address;
+  int sockfd;
+  int epollfd;          // 连接所属 reactor 的内核事件表
+  tw_timer* timer;      // 连接的定时器，已经超时或删除时为 NULL
+};
+
+// 时间轮上的定时器，通过 prev/next 挂在某个槽的双向链表上
+class tw_timer
+{
+public:
+  unsigned long long expire;              // 超时的时刻，单位是时间轮的滴答
+  void (*cb_func)(client_data *);
+  client_data* user_data;
+  tw_timer* prev;
+  tw_timer* next;
+};
+
+// 分层时间轮
+// 1. 第 0 层 256 个槽，每槽一个滴答（TICK_MS 毫秒）；往上 4 层各 64 个槽，每层一个槽等于下一层转一圈
+//    五层一共覆盖 2^32 个滴答，超出范围的定时器放在最高层的最后一个槽
+// 2. 每个槽是带哨兵的双向链表，添加、调整、删除都是 O(1)
+// 3. 第 0 层转完一圈时，把上一层对应槽的定时器重新分散到下层（级联）
+// 4. 定时器节点从时间轮自己的空闲链表中分配，不会随着连接的建立和关闭反复 new/delete
+// 5. 一次 tick 最多处理 max_expire 个超时的定时器，剩下的留给下一次，避免大量连接同时超时时卡住事件循环
+// 时间轮不加锁，只能在所属 reactor 的线程中使用
+class time_wheel
+{
+public:
+  static const int TICK_MS = 10;                  // 一个滴答的毫秒数
+  static const int ROOT_BITS = 8;
+  static const int LEVEL_BITS = 6;
+  static const int ROOT_SIZE = 1 << ROOT_BITS;    // 第 0 层的槽数
+  static const int LEVEL_SIZE = 1 << LEVEL_BITS;  // 其他每层的槽数
+  static const int LEVEL_NUMBER = 4;              // 第 0 层之外的层数
+  static const int NODE_CHUNK = 1024;             // 空闲链表为空时一次分配的节点数
+
+  explicit time_wheel(int max_expire = 1024);
+  ~time_wheel();
+
+  time_wheel(const time_wheel&)=delete;
+  time_wheel& operator=(const time_wheel&)=delete;
+
+public:
+  // 添加一个 timeout_ms 毫秒后超时的定时器
+  tw_timer* add_timer(int timeout_ms, void (*cb_func)(client_data *), client_data* user_data);
+  void adjust_timer(tw_timer* timer, int timeout_ms);   // 重新设置为 timeout_ms 毫秒后超时
+  void del_timer(tw_timer* timer);                      // 删除定时器，节点回到空闲链表
+  // 处理到当前时刻为止所有超时的定时器，定时器的回调执行后节点即被回收
+  // 返回 true 表示超时的定时器超过了 max_expire，还有没处理完的
+  bool tick();
+  size_t size() { return m_count; }
+
+  static unsigned long long now_ms();           // 单调时钟的毫秒数
+
+private:
+  void insert(tw_timer* timer);                 // 按超时时刻挂到对应的槽
+  void cascade(int level, int index);           // 把上层的一个槽重新分散到下层
+  tw_timer* alloc_node();
+  void free_node(tw_timer* timer);
+
+  static void list_init(tw_timer* head) { head->prev = head->next = head; }
+  static bool list_empty(tw_timer* head) { return head->next == head; }
+  static void list_add(tw_timer* head, tw_timer* timer);
+  static void list_del(tw_timer* timer);
+
+private:
+  tw_timer m_root[ROOT_SIZE];                   // 第 0 层，下标为超时滴答的低 8 位
+  tw_timer m_levels[LEVEL_NUMBER][LEVEL_SIZE];  // 第 1 ~ 4 层
+  unsigned long long m_current;                 // 时间轮当前转到的滴答，小于它的都已经处理完
+  int m_max_expire;
+  size_t m_count;                               // 时间轮上的定时器个数
+
+  tw_timer* m_free;                             // 节点的空闲链表，用 next 串起来
+  std::vector<tw_timer*> m_chunks;              // 批量分配的节点，析构时统一释放
+};
+
+#endif //XLAOTINYWEBSERVER_TIME_WHEEL_H